@@ -0,0 +1,95 @@
+#define _DEFAULT_SOURCE // For MAP_ANONYMOUS
+#include "arena.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define ARENA_ALIGNMENT 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGNMENT - 1) & \
+                    ~(size_t) (ARENA_ALIGNMENT - 1))
+
+
+static ArenaBlock *new_block(Arena *arena, size_t needed)
+{
+    size_t size = arena->next_block_size ?
+                  arena->next_block_size : ARENA_MIN_BLOCK_SIZE;
+    needed += ALIGN_UP(sizeof(ArenaBlock));
+    while (size < needed) {
+        size *= 2;
+    }
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    ArenaBlock *block = memory;
+    block->size = size;
+    block->used = ALIGN_UP(sizeof(ArenaBlock));
+    block->next = arena->blocks;
+    arena->blocks = block;
+    if (size < ARENA_MAX_BLOCK_SIZE) {
+        arena->next_block_size = size * 2;
+    }
+    return block;
+}
+
+
+static void *arena_bump(Arena *arena, size_t size, size_t alignment)
+{
+    ArenaBlock *block = arena->blocks;
+    size_t start = 0;
+    if (block != NULL) {
+        start = (block->used + alignment - 1) & ~(alignment - 1);
+    }
+    if (block == NULL || start > block->size || block->size - start < size) {
+        block = new_block(arena, size);
+        if (block == NULL) {
+            return NULL;
+        }
+        start = block->used;
+    }
+    block->used = start + size;
+    return (char *) block + start;
+}
+
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    return arena_bump(arena, size ? size : 1, ARENA_ALIGNMENT);
+}
+
+
+void *arena_calloc(Arena *arena, size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    // Blocks come zeroed from mmap() and their memory is never handed out
+    // twice, so there is nothing to clear
+    return arena_alloc(arena, count * size);
+}
+
+
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+{
+    // Strings need no alignment, so words are packed back to back
+    char *copy = arena_bump(arena, len + 1, 1);
+    if (copy) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+
+void arena_release(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        munmap(block, block->size);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->next_block_size = 0;
+}
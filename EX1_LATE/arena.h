@@ -0,0 +1,47 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_MIN_BLOCK_SIZE (1 << 20)
+#define ARENA_MAX_BLOCK_SIZE (64 << 20)
+
+// A block of memory taken from mmap(), allocations are bumped from it
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size; // whole block, including this header
+    size_t used;
+} ArenaBlock;
+
+// Bump allocator: objects are never freed one by one, all the blocks are
+// released together. Blocks double in size up to ARENA_MAX_BLOCK_SIZE, so
+// even a huge chain takes a handful of munmap() calls to release.
+typedef struct Arena {
+    ArenaBlock *blocks; // the newest block first
+    size_t next_block_size;
+} Arena;
+
+/**
+ * Allocate size bytes, aligned for any object.
+ * @return the memory, NULL in case of allocation failure.
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * Allocate zeroed memory for count objects of the given size.
+ * @return the memory, NULL in case of allocation failure.
+ */
+void *arena_calloc(Arena *arena, size_t count, size_t size);
+
+/**
+ * Copy len bytes of str to a null terminated string in the arena.
+ * @return the copy, NULL in case of allocation failure.
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+
+/**
+ * Release all the memory of the arena. The arena can be used again.
+ */
+void arena_release(Arena *arena);
+
+#endif /* _ARENA_H_ */
@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // For madvise()
+#include "corpus_tokenizer.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define READ_CHUNK_SIZE (1 << 16)
+
+
+// Fallback for files that can't be mapped: read everything to the heap
+static int read_corpus(FILE *fp, Corpus *corpus)
+{
+    size_t capacity = READ_CHUNK_SIZE, used = 0;
+    char *text = malloc(capacity);
+    while (text) {
+        used += fread(text + used, 1, capacity - used, fp);
+        if (used < capacity) {
+            break;
+        }
+        char *bigger = realloc(text, capacity * 2);
+        if (!bigger) {
+            free(text);
+            return 1;
+        }
+        text = bigger;
+        capacity *= 2;
+    }
+    if (!text || ferror(fp)) {
+        free(text);
+        return 1;
+    }
+    if (used == 0) {
+        free(text);
+        *corpus = (Corpus) {"", 0, 0};
+        return 0;
+    }
+    *corpus = (Corpus) {text, used, 0};
+    return 0;
+}
+
+
+int open_corpus(FILE *fp, Corpus *corpus)
+{
+    struct stat st;
+    int fd = fileno(fp);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return read_corpus(fp, corpus);
+    }
+    if (st.st_size == 0) {
+        *corpus = (Corpus) {"", 0, 0};
+        return 0;
+    }
+    void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return read_corpus(fp, corpus);
+    }
+    madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+    *corpus = (Corpus) {data, (size_t) st.st_size, 1};
+    return 0;
+}
+
+
+void close_corpus(Corpus *corpus)
+{
+    if (corpus->mapped) {
+        munmap((void *) corpus->data, corpus->size);
+    } else if (corpus->size > 0) {
+        free((void *) corpus->data);
+    }
+    corpus->data = NULL;
+    corpus->size = 0;
+}
+
+
+int is_delimiter(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+
+#ifdef __SSE2__
+// Bit i of the result is set if p[i] is a delimiter, for 16 bytes
+static unsigned delimiter_mask(const char *p)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *) p);
+    __m128i found = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))),
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')),
+                         _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r'))));
+    return (unsigned) _mm_movemask_epi8(found);
+}
+#endif
+
+
+const char *find_delimiter(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    while (end - p >= 16) {
+        unsigned mask = delimiter_mask(p);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && !is_delimiter(*p)) {
+        p++;
+    }
+    return p;
+}
+
+
+const char *skip_delimiters(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    while (end - p >= 16) {
+        unsigned mask = ~delimiter_mask(p) & 0xffffu;
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && is_delimiter(*p)) {
+        p++;
+    }
+    return p;
+}
+
+
+void init_tokenizer(Tokenizer *tokenizer, const char *start, const char *end)
+{
+    tokenizer->pos = start;
+    tokenizer->end = end;
+}
+
+
+int next_token(Tokenizer *tokenizer, TokenSpan *token)
+{
+    const char *start = skip_delimiters(tokenizer->pos, tokenizer->end);
+    if (start == tokenizer->end) {
+        tokenizer->pos = start;
+        return 0;
+    }
+    const char *stop = find_delimiter(start, tokenizer->end);
+    token->start = start;
+    token->len = (size_t) (stop - start);
+    tokenizer->pos = stop;
+    return 1;
+}
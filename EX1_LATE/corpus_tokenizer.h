@@ -0,0 +1,73 @@
+#ifndef _CORPUS_TOKENIZER_H_
+#define _CORPUS_TOKENIZER_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define DELIMITERS " \n\t\r"
+
+// A corpus file mapped to memory (or read to memory when it can't be mapped,
+// e.g. a pipe)
+typedef struct Corpus {
+    const char *data;
+    size_t size;
+    int mapped; // 1 if data was mmap()ed, 0 if it was malloc()ed
+} Corpus;
+
+// A word inside the corpus. It is not null terminated.
+typedef struct TokenSpan {
+    const char *start;
+    size_t len;
+} TokenSpan;
+
+typedef struct Tokenizer {
+    const char *pos;
+    const char *end;
+} Tokenizer;
+
+/**
+ * Map the whole corpus file to memory.
+ * @param fp the corpus file
+ * @param corpus the corpus to fill
+ * @return 0 on success, 1 in case of read or allocation error.
+ */
+int open_corpus(FILE *fp, Corpus *corpus);
+
+/**
+ * Unmap (or free) the corpus data.
+ * @param corpus the corpus to release
+ */
+void close_corpus(Corpus *corpus);
+
+/**
+ * Check if c is one of the DELIMITERS.
+ */
+int is_delimiter(char c);
+
+/**
+ * Find the first delimiter in [p, end).
+ * @return pointer to the delimiter, end if there is none.
+ */
+const char *find_delimiter(const char *p, const char *end);
+
+/**
+ * Find the first character in [p, end) which is not a delimiter.
+ * @return pointer to the character, end if there is none.
+ */
+const char *skip_delimiters(const char *p, const char *end);
+
+/**
+ * Start tokenizing the words in [start, end).
+ */
+void init_tokenizer(Tokenizer *tokenizer, const char *start, const char *end);
+
+/**
+ * Get the next word. Words point into the tokenized buffer, nothing is
+ * copied.
+ * @param tokenizer
+ * @param token filled with the next word
+ * @return 1 if a word was found, 0 at the end of the buffer.
+ */
+int next_token(Tokenizer *tokenizer, TokenSpan *token);
+
+#endif /* _CORPUS_TOKENIZER_H_ */
@@ -0,0 +1,474 @@
+#define _POSIX_C_SOURCE 200809L
+#include "markov_builder.h"
+#include "corpus_tokenizer.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h> // For sysconf()
+
+#define TABLE_INITIAL_CAPACITY 1024
+
+// A word seen by one thread, pointing into the mapped corpus (not copied)
+typedef struct LocalWord {
+    const char *word;
+    uint32_t len;
+    uint64_t hash;
+} LocalWord;
+
+// Occurrences of the transition first -> second
+typedef struct Bigram {
+    uint32_t first;
+    uint32_t second;
+    int count;
+} Bigram;
+
+// Words and bigrams are kept in arrays in order of first appearance (so the
+// merged chain keeps the order of the sequential build), and found through
+// open addressing tables holding index + 1 (0 is an empty slot).
+typedef struct ShardCounts {
+    LocalWord *words;
+    size_t num_words, words_capacity;
+    uint32_t *word_slots;
+    size_t word_slots_capacity;
+
+    Bigram *bigrams;
+    size_t num_bigrams, bigrams_capacity;
+    uint32_t *bigram_slots;
+    size_t bigram_slots_capacity;
+} ShardCounts;
+
+typedef struct Shard {
+    const char *start;
+    const char *end;
+    ShardCounts counts;
+    int failed;
+
+    // Only recorded for chains of order > 1: the local ids of the chunk's
+    // words (with SENTENCE_END_FLAG on sentence enders), their ids in the
+    // chain once merged, and the states counted from them
+    int order;
+    uint32_t *sequence;
+    size_t sequence_len, sequence_capacity;
+    uint32_t *global_ids;
+    NgramCounts ngrams;
+} Shard;
+
+
+static uint64_t hash_pair(uint32_t first, uint32_t second)
+{
+    uint64_t key = ((uint64_t) first << 32) | second;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+
+static int grow_array(void **array, size_t *capacity, size_t element_size)
+{
+    size_t new_capacity = *capacity ? *capacity * 2 : TABLE_INITIAL_CAPACITY;
+    void *bigger = realloc(*array, new_capacity * element_size);
+    if (!bigger) {
+        return 1;
+    }
+    *array = bigger;
+    *capacity = new_capacity;
+    return 0;
+}
+
+
+static uint32_t *find_word_slot(ShardCounts *counts, const char *word,
+                                uint32_t len, uint64_t hash)
+{
+    size_t mask = counts->word_slots_capacity - 1;
+    size_t i = (size_t) hash & mask;
+    while (counts->word_slots[i] != 0) {
+        LocalWord *local = &counts->words[counts->word_slots[i] - 1];
+        if (local->hash == hash && local->len == len &&
+            memcmp(local->word, word, len) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &counts->word_slots[i];
+}
+
+
+static uint32_t *find_bigram_slot(ShardCounts *counts, uint32_t first,
+                                  uint32_t second)
+{
+    size_t mask = counts->bigram_slots_capacity - 1;
+    size_t i = (size_t) hash_pair(first, second) & mask;
+    while (counts->bigram_slots[i] != 0) {
+        Bigram *bigram = &counts->bigrams[counts->bigram_slots[i] - 1];
+        if (bigram->first == first && bigram->second == second) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &counts->bigram_slots[i];
+}
+
+
+static int rehash_words(ShardCounts *counts)
+{
+    size_t capacity = counts->word_slots_capacity ?
+                      counts->word_slots_capacity * 2 : TABLE_INITIAL_CAPACITY;
+    free(counts->word_slots);
+    counts->word_slots = calloc(capacity, sizeof(uint32_t));
+    if (!counts->word_slots) {
+        return 1;
+    }
+    counts->word_slots_capacity = capacity;
+    for (size_t i = 0; i < counts->num_words; i++) {
+        LocalWord *local = &counts->words[i];
+        *find_word_slot(counts, local->word, local->len, local->hash) =
+                (uint32_t) i + 1;
+    }
+    return 0;
+}
+
+
+static int rehash_bigrams(ShardCounts *counts)
+{
+    size_t capacity = counts->bigram_slots_capacity ?
+                      counts->bigram_slots_capacity * 2 :
+                      TABLE_INITIAL_CAPACITY;
+    free(counts->bigram_slots);
+    counts->bigram_slots = calloc(capacity, sizeof(uint32_t));
+    if (!counts->bigram_slots) {
+        return 1;
+    }
+    counts->bigram_slots_capacity = capacity;
+    for (size_t i = 0; i < counts->num_bigrams; i++) {
+        Bigram *bigram = &counts->bigrams[i];
+        *find_bigram_slot(counts, bigram->first, bigram->second) =
+                (uint32_t) i + 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Get the local id of the word, adding it to the shard if it is new.
+ * @return the id, or -1 in case of allocation error
+ */
+static int64_t intern_word(ShardCounts *counts, const char *word, uint32_t len)
+{
+    if ((counts->num_words + 1) * 2 > counts->word_slots_capacity &&
+        rehash_words(counts) != 0) {
+        return -1;
+    }
+    uint64_t hash = hash_word(word, len);
+    uint32_t *slot = find_word_slot(counts, word, len, hash);
+    if (*slot != 0) {
+        return *slot - 1;
+    }
+    if (counts->num_words == counts->words_capacity &&
+        grow_array((void **) &counts->words, &counts->words_capacity,
+                   sizeof(LocalWord)) != 0) {
+        return -1;
+    }
+    counts->words[counts->num_words] = (LocalWord) {word, len, hash};
+    *slot = (uint32_t) ++counts->num_words;
+    return *slot - 1;
+}
+
+
+static int count_bigram(ShardCounts *counts, uint32_t first, uint32_t second,
+                        int count)
+{
+    if ((counts->num_bigrams + 1) * 2 > counts->bigram_slots_capacity &&
+        rehash_bigrams(counts) != 0) {
+        return 1;
+    }
+    uint32_t *slot = find_bigram_slot(counts, first, second);
+    if (*slot != 0) {
+        counts->bigrams[*slot - 1].count += count;
+        return 0;
+    }
+    if (counts->num_bigrams == counts->bigrams_capacity &&
+        grow_array((void **) &counts->bigrams, &counts->bigrams_capacity,
+                   sizeof(Bigram)) != 0) {
+        return 1;
+    }
+    counts->bigrams[counts->num_bigrams] = (Bigram) {first, second, count};
+    *slot = (uint32_t) ++counts->num_bigrams;
+    return 0;
+}
+
+
+static void free_counts(ShardCounts *counts)
+{
+    free(counts->words);
+    free(counts->word_slots);
+    free(counts->bigrams);
+    free(counts->bigram_slots);
+}
+
+
+static void free_shard(Shard *shard)
+{
+    free_counts(&shard->counts);
+    free(shard->sequence);
+    free(shard->global_ids);
+    free_ngram_counts(&shard->ngrams);
+}
+
+
+// Thread routine: count the words and transitions of one chunk
+static void *count_shard(void *arg)
+{
+    Shard *shard = arg;
+    Tokenizer tokenizer;
+    TokenSpan token;
+    int64_t prev = -1;
+    int prev_ends_sentence = 0;
+
+    init_tokenizer(&tokenizer, shard->start, shard->end);
+    while (next_token(&tokenizer, &token)) {
+        int64_t id = intern_word(&shard->counts, token.start,
+                                 (uint32_t) token.len);
+        if (id < 0) {
+            shard->failed = 1;
+            return NULL;
+        }
+        // Nothing follows a word that ends a sentence
+        if (prev >= 0 && !prev_ends_sentence &&
+            count_bigram(&shard->counts, (uint32_t) prev, (uint32_t) id,
+                         1) != 0) {
+            shard->failed = 1;
+            return NULL;
+        }
+        prev = id;
+        prev_ends_sentence = token.start[token.len - 1] == '.';
+
+        if (shard->order > 1) {
+            if (shard->sequence_len == shard->sequence_capacity &&
+                grow_array((void **) &shard->sequence,
+                           &shard->sequence_capacity, sizeof(uint32_t)) != 0) {
+                shard->failed = 1;
+                return NULL;
+            }
+            shard->sequence[shard->sequence_len++] =
+                    (uint32_t) id | (prev_ends_sentence ? SENTENCE_END_FLAG : 0);
+        }
+    }
+    return NULL;
+}
+
+
+// Thread routine: count the states of 2..order words of one chunk, once its
+// words have their ids in the chain
+static void *count_shard_ngrams(void *arg)
+{
+    Shard *shard = arg;
+    uint32_t history[MAX_MARKOV_ORDER];
+    int len = 0;
+
+    for (size_t i = 0; i < shard->sequence_len; i++) {
+        uint32_t id = shard->global_ids[shard->sequence[i] & ~SENTENCE_END_FLAG];
+        if (count_ngram_states(&shard->ngrams, history, len, id,
+                               shard->order) != 0) {
+            shard->failed = 1;
+            return NULL;
+        }
+        if (shard->sequence[i] & SENTENCE_END_FLAG) {
+            len = 0;
+        } else if (len < shard->order) {
+            history[len++] = id;
+        } else {
+            memmove(history, history + 1, (len - 1) * sizeof(uint32_t));
+            history[len - 1] = id;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Find the first sentence boundary at or after from: the position right
+ * after a word ending with '.' and the delimiter following it.
+ */
+static const char *next_sentence_boundary(const char *from, const char *begin,
+                                          const char *end)
+{
+    for (const char *p = find_delimiter(from, end); p < end;
+         p = find_delimiter(p + 1, end)) {
+        if (p > begin && p[-1] == '.') {
+            return p + 1;
+        }
+    }
+    return end;
+}
+
+
+static int online_cpus(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int) cpus : 1;
+}
+
+
+/**
+ * Merge the per-thread counts into the chain, in the order of the shards.
+ * Transitions are first merged by global word id so every frequency node is
+ * appended once, instead of searching the frequency lists per shard.
+ */
+static int merge_shards(Shard *shards, int num_shards,
+                        MarkovChain *markov_chain)
+{
+    ShardCounts global = {0};
+    int result = 0;
+
+    for (int s = 0; s < num_shards && result == 0; s++) {
+        ShardCounts *counts = &shards[s].counts;
+        uint32_t *global_ids = malloc((counts->num_words + 1) *
+                                      sizeof(uint32_t));
+        if (!global_ids) {
+            result = 1;
+            break;
+        }
+        shards[s].global_ids = global_ids;
+        for (size_t i = 0; i < counts->num_words; i++) {
+            Node *node = add_span_to_database(markov_chain,
+                                              counts->words[i].word,
+                                              counts->words[i].len);
+            if (!node) {
+                result = 1;
+                break;
+            }
+            global_ids[i] = (uint32_t) node->data->id;
+        }
+        for (size_t i = 0; i < counts->num_bigrams && result == 0; i++) {
+            Bigram *bigram = &counts->bigrams[i];
+            result = count_bigram(&global, global_ids[bigram->first],
+                                  global_ids[bigram->second], bigram->count);
+        }
+    }
+
+    MarkovNode **nodes = markov_chain->nodes;
+    MarkovNodeFrequency **tails = calloc(markov_chain->database->size + 1,
+                                         sizeof(MarkovNodeFrequency *));
+    if (result != 0 || !tails) {
+        free(tails);
+        free_counts(&global);
+        return 1;
+    }
+
+    for (size_t b = 0; b < global.num_bigrams; b++) {
+        Bigram *bigram = &global.bigrams[b];
+        MarkovNode *first = nodes[bigram->first];
+        MarkovNodeFrequency *frequency = arena_alloc(
+                &markov_chain->arena, sizeof(MarkovNodeFrequency));
+        if (!frequency) {
+            result = 1;
+            break;
+        }
+        *frequency = (MarkovNodeFrequency) {nodes[bigram->second],
+                                            bigram->count, NULL};
+        if (tails[bigram->first]) {
+            tails[bigram->first]->next = frequency;
+        } else {
+            first->frequency_list = frequency;
+        }
+        tails[bigram->first] = frequency;
+        first->total_frequency += bigram->count;
+    }
+
+    free(tails);
+    free_counts(&global);
+    return result;
+}
+
+
+// Run routine on every shard in its own thread and wait for all of them
+static int run_shards(void *(*routine)(void *), Shard *shards, int num_shards)
+{
+    pthread_t threads[MAX_BUILDER_THREADS];
+    int started = 0, result = 0;
+    for (; started < num_shards; started++) {
+        if (pthread_create(&threads[started], NULL, routine,
+                           &shards[started]) != 0) {
+            result = 1;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        result |= shards[i].failed;
+    }
+    return result;
+}
+
+
+// Count the states of every shard in parallel and build the chain's model
+static int build_ngrams(Shard *shards, int num_shards,
+                        MarkovChain *markov_chain)
+{
+    if (run_shards(count_shard_ngrams, shards, num_shards) != 0) {
+        return 1;
+    }
+    for (int i = 1; i < num_shards; i++) {
+        if (merge_ngram_counts(&shards[0].ngrams, &shards[i].ngrams) != 0) {
+            return 1;
+        }
+        free_ngram_counts(&shards[i].ngrams);
+    }
+    return build_ngram_model(&shards[0].ngrams, &markov_chain->ngrams);
+}
+
+
+int fill_database_parallel(FILE *fp, MarkovChain *markov_chain,
+                           int num_threads)
+{
+    Corpus corpus;
+    if (open_corpus(fp, &corpus) != 0) {
+        return 1;
+    }
+    const char *text = corpus.data;
+    size_t size = corpus.size;
+
+    if (num_threads <= 0) {
+        num_threads = online_cpus();
+    }
+    if ((size_t) num_threads > size / MIN_CHUNK_SIZE + 1) {
+        num_threads = (int) (size / MIN_CHUNK_SIZE + 1);
+    }
+    if (num_threads > MAX_BUILDER_THREADS) {
+        num_threads = MAX_BUILDER_THREADS;
+    }
+
+    Shard shards[MAX_BUILDER_THREADS];
+    const char *end = text + size;
+    const char *start = text;
+    for (int i = 0; i < num_threads; i++) {
+        const char *target = text + size / num_threads * (i + 1);
+        const char *chunk_end = end;
+        if (i < num_threads - 1) {
+            chunk_end = target <= start ?
+                        start : next_sentence_boundary(target, text, end);
+        }
+        memset(&shards[i], 0, sizeof(Shard));
+        shards[i].start = start;
+        shards[i].end = chunk_end;
+        shards[i].order = markov_chain->order;
+        start = chunk_end;
+    }
+
+    int result = run_shards(count_shard, shards, num_threads);
+    if (result == 0) {
+        result = merge_shards(shards, num_threads, markov_chain);
+    }
+    if (result == 0 && markov_chain->order > 1) {
+        result = build_ngrams(shards, num_threads, markov_chain);
+    }
+    if (result == 0) {
+        result = index_followers(markov_chain);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        free_shard(&shards[i]);
+    }
+    close_corpus(&corpus);
+    return result;
+}
@@ -0,0 +1,27 @@
+#ifndef _MARKOV_BUILDER_H_
+#define _MARKOV_BUILDER_H_
+
+#include "markov_chain.h"
+#include <stdio.h>
+
+#define MAX_BUILDER_THREADS 64
+// Corpora smaller than this per thread are not worth splitting further
+#define MIN_CHUNK_SIZE (1 << 20)
+
+/**
+ * Build the database of markov_chain from the whole corpus in parallel.
+ * The corpus is split into one chunk per thread at sentence boundaries,
+ * every thread counts the word transitions of its chunk in private hash
+ * maps, and the counts are merged into markov_chain at the end. For chains
+ * of order > 1 the states of 2..order words are then counted per thread the
+ * same way. The resulting chain is the same as the one built by reading the
+ * corpus sequentially.
+ * @param fp the corpus file
+ * @param markov_chain an empty chain to fill
+ * @param num_threads number of threads to use, 0 to use one per online cpu
+ * @return 0 on success, 1 in case of allocation or read error.
+ */
+int fill_database_parallel(FILE *fp, MarkovChain *markov_chain,
+                           int num_threads);
+
+#endif /* _MARKOV_BUILDER_H_ */
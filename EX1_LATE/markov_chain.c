@@ -1,9 +1,16 @@
 #include "markov_chain.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <string.h> // Include for memcpy
-#include <ctype.h>
+
+// Generator used by the functions that don't get one from the caller
+static MarkovRng default_rng = {{0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL,
+                                 0x94d049bb133111ebULL, 0x2545f4914f6cdd1dULL}};
+
+void set_random_seed(unsigned int seed)
+{
+    seed_rng(&default_rng, seed, 0);
+}
 
 /**
  * Get random number between 0 and max_number [0, max_number).
@@ -12,7 +19,80 @@
  */
 int get_random_number(int max_number)
 {
-    return rand() % max_number;
+    return (int) random_below(&default_rng, (uint32_t) max_number);
+}
+
+
+MarkovChain *new_markov_chain(int order)
+{
+    if (order < 1 || order > MAX_MARKOV_ORDER) {
+        return NULL;
+    }
+    MarkovChain *markov_chain = calloc(1, sizeof(MarkovChain));
+    if (!markov_chain) {
+        return NULL;
+    }
+    markov_chain->order = order;
+    markov_chain->database = calloc(1, sizeof(LinkedList));
+    markov_chain->index.slots = calloc(WORD_INDEX_INITIAL_CAPACITY,
+                                       sizeof(Node *));
+    if (!markov_chain->database || !markov_chain->index.slots) {
+        free(markov_chain->database);
+        free(markov_chain->index.slots);
+        free(markov_chain);
+        return NULL;
+    }
+    markov_chain->index.capacity = WORD_INDEX_INITIAL_CAPACITY;
+    return markov_chain;
+}
+
+
+uint64_t hash_word(const char *word, size_t len)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) word[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+// Find the slot of the word in the index: either the slot holding it, or the
+// empty slot where it should be inserted.
+static Node **find_index_slot(WordIndex *index, const char *word, size_t len)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = (size_t) hash_word(word, len) & mask;
+    while (index->slots[i] != NULL) {
+        const char *data = index->slots[i]->data->data;
+        if (strncmp(data, word, len) == 0 && data[len] == '\0') {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &index->slots[i];
+}
+
+
+// Double the index capacity once it is more than half full.
+static int grow_index(WordIndex *index)
+{
+    WordIndex bigger = {NULL, index->capacity * 2, index->count};
+    bigger.slots = calloc(bigger.capacity, sizeof(Node *));
+    if (!bigger.slots) {
+        return 1;
+    }
+    for (size_t i = 0; i < index->capacity; i++) {
+        Node *node = index->slots[i];
+        if (node != NULL) {
+            const char *data = node->data->data;
+            *find_index_slot(&bigger, data, strlen(data)) = node;
+        }
+    }
+    free(index->slots);
+    *index = bigger;
+    return 0;
 }
 
 
@@ -26,36 +106,10 @@ int get_random_number(int max_number)
  */
 Node* get_node_from_database(MarkovChain *markov_chain, char *data_ptr)
 {
-    Node * start = markov_chain->database->first;
-    Node * current = start;
-    while (current != NULL){
-        if(strcmp(current->data->data, data_ptr)==0)
-        {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
+    return *find_index_slot(&markov_chain->index, data_ptr, strlen(data_ptr));
 }
 
 
-int count_words_before_dot(const char *sentence) {
-    int count = 0;
-    int in_word = 0;
-
-    while (*sentence && *sentence != '.') {
-        if (isspace(*sentence)) {
-            in_word = 0;
-        } else if (!in_word) {
-            in_word = 1;
-            count++;
-        }
-        sentence++;
-    }
-
-    return count;
-}
-
 /**
 * If data_ptr in markov_chain, return it's node. Otherwise, create new
  * node, add to end of markov_chain's database and return it.
@@ -66,51 +120,64 @@ int count_words_before_dot(const char *sentence) {
  */
 Node* add_to_database(MarkovChain *markov_chain, char *data_ptr)
 {
-    //
-    LinkedList *db = markov_chain->database;  // Access database directly
-
-    struct Node* newNode = (struct Node*) malloc(sizeof(struct Node));
-    if (newNode == NULL) {
-        // Handle allocation failure
-        printf("Memory allocation failed\n");
-        exit(1); // Exit or handle the error as appropriate
-    }
-    newNode->data = (MarkovNode *)malloc(sizeof(MarkovNode));
-    newNode->data->data = (char* *)malloc(sizeof(char*));
-    size_t data_size = strlen(data_ptr) + 1;
-    // Assuming data_ptr and newNode->data are properly allocated and you know the size in bytes
-    memcpy(newNode->data->data, data_ptr, data_size);
-
-    newNode->next = NULL;
-
-    if(db->first == NULL) {
-
-        if(count_words_before_dot(newNode->data->data)>1)
-        {
-            db->first = newNode;
-            db->size++;
-            return db->first;
-        }
+    return add_span_to_database(markov_chain, data_ptr, strlen(data_ptr));
+}
+
+
+Node* add_span_to_database(MarkovChain *markov_chain, const char *word,
+                           size_t len)
+{
+    WordIndex *index = &markov_chain->index;
+    Node **slot = find_index_slot(index, word, len);
+    if (*slot != NULL) {
+        return *slot;
     }
-    struct Node* current = db->first;
-    Node * search = get_node_from_database(markov_chain, data_ptr);
-    if(search != NULL)
-    {
-        return search;
+
+    // The node, its word and its list Node all live in the chain's arena
+    MarkovNode *markov_node = arena_calloc(&markov_chain->arena, 1,
+                                           sizeof(MarkovNode));
+    Node *list_node = arena_alloc(&markov_chain->arena, sizeof(Node));
+    if (!markov_node || !list_node) {
+        return NULL;
     }
-    if(current!=NULL)
-    {
-        while (current->next != NULL)
-        {
-            current = current->next;
+    markov_node->data = arena_strndup(&markov_chain->arena, word, len);
+    if (!markov_node->data) {
+        return NULL;
+    }
+    markov_node->id = markov_chain->database->size;
+    if (markov_node->data[len - 1] != '.') {
+        markov_chain->num_starters++;
+    }
+
+    if ((size_t) markov_node->id == markov_chain->nodes_capacity) {
+        size_t capacity = markov_chain->nodes_capacity ?
+                          markov_chain->nodes_capacity * 2 :
+                          WORD_INDEX_INITIAL_CAPACITY;
+        MarkovNode **nodes = realloc(markov_chain->nodes,
+                                     capacity * sizeof(MarkovNode *));
+        if (!nodes) {
+            return NULL;
         }
-        current->next = newNode;
-        db->last = newNode;
-        db->size++;
-        db->last = current->next;
-        return newNode;
+        markov_chain->nodes = nodes;
+        markov_chain->nodes_capacity = capacity;
     }
-    return NULL;
+
+    LinkedList *db = markov_chain->database;
+    *list_node = (Node) {markov_node, NULL};
+    if (db->first == NULL) {
+        db->first = list_node;
+    } else {
+        db->last->next = list_node;
+    }
+    db->last = list_node;
+    db->size++;
+    markov_chain->nodes[markov_node->id] = markov_node;
+    *slot = markov_chain->database->last;
+    index->count++;
+    if (index->count * 2 > index->capacity && grow_index(index) != 0) {
+        return NULL;
+    }
+    return markov_chain->database->last;
 }
 
 /**
@@ -121,21 +188,34 @@ Node* add_to_database(MarkovChain *markov_chain, char *data_ptr)
  * @return success/failure: 0 if the process was successful, 1 if in
  * case of allocation error.
  */
-int add_node_to_frequency_list(MarkovNode *first_node, MarkovNode * second_node)
+int add_node_to_frequency_list(MarkovChain *markov_chain,
+                               MarkovNode *first_node, MarkovNode * second_node)
+{
+    return add_node_to_frequency_list_count(markov_chain, first_node,
+                                            second_node, 1);
+}
+
+
+int add_node_to_frequency_list_count(MarkovChain *markov_chain,
+                                     MarkovNode *first_node,
+                                     MarkovNode *second_node, int count)
 {
 
     if (!first_node || !second_node) {
         return 1; // Failure due to invalid input
     }
+    first_node->followers = NULL;
 
     MarkovNodeFrequency *current = first_node->frequency_list;
     MarkovNodeFrequency *previous = NULL;
 
-    // Search for the node in the frequency list
+    // Search for the node in the frequency list. Words are unique in the
+    // database, so comparing the node pointers is enough.
     while (current != NULL) {
-        if (strcmp(current->markov_node->data, second_node->data)==0) {
+        if (current->markov_node == second_node) {
             // Node already exists, increment its frequency
-            current->frequency++;
+            current->frequency += count;
+            first_node->total_frequency += count;
             return 0; // Success
         }
         previous = current;
@@ -143,14 +223,16 @@ int add_node_to_frequency_list(MarkovNode *first_node, MarkovNode * second_node)
     }
 
     // Node not found, create a new frequency node
-    MarkovNodeFrequency *new_node = (MarkovNodeFrequency *)malloc(sizeof(MarkovNodeFrequency));
+    MarkovNodeFrequency *new_node = arena_alloc(&markov_chain->arena,
+                                                sizeof(MarkovNodeFrequency));
     if (!new_node) {
         return 1; // Failure due to memory allocation error
     }
 
     new_node->markov_node = second_node;
-    new_node->frequency = 1;
+    new_node->frequency = count;
     new_node->next = NULL;
+    first_node->total_frequency += count;
 
     // Add the new node to the list
     if (previous == NULL) {
@@ -163,20 +245,54 @@ int add_node_to_frequency_list(MarkovNode *first_node, MarkovNode * second_node)
 }
 
 
+int index_followers(MarkovChain *markov_chain)
+{
+    size_t total = 0;
+    for (Node *node = markov_chain->database->first; node; node = node->next) {
+        for (MarkovNodeFrequency *frequency = node->data->frequency_list;
+             frequency; frequency = frequency->next) {
+            total++;
+        }
+    }
+    NodeFollower *followers = arena_alloc(&markov_chain->arena,
+                                          (total + 1) * sizeof(NodeFollower));
+    if (!followers) {
+        return 1;
+    }
+
+    for (Node *node = markov_chain->database->first; node; node = node->next) {
+        MarkovNode *markov_node = node->data;
+        int cumulative = 0;
+        markov_node->followers = followers;
+        markov_node->num_followers = 0;
+        for (MarkovNodeFrequency *frequency = markov_node->frequency_list;
+             frequency; frequency = frequency->next) {
+            cumulative += frequency->frequency;
+            *followers++ = (NodeFollower) {frequency->markov_node, cumulative};
+            markov_node->num_followers++;
+        }
+    }
+    return 0;
+}
+
+
 /**
- * Free markov_chain and all of it's content from memory
+ * Free markov_chain and all of it's content from memory. The nodes, words
+ * and frequency lists are released together with the arena.
  * @param markov_chain markov_chain to free
  */
 void free_database(MarkovChain ** ptr_chain)
 {
-    struct Node* current  = (*ptr_chain)->database->first;
-    struct Node* nextNode;
-
-    while (current != NULL) {
-        nextNode = current->next;
-        free(current);             // Free the current node
-        current = nextNode;        // Move to the next node
+    MarkovChain *markov_chain = *ptr_chain;
+    if (markov_chain == NULL) {
+        return;
     }
+    arena_release(&markov_chain->arena);
+    free(markov_chain->index.slots);
+    free(markov_chain->nodes);
+    free_ngram_model(&markov_chain->ngrams);
+    free(markov_chain->database);
+    free(markov_chain);
 
     *ptr_chain = NULL;  // Set head to NULL to indicate list is empty
 }
@@ -184,20 +300,28 @@ void free_database(MarkovChain ** ptr_chain)
 
 /**
  * Get one random MarkovNode from the given markov_chain's database.
+ * Words that end a sentence are never chosen as the first word.
  * @param markov_chain
  * @return the random MarkovNode
  */
- MarkovNode* get_first_random_node(MarkovChain *markov_chain)
- {
-     int random_number = get_random_number(markov_chain->database->size);
-     printf("");
-     Node* curNode = markov_chain->database->first;
-     for(int i=0; i<random_number;i++)
-     {
-         curNode = curNode->next;
-     }
-     return curNode->data;
- }
+MarkovNode* get_first_random_node(MarkovChain *markov_chain)
+{
+    return get_first_random_node_r(markov_chain, &default_rng);
+}
+
+
+MarkovNode* get_first_random_node_r(MarkovChain *markov_chain, MarkovRng *rng)
+{
+    if (markov_chain->num_starters == 0) {
+        return NULL;
+    }
+    while (1) {
+        uint32_t id = random_below(rng, (uint32_t) markov_chain->database->size);
+        if (!ends_with_dot(markov_chain->nodes[id]->data)) {
+            return markov_chain->nodes[id];
+        }
+    }
+}
 
 /**
  * Choose randomly the next MarkovNode, depend on it's occurrence frequency.
@@ -205,36 +329,39 @@ void free_database(MarkovChain ** ptr_chain)
  * @return the next random MarkovNode
  */
 MarkovNode* get_next_random_node(MarkovNode *cur_markov_node)
+{
+    return get_next_random_node_r(cur_markov_node, &default_rng);
+}
+
+
+MarkovNode* get_next_random_node_r(MarkovNode *cur_markov_node, MarkovRng *rng)
 {
     if (!cur_markov_node || !cur_markov_node->frequency_list) {
         return NULL; // Return NULL if input is invalid
     }
-    // Calculate total frequency
-    int total_frequency = 0;
+    // Generate a random number between 0 and total_frequency - 1, and find
+    // where the cumulative frequency passes it
+    int random_value = (int) random_below(
+            rng, (uint32_t) cur_markov_node->total_frequency);
+    if (cur_markov_node->followers != NULL) {
+        NodeFollower *followers = cur_markov_node->followers;
+        int low = 0, high = cur_markov_node->num_followers - 1;
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+            if (followers[middle].cumulative <= random_value) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return followers[low].markov_node;
+    }
     MarkovNodeFrequency *current = cur_markov_node->frequency_list;
-    while (current) {
-
-        total_frequency += current->frequency;
+    while (random_value >= current->frequency) {
+        random_value -= current->frequency;
         current = current->next;
     }
-    MarkovNode **array = (MarkovNode **)malloc(total_frequency * sizeof(MarkovNode *));
-    if (array == NULL) {
-        printf("Memory allocation failed.\n");
-        return NULL;
-    }
-    MarkovNodeFrequency *temp = cur_markov_node->frequency_list;
-    for (int i = 0; i < total_frequency; i++) {
-        // Allocate memory for the string and copy it
-        array[i] = temp->markov_node;
-        if (array[i]  == NULL) {
-            printf("Memory allocation failed for string %d.\n", i + 1);
-            return NULL;
-        }
-        //strcpy(array[i] , temp->markov_node); // Copy the string
-    }
-    // Generate a random number between 0 and total_frequency - 1
-    int random_value = get_random_number(total_frequency);
-    return array[random_value];
+    return current->markov_node;
 }
 
 
@@ -255,6 +382,116 @@ int ends_with_dot(const char *str) {
 }
 
 
+MarkovNode* get_next_random_node_from_history(MarkovChain *markov_chain,
+                                              MarkovNode *const *history,
+                                              int len)
+{
+    return get_next_random_node_from_history_r(markov_chain, history, len,
+                                               &default_rng);
+}
+
+
+MarkovNode* get_next_random_node_from_history_r(MarkovChain *markov_chain,
+                                                MarkovNode *const *history,
+                                                int len, MarkovRng *rng)
+{
+    uint32_t ids[MAX_MARKOV_ORDER];
+    int order = markov_chain ? markov_chain->order : 1;
+    int longest = len < order ? len : order;
+    for (int i = 0; i < longest; i++) {
+        ids[i] = (uint32_t) history[len - longest + i]->id;
+    }
+    // Back off from the longest state to the single word state
+    for (int n = longest; n >= 2; n--) {
+        const NgramState *state = find_ngram_state(
+                &markov_chain->ngrams, ngram_state_key(ids + longest - n, n));
+        if (state != NULL) {
+            const NgramEdge *edge = pick_ngram_edge(
+                    &markov_chain->ngrams, state,
+                    random_below(rng, state->total));
+            return markov_chain->nodes[edge->word];
+        }
+    }
+    return get_next_random_node_r(history[len - 1], rng);
+}
+
+
+int write_tweet(MarkovChain *markov_chain, MarkovNode *first_node,
+                int max_length, MarkovRng *rng, char *buffer, size_t size)
+{
+    MarkovNode *history[MAX_TWEET_LENGTH];
+    size_t written = 0;
+    int word_count = 0;
+    MarkovNode *current_node = first_node;
+    if (max_length > MAX_TWEET_LENGTH) {
+        max_length = MAX_TWEET_LENGTH;
+    }
+
+    while (current_node && word_count < max_length) {
+        history[word_count++] = current_node;
+        size_t len = strlen(current_node->data);
+        if (written + len < size) {
+            memcpy(buffer + written, current_node->data, len);
+        }
+        written += len;
+        if (ends_with_dot(current_node->data) || word_count == max_length) {
+            break;
+        }
+        current_node = get_next_random_node_from_history_r(
+                markov_chain, history, word_count, rng);
+        if (current_node) {
+            if (written + 1 < size) {
+                buffer[written] = ' ';
+            }
+            written++;
+        }
+    }
+    if (size > 0) {
+        buffer[written < size ? written : size - 1] = '\0';
+    }
+    return (int) written;
+}
+
+
+// Write the tweet to a stack buffer (or a heap one if it is too long) and
+// print it
+static void print_tweet(MarkovChain *markov_chain, MarkovNode *first_node,
+                        int max_length)
+{
+    char buffer[TWEET_BUFFER_SIZE];
+    MarkovRng saved = default_rng;
+    int len = write_tweet(markov_chain, first_node, max_length, &default_rng,
+                          buffer, sizeof(buffer));
+    if ((size_t) len < sizeof(buffer)) {
+        printf("%s", buffer);
+        return;
+    }
+    char *long_buffer = malloc((size_t) len + 1);
+    if (!long_buffer) {
+        printf(ALLOCATION_ERROR_MASSAGE);
+        return;
+    }
+    // Generate the same tweet again
+    default_rng = saved;
+    write_tweet(markov_chain, first_node, max_length, &default_rng,
+                long_buffer, (size_t) len + 1);
+    printf("%s", long_buffer);
+    free(long_buffer);
+}
+
+
+void generate_tweet_from_chain(MarkovChain *markov_chain,
+                               MarkovNode *first_node, int max_length)
+{
+    if (!first_node || max_length <= 0)
+    {
+        printf("Invalid input.\n");
+        return;
+    }
+    print_tweet(markov_chain, first_node, max_length);
+}
+
+
 /**
  * Receive markov_chain, generate and print random sentence out of it. The
  * sentence must have at least 2 words in it.
@@ -263,37 +500,10 @@ int ends_with_dot(const char *str) {
  */
 void generate_tweet(MarkovNode *first_node, int max_length)
 {
-    if (!first_node || max_length <= 0) 
+    if (!first_node || max_length <= 0)
     {
         printf("Invalid input.\n");
         return;
     }
-    //Seed random number generator
-    srand((unsigned int)time(NULL));
-
-    MarkovNode* current_node = first_node;
-    int word_count = 0;
-    char **tweets = (char **)malloc(max_length * sizeof(char *));
-    int index= 0;
-    // Generate the tweet
-    int max_tweet_length = 20;
-    while ((current_node && word_count < max_tweet_length)) {
-        tweets[index] = current_node->data;
-        // Print the current word
-        printf("%s",current_node->data);
-        // Stop if we've reached a terminal node (no transitions)
-        //        if (!current_node->frequency_list) {
-        //            break;
-        //        }
-        if (ends_with_dot(current_node->data)) {
-            break;
-        }
-        // Choose the next node randomly based on frequencies
-        current_node = get_next_random_node(current_node);
-        // Add a space if there is a next node
-        if (current_node) {
-            printf(" ");
-        }
-        word_count++;
-    }
-}
\ No newline at end of file
+    print_tweet(NULL, first_node, max_length);
+}
@@ -2,25 +2,66 @@
 #define _MARKOV_CHAIN_H_
 
 #include "linked_list.h"
+#include "ngram.h"
+#include "rng.h"
+#include "arena.h"
 #include <stdio.h>  // For printf(), sscanf()
 #include <stdlib.h> // For malloc()
 #include <stdbool.h> // for bool
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 
 
 
 #define ALLOCATION_ERROR_MASSAGE "Allocation failure: Failed to allocate"\
             "new memory\n"
 
+#define WORD_INDEX_INITIAL_CAPACITY 1024
+#define MAX_TWEET_LENGTH 20
+#define TWEET_BUFFER_SIZE 1024
+
+
+// Open addressing hash index from a word to the Node holding it, so that
+// lookups during ingestion don't have to walk the whole database.
+typedef struct WordIndex{
+    Node **slots;
+    size_t capacity; // always a power of two
+    size_t count;
+} WordIndex;
+
+// An entry of the frequency list, with the frequencies of the entries before
+// it added up, so the next node can be chosen with a binary search
+typedef struct NodeFollower{
+    struct MarkovNode *markov_node;
+    int cumulative;
+} NodeFollower;
 
 typedef struct MarkovChain{
     LinkedList * database;
+    WordIndex index;
+    struct MarkovNode **nodes; // the database nodes by id
+    size_t nodes_capacity;
+    int num_starters; // number of words that don't end a sentence
+    // A state is the last order words. Order 1 uses the frequency lists of
+    // the nodes, higher orders also use the states of 2..order words in
+    // ngrams, backing off to shorter states when a state was never seen.
+    int order;
+    NgramModel ngrams;
+    // Owns the nodes, their words, their list Nodes, frequency lists and
+    // followers; released at once by free_database
+    Arena arena;
 } MarkovChain;
 
 typedef struct MarkovNode{
     char *data;
     struct MarkovNodeFrequency* frequency_list;
+    int total_frequency; // sum of all the frequencies in frequency_list
+    int id; // position of the node in the database
+    // frequency_list as an array, set by index_followers(). NULL when the
+    // list changed since.
+    NodeFollower *followers;
+    int num_followers;
     // any other field you need
 } MarkovNode;
 
@@ -31,6 +72,21 @@ typedef struct MarkovNodeFrequency{
 } MarkovNodeFrequency;
 
 
+/**
+ * Allocate a new empty markov chain.
+ * @param order number of words in a state, 1 to MAX_MARKOV_ORDER
+ * @return the new chain, NULL in case of memory allocation failure.
+ */
+MarkovChain *new_markov_chain(int order);
+
+/**
+ * Hash a word of the given length (FNV-1a).
+ * @param word the word, doesn't have to be null terminated
+ * @param len number of bytes in word
+ * @return 64 bit hash of the word
+ */
+uint64_t hash_word(const char *word, size_t len);
+
 /**
 * Check if data_ptr is in database. If so, return the Node wrapping it in
  * the markov_chain, otherwise return NULL.
@@ -51,17 +107,59 @@ Node* get_node_from_database(MarkovChain *markov_chain, char *data_ptr);
  */
 Node* add_to_database(MarkovChain *markov_chain, char *data_ptr);
 
+/**
+ * Same as add_to_database, but the word is given as a span of len bytes
+ * which doesn't have to be null terminated. The word is copied only when it
+ * is new to the database.
+ * @param markov_chain the chain to look in its database
+ * @param word start of the word
+ * @param len length of the word in bytes
+ * @return Node wrapping the word, NULL in case of memory allocation failure.
+ */
+Node* add_span_to_database(MarkovChain *markov_chain, const char *word,
+                           size_t len);
+
 
 /**
  * Add the second markov_node to the frequency list of the first markov_node.
  * If already in list, update it's occurrence frequency value.
+ * @param markov_chain the chain owning both nodes
  * @param first_node
  * @param second_node
  * @return success/failure: 0 if the process was successful, 1 if in
  * case of allocation error.
  */
-int add_node_to_frequency_list(MarkovNode *first_node
-                               , MarkovNode *second_node);
+int add_node_to_frequency_list(MarkovChain *markov_chain,
+                               MarkovNode *first_node,
+                               MarkovNode *second_node);
+
+/**
+ * Same as add_node_to_frequency_list, but adds count occurrences at once.
+ * @param markov_chain the chain owning both nodes
+ * @param first_node
+ * @param second_node
+ * @param count number of occurrences to add
+ * @return 0 if the process was successful, 1 in case of allocation error.
+ */
+int add_node_to_frequency_list_count(MarkovChain *markov_chain,
+                                     MarkovNode *first_node,
+                                     MarkovNode *second_node, int count);
+
+/**
+ * Copy the frequency lists of all the nodes to arrays of cumulative
+ * frequencies, so choosing the next node doesn't walk the lists. Called
+ * once the database is filled.
+ * @param markov_chain
+ * @return 0 on success, 1 in case of allocation error.
+ */
+int index_followers(MarkovChain *markov_chain);
+
+/**
+ * Check if the word ends a sentence (it's last character is '.').
+ * @param word null terminated word
+ * @return 1 if the word ends a sentence, 0 otherwise
+ */
+int ends_with_dot(const char *word);
 
 /**
  * Free markov_chain and all of it's content from memory
@@ -69,6 +167,12 @@ int add_node_to_frequency_list(MarkovNode *first_node
  */
 void free_database(MarkovChain ** ptr_chain);
 
+/**
+ * Seed the generator used by the functions which don't take one.
+ * @param seed
+ */
+void set_random_seed(unsigned int seed);
+
 /**
  * Get one random MarkovNode from the given markov_chain's database.
  * @param markov_chain
@@ -76,6 +180,12 @@ void free_database(MarkovChain ** ptr_chain);
  */
 MarkovNode* get_first_random_node(MarkovChain *markov_chain);
 
+/**
+ * Same as get_first_random_node, using the caller's generator.
+ * @return the random MarkovNode, NULL if every word ends a sentence
+ */
+MarkovNode* get_first_random_node_r(MarkovChain *markov_chain, MarkovRng *rng);
+
 /**
  * Choose randomly the next MarkovNode, depend on it's occurrence frequency.
  * @param cur_markov_node current MarkovNode
@@ -83,6 +193,59 @@ MarkovNode* get_first_random_node(MarkovChain *markov_chain);
  */
 MarkovNode* get_next_random_node(MarkovNode *cur_markov_node);
 
+/**
+ * Same as get_next_random_node, using the caller's generator.
+ */
+MarkovNode* get_next_random_node_r(MarkovNode *cur_markov_node,
+                                   MarkovRng *rng);
+
+/**
+ * Choose randomly the word following the given words of the sentence, using
+ * the longest state of at most markov_chain->order words that was seen in
+ * the corpus.
+ * @param markov_chain
+ * @param history the words of the sentence so far, oldest first
+ * @param len number of words in history, at least 1
+ * @return the next random MarkovNode, NULL if the last word has no follower
+ */
+MarkovNode* get_next_random_node_from_history(MarkovChain *markov_chain,
+                                              MarkovNode *const *history,
+                                              int len);
+
+/**
+ * Same as get_next_random_node_from_history, using the caller's generator.
+ * markov_chain may be NULL to use only the single word states.
+ */
+MarkovNode* get_next_random_node_from_history_r(MarkovChain *markov_chain,
+                                                MarkovNode *const *history,
+                                                int len, MarkovRng *rng);
+
+/**
+ * Generate a random sentence into the caller's buffer, words separated by
+ * spaces and null terminated. Like snprintf, the tweet is cut to fit the
+ * buffer but the full length is returned, and the generator advances the
+ * same either way.
+ * @param markov_chain the chain, NULL to use only the single word states
+ * @param first_node markov_node to start with
+ * @param max_length maximum number of words, at most MAX_TWEET_LENGTH
+ * @param rng the generator to use
+ * @param buffer where to write the tweet
+ * @param size size of buffer
+ * @return length of the whole tweet, not counting the null terminator
+ */
+int write_tweet(MarkovChain *markov_chain, MarkovNode *first_node,
+                int max_length, MarkovRng *rng, char *buffer, size_t size);
+
+/**
+ * Generate and print a random sentence of markov_chain, starting from
+ * first_node and following the states of the chain's order.
+ * @param markov_chain
+ * @param first_node markov_node to start with
+ * @param max_length maximum length of chain to generate
+ */
+void generate_tweet_from_chain(MarkovChain *markov_chain,
+                               MarkovNode *first_node, int max_length);
+
 /**
  * Receive markov_chain, generate and print random sentence out of it. The
  * sentence must have at least 2 words in it.
@@ -0,0 +1,212 @@
+#include "ngram.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NGRAM_COUNTS_INITIAL_CAPACITY 1024
+
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+
+uint64_t ngram_state_key(const uint32_t *words, int len)
+{
+    uint64_t key = mix64((uint64_t) len);
+    for (int i = 0; i < len; i++) {
+        key = mix64(key ^ words[i]);
+    }
+    return key ? key : 1;
+}
+
+
+static NgramCount *find_count_slot(NgramCount *slots, size_t capacity,
+                                   uint64_t state, uint32_t word)
+{
+    size_t mask = capacity - 1;
+    size_t i = (size_t) mix64(state ^ word) & mask;
+    while (slots[i].count != 0 &&
+           (slots[i].state != state || slots[i].word != word)) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+
+static int grow_counts(NgramCounts *counts)
+{
+    size_t capacity = counts->capacity ?
+                      counts->capacity * 2 : NGRAM_COUNTS_INITIAL_CAPACITY;
+    NgramCount *slots = calloc(capacity, sizeof(NgramCount));
+    if (!slots) {
+        return 1;
+    }
+    for (size_t i = 0; i < counts->capacity; i++) {
+        NgramCount *entry = &counts->slots[i];
+        if (entry->count != 0) {
+            *find_count_slot(slots, capacity, entry->state, entry->word) =
+                    *entry;
+        }
+    }
+    free(counts->slots);
+    counts->slots = slots;
+    counts->capacity = capacity;
+    return 0;
+}
+
+
+int count_ngram(NgramCounts *counts, uint64_t state, uint32_t word,
+                uint32_t count)
+{
+    if ((counts->count + 1) * 2 > counts->capacity && grow_counts(counts)) {
+        return 1;
+    }
+    NgramCount *slot = find_count_slot(counts->slots, counts->capacity,
+                                       state, word);
+    if (slot->count == 0) {
+        slot->state = state;
+        slot->word = word;
+        counts->count++;
+    }
+    slot->count += count;
+    return 0;
+}
+
+
+int count_ngram_states(NgramCounts *counts, const uint32_t *history, int len,
+                       uint32_t word, int order)
+{
+    for (int n = 2; n <= order && n <= len; n++) {
+        uint64_t state = ngram_state_key(history + len - n, n);
+        if (count_ngram(counts, state, word, 1) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int merge_ngram_counts(NgramCounts *to, const NgramCounts *from)
+{
+    for (size_t i = 0; i < from->capacity; i++) {
+        const NgramCount *entry = &from->slots[i];
+        if (entry->count != 0 &&
+            count_ngram(to, entry->state, entry->word, entry->count) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void free_ngram_counts(NgramCounts *counts)
+{
+    free(counts->slots);
+    counts->slots = NULL;
+    counts->capacity = 0;
+    counts->count = 0;
+}
+
+
+static int compare_counts(const void *a, const void *b)
+{
+    const NgramCount *first = a, *second = b;
+    if (first->state != second->state) {
+        return first->state < second->state ? -1 : 1;
+    }
+    return (first->word > second->word) - (first->word < second->word);
+}
+
+
+int build_ngram_model(const NgramCounts *counts, NgramModel *model)
+{
+    memset(model, 0, sizeof(NgramModel));
+    NgramCount *sorted = malloc((counts->count + 1) * sizeof(NgramCount));
+    if (!sorted) {
+        return 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < counts->capacity; i++) {
+        if (counts->slots[i].count != 0) {
+            sorted[n++] = counts->slots[i];
+        }
+    }
+    qsort(sorted, n, sizeof(NgramCount), compare_counts);
+
+    size_t num_states = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || sorted[i].state != sorted[i - 1].state) {
+            num_states++;
+        }
+    }
+    model->edges = malloc((n + 1) * sizeof(NgramEdge));
+    model->states = malloc((num_states + 1) * sizeof(NgramState));
+    if (!model->edges || !model->states) {
+        free(sorted);
+        free_ngram_model(model);
+        return 1;
+    }
+
+    NgramState *state = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || sorted[i].state != sorted[i - 1].state) {
+            state = &model->states[model->num_states++];
+            *state = (NgramState) {sorted[i].state, (uint32_t) i, 0};
+        }
+        state->total += sorted[i].count;
+        model->edges[i] = (NgramEdge) {sorted[i].word, state->total};
+    }
+    model->num_edges = n;
+    model->states[model->num_states] = (NgramState) {0, (uint32_t) n, 0};
+    free(sorted);
+    return 0;
+}
+
+
+const NgramState *find_ngram_state(const NgramModel *model, uint64_t key)
+{
+    size_t low = 0, high = model->num_states;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (model->states[middle].key < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < model->num_states && model->states[low].key == key) {
+        return &model->states[low];
+    }
+    return NULL;
+}
+
+
+const NgramEdge *pick_ngram_edge(const NgramModel *model,
+                                 const NgramState *state,
+                                 uint32_t random_value)
+{
+    uint32_t low = state->first_edge, high = state[1].first_edge - 1;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (model->edges[middle].cumulative <= random_value) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return &model->edges[low];
+}
+
+
+void free_ngram_model(NgramModel *model)
+{
+    free(model->states);
+    free(model->edges);
+    memset(model, 0, sizeof(NgramModel));
+}
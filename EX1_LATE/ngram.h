@@ -0,0 +1,107 @@
+#ifndef _NGRAM_H_
+#define _NGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_MARKOV_ORDER 8
+
+// Marks a word id in a recorded word sequence as the end of a sentence
+#define SENTENCE_END_FLAG 0x80000000u
+
+// Occurrences of word after a state (a sequence of 2..order words), while
+// the chain is being built
+typedef struct NgramCount {
+    uint64_t state;
+    uint32_t word;
+    uint32_t count; // 0 marks an empty slot
+} NgramCount;
+
+// Open addressing hash table of NgramCount
+typedef struct NgramCounts {
+    NgramCount *slots;
+    size_t capacity; // always a power of two
+    size_t count;
+} NgramCounts;
+
+typedef struct NgramEdge {
+    uint32_t word;
+    uint32_t cumulative; // count of this edge plus the state's edges before it
+} NgramEdge;
+
+// The words following a state are edges[first_edge .. next state's
+// first_edge). States are sorted by key.
+typedef struct NgramState {
+    uint64_t key;
+    uint32_t first_edge;
+    uint32_t total; // sum of the counts of the state's edges
+} NgramState;
+
+// Compact, read only form of NgramCounts used for generation
+typedef struct NgramModel {
+    NgramState *states; // num_states + 1 entries, the last is a sentinel
+    size_t num_states;
+    NgramEdge *edges;
+    size_t num_edges;
+} NgramModel;
+
+/**
+ * Hash a state of len word ids (oldest first) to its key. Never returns 0.
+ */
+uint64_t ngram_state_key(const uint32_t *words, int len);
+
+/**
+ * Add count occurrences of word after the given state.
+ * @return 0 on success, 1 in case of allocation error.
+ */
+int count_ngram(NgramCounts *counts, uint64_t state, uint32_t word,
+                uint32_t count);
+
+/**
+ * Count word after each state of 2..order words that ends history.
+ * @param counts the counts to update
+ * @param history ids of the previous words of the sentence, oldest first
+ * @param len number of words in history
+ * @param word id of the word following history
+ * @param order the order of the chain
+ * @return 0 on success, 1 in case of allocation error.
+ */
+int count_ngram_states(NgramCounts *counts, const uint32_t *history, int len,
+                       uint32_t word, int order);
+
+/**
+ * Add all the counts of from into to.
+ * @return 0 on success, 1 in case of allocation error.
+ */
+int merge_ngram_counts(NgramCounts *to, const NgramCounts *from);
+
+void free_ngram_counts(NgramCounts *counts);
+
+/**
+ * Build the compact model out of the counts. Edges of every state are
+ * sorted by word id, so the model doesn't depend on the counting order.
+ * @return 0 on success, 1 in case of allocation error.
+ */
+int build_ngram_model(const NgramCounts *counts, NgramModel *model);
+
+/**
+ * Find a state in the model.
+ * @return the state, NULL if the model has no such state.
+ */
+const NgramState *find_ngram_state(const NgramModel *model, uint64_t key);
+
+/**
+ * Find the edge of state that the random value falls on, i.e. the first
+ * edge whose cumulative count is above it (binary search).
+ * @param model
+ * @param state a state of the model
+ * @param random_value a number in [0, state->total)
+ * @return the chosen edge
+ */
+const NgramEdge *pick_ngram_edge(const NgramModel *model,
+                                 const NgramState *state,
+                                 uint32_t random_value);
+
+void free_ngram_model(NgramModel *model);
+
+#endif /* _NGRAM_H_ */
@@ -0,0 +1,50 @@
+#include "rng.h"
+
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+static uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+
+void seed_rng(MarkovRng *rng, uint64_t seed, uint64_t stream)
+{
+    // Mix the stream number in through its own splitmix step, so nearby
+    // streams start from unrelated states
+    uint64_t stream_state = stream;
+    uint64_t state = seed ^ splitmix64(&stream_state);
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitmix64(&state);
+    }
+}
+
+
+uint64_t next_random(MarkovRng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+
+uint32_t random_below(MarkovRng *rng, uint32_t bound)
+{
+    // Map the top 32 bits to [0, bound) with a multiplication (Lemire)
+    return (uint32_t) (((next_random(rng) >> 32) * bound) >> 32);
+}
@@ -0,0 +1,31 @@
+#ifndef _RNG_H_
+#define _RNG_H_
+
+#include <stdint.h>
+
+// xoshiro256** generator. Every thread (or batch of tweets) owns one, so
+// generation never touches the global rand() state.
+typedef struct MarkovRng {
+    uint64_t s[4];
+} MarkovRng;
+
+/**
+ * Seed a generator. Different streams of the same seed give independent
+ * sequences.
+ * @param rng the generator to seed
+ * @param seed the seed given on the command line
+ * @param stream number of the stream (e.g. thread or batch index)
+ */
+void seed_rng(MarkovRng *rng, uint64_t seed, uint64_t stream);
+
+/**
+ * Get the next 64 random bits.
+ */
+uint64_t next_random(MarkovRng *rng);
+
+/**
+ * Get a random number in [0, bound). bound must be positive.
+ */
+uint32_t random_below(MarkovRng *rng, uint32_t bound);
+
+#endif /* _RNG_H_ */
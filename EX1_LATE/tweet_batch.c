@@ -0,0 +1,146 @@
+#include "tweet_batch.h"
+#include <pthread.h>
+#include <string.h>
+
+// Room for the "Tweet <i>: " prefix and the new line
+#define LINE_OVERHEAD 32
+
+typedef struct Batch {
+    MarkovChain *markov_chain;
+    uint64_t seed;
+    long num_tweets;
+    long num_blocks;
+    FILE *out;
+
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    long next_block; // next block to generate
+    long next_to_write; // next block to write to out
+    int failed;
+} Batch;
+
+
+static int reserve(char **buffer, size_t *capacity, size_t needed)
+{
+    if (needed <= *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity ? *capacity : TWEET_BUFFER_SIZE;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    char *bigger = realloc(*buffer, new_capacity);
+    if (!bigger) {
+        return 1;
+    }
+    *buffer = bigger;
+    *capacity = new_capacity;
+    return 0;
+}
+
+
+// Write the tweets of one block to buffer, return its length or -1
+static long write_block(Batch *batch, long block, char **buffer,
+                        size_t *capacity)
+{
+    MarkovRng rng;
+    size_t used = 0;
+    long first = block * TWEETS_PER_BLOCK;
+    long last = first + TWEETS_PER_BLOCK < batch->num_tweets ?
+                first + TWEETS_PER_BLOCK : batch->num_tweets;
+
+    seed_rng(&rng, batch->seed, (uint64_t) block);
+    for (long i = first; i < last; i++) {
+        if (reserve(buffer, capacity,
+                    used + TWEET_BUFFER_SIZE + LINE_OVERHEAD) != 0) {
+            return -1;
+        }
+        used += (size_t) sprintf(*buffer + used, "Tweet %ld: ", i + 1);
+        MarkovNode *first_node = get_first_random_node_r(batch->markov_chain,
+                                                         &rng);
+        MarkovRng saved = rng;
+        size_t room = *capacity - used;
+        size_t len = (size_t) write_tweet(batch->markov_chain, first_node,
+                                          MAX_TWEET_LENGTH, &rng,
+                                          *buffer + used, room);
+        if (len >= room) {
+            // Too long for the buffer, generate the same tweet again
+            if (reserve(buffer, capacity, used + len + LINE_OVERHEAD) != 0) {
+                return -1;
+            }
+            rng = saved;
+            write_tweet(batch->markov_chain, first_node, MAX_TWEET_LENGTH,
+                        &rng, *buffer + used, *capacity - used);
+        }
+        used += len;
+        (*buffer)[used++] = '\n';
+    }
+    return (long) used;
+}
+
+
+// Thread routine: generate blocks until all are taken
+static void *generate_blocks(void *arg)
+{
+    Batch *batch = arg;
+    char *buffer = NULL;
+    size_t capacity = 0;
+
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        if (batch->failed || batch->next_block == batch->num_blocks) {
+            pthread_mutex_unlock(&batch->lock);
+            break;
+        }
+        long block = batch->next_block++;
+        pthread_mutex_unlock(&batch->lock);
+
+        long used = write_block(batch, block, &buffer, &capacity);
+
+        pthread_mutex_lock(&batch->lock);
+        while (batch->next_to_write != block && !batch->failed) {
+            pthread_cond_wait(&batch->turn, &batch->lock);
+        }
+        if (used < 0 || (!batch->failed &&
+            fwrite(buffer, 1, (size_t) used, batch->out) != (size_t) used)) {
+            batch->failed = 1;
+        }
+        batch->next_to_write++;
+        pthread_cond_broadcast(&batch->turn);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+
+int generate_tweets_parallel(MarkovChain *markov_chain, uint64_t seed,
+                             long num_tweets, int num_threads, FILE *out)
+{
+    if (num_threads < 1 || num_threads > MAX_BATCH_THREADS ||
+        markov_chain->num_starters == 0) {
+        return 1;
+    }
+    Batch batch = {markov_chain, seed, num_tweets,
+                   (num_tweets + TWEETS_PER_BLOCK - 1) / TWEETS_PER_BLOCK, out,
+                   PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                   0, 0, 0};
+    pthread_t threads[MAX_BATCH_THREADS];
+    int started = 0;
+
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, generate_blocks,
+                           &batch) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        generate_blocks(&batch);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.turn);
+    return batch.failed || fflush(out) != 0;
+}
@@ -0,0 +1,28 @@
+#ifndef _TWEET_BATCH_H_
+#define _TWEET_BATCH_H_
+
+#include "markov_chain.h"
+#include <stdio.h>
+
+#define MAX_BATCH_THREADS 64
+// Tweets are generated in blocks of this many. Every block has its own
+// random stream, so the output depends only on the seed and not on the
+// number of threads.
+#define TWEETS_PER_BLOCK 4096
+
+/**
+ * Generate num_tweets tweets ("Tweet <i>: <tweet>" lines) with num_threads
+ * threads. Every thread writes whole blocks of tweets into its own buffer,
+ * and the blocks are written to out in order.
+ * @param markov_chain the chain, must have at least one word that doesn't
+ * end a sentence
+ * @param seed the seed given on the command line
+ * @param num_tweets number of tweets to generate
+ * @param num_threads number of threads, 1 to MAX_BATCH_THREADS
+ * @param out where to write the tweets
+ * @return 0 on success, 1 in case of allocation or write error.
+ */
+int generate_tweets_parallel(MarkovChain *markov_chain, uint64_t seed,
+                             long num_tweets, int num_threads, FILE *out);
+
+#endif /* _TWEET_BATCH_H_ */
@@ -1,153 +1,188 @@
 #define FILE_PATH_ERROR "Error: incorrect file path"
 #define NUM_ARGS_ERROR "Usage: invalid number of arguments"
+#define ORDER_ERROR "Usage: the order must be between 1 and 8"
+#define THREADS_ERROR "Usage: the number of threads must be between 1 and 64"
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
 
-#define DELIMITERS " \n\t\r"
 #include "markov_chain.h"
+#include "markov_builder.h"
+#include "corpus_tokenizer.h"
+#include "tweet_batch.h"
 #include <stdio.h>   // For printf and file I/O functions
-#include <string.h> // For strdup, strcmp, etc.
-#include <unistd.h> // For sleep()
-
-// Function to check if a string ends with a '.' character
-int ends_with_point(const char *str) {
-    if (!str || *str == '\0') { // Check for NULL or empty string
-        return 0; // Return false
+#include <string.h> // For strcmp, memmove
+
+// Count the states of 2..order words ending before current_node, and add it
+// to the sentence history (which is emptied once the sentence ends)
+static int add_to_history(NgramCounts *counts, uint32_t *history, int *len,
+                          MarkovNode *current_node, int order)
+{
+    uint32_t id = (uint32_t) current_node->id;
+    if (count_ngram_states(counts, history, *len, id, order) != 0) {
+        return 1;
     }
-
-    // Move pointer to the end of the string
-    while (*(str + 1)) {
-        str++;
+    if (ends_with_dot(current_node->data)) {
+        *len = 0;
+    } else if (*len < order) {
+        history[(*len)++] = id;
+    } else {
+        memmove(history, history + 1, (*len - 1) * sizeof(uint32_t));
+        history[*len - 1] = id;
     }
-
-    // Check if the last character is '.'
-    return (*str == '.') ? 1 : 0;
+    return 0;
 }
 
 
 int fill_database(FILE* fp, int words_to_read, MarkovChain* markovChain) {
     MarkovNode *prev = NULL;
-    MarkovNode *current;
     int word_count = 0;
-    char line[1024];
-    char *token = NULL;
-    char *last_word_to_read = NULL;
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        token = strtok(line, DELIMITERS);
-        while (((token != NULL && word_count < words_to_read) && (!ends_with_point(last_word_to_read)))) {
-            // Allocate and copy data
-            word_count++;
-            char *data = strdup(token);
-            if (!data) {
-                printf("Error: Memory allocation failed for word.\n");
-                fclose(fp);
-                free_database(&markovChain);
-                return 1;
-            }
-
-            Node * current_node = add_to_database(markovChain,data);
-            if (current_node == NULL && markovChain->database->size !=0 ) {
-                printf("Failed to add word to database.\n");
-                free(current);
-                free(data);
-                return 1;
-            }
-
-            // If there's a previous word, add it to the frequency list
-            if (prev != NULL) {
-                Node* first = get_node_from_database(markovChain,prev->data);
-                if(first->data!=NULL)
-                {
-                    add_node_to_frequency_list(first->data, current_node->data);
-                }
-            }
+    Corpus corpus;
+    Tokenizer tokenizer;
+    TokenSpan token;
+    NgramCounts ngram_counts = {0};
+    uint32_t history[MAX_MARKOV_ORDER];
+    int history_len = 0;
+    if (open_corpus(fp, &corpus) != 0) {
+        printf("Error: failed to read the corpus.\n");
+        return 1;
+    }
+    init_tokenizer(&tokenizer, corpus.data, corpus.data + corpus.size);
+    while (word_count < words_to_read && next_token(&tokenizer, &token)) {
+        word_count++;
+        Node * current_node = add_span_to_database(markovChain, token.start,
+                                                   token.len);
+        if (current_node == NULL) {
+            printf("Failed to add word to database.\n");
+            free_ngram_counts(&ngram_counts);
+            close_corpus(&corpus);
+            return 1;
+        }
 
-            // Update previous word and increment count
-            if(current_node!=NULL)
+        // If there's a previous word that doesn't end a sentence, add
+        // the current word to its frequency list
+        if (prev != NULL && !ends_with_dot(prev->data)) {
+            if (add_node_to_frequency_list(markovChain, prev,
+                                           current_node->data) != 0)
             {
-                prev = current_node->data;
-
-                last_word_to_read = data;
-
+                printf(ALLOCATION_ERROR_MASSAGE);
+                free_ngram_counts(&ngram_counts);
+                close_corpus(&corpus);
+                return 1;
             }
-            token = strtok(NULL, DELIMITERS);
-
         }
-        if(word_count > words_to_read)
-        {
-            break;
+
+        if (markovChain->order > 1 &&
+            add_to_history(&ngram_counts, history, &history_len,
+                           current_node->data, markovChain->order) != 0) {
+            printf(ALLOCATION_ERROR_MASSAGE);
+            free_ngram_counts(&ngram_counts);
+            close_corpus(&corpus);
+            return 1;
         }
 
+        // Update previous word
+        prev = current_node->data;
     }
 
-    return 0;
+    close_corpus(&corpus);
+    int result = 0;
+    if (markovChain->order > 1) {
+        result = build_ngram_model(&ngram_counts, &markovChain->ngrams);
+        free_ngram_counts(&ngram_counts);
+    }
+    if (result == 0) {
+        result = index_followers(markovChain);
+    }
+    return result;
 }
 
 
 int main(int argc, char *argv[]) {
 
-    if(argc !=5)
+    // Optional "-k <order>" and "-t <threads>" before the other arguments
+    int order = 1;
+    int num_threads = 1;
+    while (argc > 2 && (strcmp(argv[1], "-k") == 0 ||
+                        strcmp(argv[1], "-t") == 0)) {
+        if (strcmp(argv[1], "-k") == 0) {
+            order = atoi(argv[2]);
+            if (order < 1 || order > MAX_MARKOV_ORDER) {
+                fprintf(stderr, ORDER_ERROR);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            num_threads = atoi(argv[2]);
+            if (num_threads < 1 || num_threads > MAX_BATCH_THREADS) {
+                fprintf(stderr, THREADS_ERROR);
+                exit(EXIT_FAILURE);
+            }
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if(argc != 4 && argc != 5)
     {
-        // add the 10 tweets length if the number of tweets is not specifieds
         fprintf(stderr, NUM_ARGS_ERROR);
         exit(EXIT_FAILURE);
     }
 
     // Parse command-line arguments
     int seed = atoi(argv[1]);
-    int max_length = atoi(argv[2]);
+    long num_tweets = atol(argv[2]);
     char *file_path = argv[3];
-    int num_tweets = atoi(argv[4]);
-    //LinkedList* all_words;
+    // Without a word count the whole corpus is read
+    int words_to_read = argc == 5 ? atoi(argv[4]) : -1;
 
-    if (max_length <= 0 || num_tweets <= 0) {
-        printf("Error: max_length and num_tweets must be positive integers.\n");
+    if (num_tweets <= 0 || (argc == 5 && words_to_read <= 0)) {
+        printf("Error: num_tweets and words_to_read must be positive integers.\n");
         return 1;
     }
 
-    // Seed the random number generator
-    srand(seed);
-
-    MarkovChain *markov_chain = malloc(sizeof(MarkovChain));
+    MarkovChain *markov_chain = new_markov_chain(order);
     if (!markov_chain) {
         printf("Error: Memory allocation failed for Markov Chain.\n");
         return 1;
     }
-    markov_chain->database = malloc(sizeof(LinkedList));
-    if (!markov_chain->database) {
-        printf("Error: Memory allocation failed for database.\n");
-        free(markov_chain);
-        return 1;
-    }
-    markov_chain->database->first = NULL;
 
 
     // Load the text corpus into the Markov Chain
     FILE *file = fopen(file_path, "r");
     if (!file) {
         fprintf(stderr, FILE_PATH_ERROR);
-        free(markov_chain->database);
-        free(markov_chain);
+        free_database(&markov_chain);
         exit(EXIT_FAILURE);
     }
 
-    int result =fill_database(file,num_tweets,markov_chain);
+    // Reading a prefix of the corpus has to stop at an exact word, so only
+    // the whole corpus is split between threads
+    int result = words_to_read > 0 ?
+                 fill_database(file, words_to_read, markov_chain) :
+                 fill_database_parallel(file, markov_chain, 0);
 
+    fclose(file);
     if(result!=0)
     {
         printf("Database fill end with error!\n");
+        free_database(&markov_chain);
         exit(1);
     }
-    MarkovNode* current = get_first_random_node(markov_chain);
-    for(int i =0 ; i<max_length; i++)
-    {
-        printf("Tweet %d: ",i+1);
-        generate_tweet(current,max_length);
-        printf("\n"); // End the tweet
-        sleep(1);
-        current = get_first_random_node(markov_chain);
+    if (markov_chain->num_starters == 0) {
+        printf("Error: the corpus has no word to start a tweet with.\n");
+        free_database(&markov_chain);
+        exit(1);
+    }
+    // Tweets are written in whole blocks, so a big stdio buffer saves
+    // write calls
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    if (generate_tweets_parallel(markov_chain, (uint64_t) seed, num_tweets,
+                                 num_threads, stdout) != 0) {
+        fprintf(stderr, "Error: failed to write the tweets.\n");
+        free_database(&markov_chain);
+        exit(1);
     }
 
     // Free resources
     free_database(&markov_chain);
-    fclose(file);
     return 0;
 }
@@ -0,0 +1,506 @@
+#include "batch_fetch.h"
+#include "conn_pool.h"
+#include "resolver.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define SCRATCH_SIZE 16384
+
+static int epoll_fd = -1;
+static int in_flight = 0;
+static long fetched = 0;
+static long failed = 0;
+static char scratch[SCRATCH_SIZE]; // received bytes, until they are parsed
+static char *lookahead = NULL;     // a URL read but not started yet
+
+
+static long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+           (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+
+static int set_non_blocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+static int watch(Fetch *fetch, uint32_t events, int operation)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = fetch;
+    return epoll_ctl(epoll_fd, operation, fetch->sock, &event);
+}
+
+
+// Print the line of a URL and free it
+static void report_url(Fetch *fetch, int index, const char *error)
+{
+    long ms = elapsed_ms(&fetch->started);
+    if (error != NULL) {
+        printf("ERR %s %ldms %s\n", error, ms, fetch->urls[index]);
+        failed++;
+    } else {
+        printf("%d %ld %ldms %s\n", fetch->parser.status_code,
+               fetch->parser.body_bytes, ms, fetch->urls[index]);
+        fetched++;
+    }
+    free(fetch->urls[index]);
+    fetch->urls[index] = NULL;
+}
+
+
+// The fetch is over: report the URLs left unanswered and free its slot
+static void end_fetch(Fetch *fetch, const char *error)
+{
+    for (int i = fetch->answered; i < fetch->num_urls; i++) {
+        report_url(fetch, i, error);
+    }
+    if (fetch->sock != -1) {
+        close(fetch->sock);
+        fetch->sock = -1;
+    }
+    free(fetch->request);
+    fetch->request = NULL;
+    fetch->num_urls = 0;
+    fetch->state = FETCH_IDLE;
+    in_flight--;
+}
+
+
+// Write the requests of the unanswered URLs one after the other.
+// Returns -1 if there is no memory for them.
+static int build_requests(Fetch *fetch)
+{
+    char host[URL_HOST_SIZE], path[URL_PATH_SIZE];
+    char host_header[URL_HOST_HEADER_SIZE];
+    int port;
+    // The URLs of a fetch all have its host and port
+    const char *format = "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n";
+    format_host_header(fetch->host, fetch->port, host_header);
+    size_t size = 0;
+    for (int i = fetch->answered; i < fetch->num_urls; i++) {
+        split_url(fetch->urls[i], host, path, &port);
+        size += strlen(format) + strlen(path) + strlen(host_header);
+    }
+    free(fetch->request);
+    fetch->request = malloc(size);
+    if (fetch->request == NULL) {
+        return -1;
+    }
+    fetch->request_len = 0;
+    for (int i = fetch->answered; i < fetch->num_urls; i++) {
+        split_url(fetch->urls[i], host, path, &port);
+        fetch->request_len += (size_t) sprintf(fetch->request + fetch->request_len,
+                                               format, path, host_header);
+    }
+    return 0;
+}
+
+
+// Connect to the next address of the host. Returns -1 (the fetch ended)
+// when none is left.
+static int connect_next_address(Fetch *fetch)
+{
+    while (fetch->address < fetch->addresses.count) {
+        int i = fetch->address++;
+        struct sockaddr *address = (struct sockaddr *) &fetch->addresses.addresses[i];
+        fetch->sock = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fetch->sock == -1) {
+            continue;
+        }
+        if (connect(fetch->sock, address, fetch->addresses.lengths[i]) == 0) {
+            fetch->state = FETCH_SENDING;
+        } else if (errno == EINPROGRESS) {
+            fetch->state = FETCH_CONNECTING;
+        } else {
+            close(fetch->sock);
+            fetch->sock = -1;
+            continue;
+        }
+        if (watch(fetch, EPOLLOUT, EPOLL_CTL_ADD) == -1) {
+            end_fetch(fetch, "epoll");
+            return -1;
+        }
+        return 0;
+    }
+    end_fetch(fetch, "connect");
+    return -1;
+}
+
+
+// Look the host up without blocking: the fetch waits in FETCH_RESOLVING
+// until a resolver thread is done. Returns -1 (the fetch ended) on failure.
+static int resolve_and_connect(Fetch *fetch)
+{
+    int result = resolve_host_async(fetch->host, fetch->port, &fetch->addresses);
+    if (result == -1) {
+        end_fetch(fetch, "no-such-host");
+        return -1;
+    }
+    if (result == 1) {
+        fetch->state = FETCH_RESOLVING;
+        return 0;
+    }
+    fetch->address = 0;
+    return connect_next_address(fetch);
+}
+
+
+// Start a connection to the host of the fetch, or take an idle one from the
+// pool. Returns -1 (the fetch ended) on failure.
+static int open_connection(Fetch *fetch, bool use_pool)
+{
+    fetch->sent = 0;
+    fetch->sock = use_pool ? pool_take(fetch->host, fetch->port) : -1;
+    fetch->reused = fetch->sock != -1;
+    if (!fetch->reused) {
+        return resolve_and_connect(fetch);
+    }
+    fetch->state = FETCH_SENDING;
+    if (set_non_blocking(fetch->sock) == -1 ||
+        watch(fetch, EPOLLOUT, EPOLL_CTL_ADD) == -1) {
+        end_fetch(fetch, "epoll");
+        return -1;
+    }
+    return 0;
+}
+
+
+// The connection can't carry the rest of the requests: the server closed it
+// (a pooled one before answering, or after some of the responses), or said
+// it would. Send the unanswered requests again on a new one.
+static void resend_requests(Fetch *fetch)
+{
+    close(fetch->sock);
+    fetch->sock = -1;
+    fetch->answered_here = 0;
+    http_parser_init(&fetch->parser, NULL, NULL);
+    if (build_requests(fetch) == -1) {
+        end_fetch(fetch, "no-memory");
+        return;
+    }
+    open_connection(fetch, false);
+}
+
+
+// Read the next URL of the list. Returns NULL at the end of the list.
+static char *next_url(FILE *urls)
+{
+    if (lookahead != NULL) {
+        char *url = lookahead;
+        lookahead = NULL;
+        return url;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, urls) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *url = line + strspn(line, " \t");
+        if (*url != '\0' && *url != '#') {
+            char *copy = strdup(url);
+            free(line);
+            return copy;
+        }
+    }
+    free(line);
+    return NULL;
+}
+
+
+// Start a fetch with the URL, and with the URLs after it of the same host
+// and port, up to pipeline of them
+static void start_fetch(Fetch *fetch, char *url, FILE *urls, int pipeline)
+{
+    char path[URL_PATH_SIZE];
+    fetch->urls[0] = url;
+    fetch->num_urls = 1;
+    fetch->answered = 0;
+    fetch->answered_here = 0;
+    fetch->sock = -1;
+    clock_gettime(CLOCK_MONOTONIC, &fetch->started);
+    http_parser_init(&fetch->parser, NULL, NULL);
+    in_flight++;
+    if (split_url(url, fetch->host, path, &fetch->port) != 0) {
+        end_fetch(fetch, "bad-url");
+        return;
+    }
+    while (fetch->num_urls < pipeline) {
+        char host[URL_HOST_SIZE];
+        int port;
+        char *next = next_url(urls);
+        if (next == NULL) {
+            break;
+        }
+        if (split_url(next, host, path, &port) != 0 || port != fetch->port ||
+            strcmp(host, fetch->host) != 0) {
+            lookahead = next;
+            break;
+        }
+        fetch->urls[fetch->num_urls++] = next;
+    }
+    if (build_requests(fetch) == -1) {
+        end_fetch(fetch, "no-memory");
+        return;
+    }
+    open_connection(fetch, true);
+}
+
+
+// All the responses arrived: keep the connection for the next URLs of the
+// host if the server allows it
+static void complete_fetch(Fetch *fetch, bool connection_reusable)
+{
+    if (connection_reusable) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fetch->sock, NULL);
+        pool_put(fetch->host, fetch->port, fetch->sock);
+        fetch->sock = -1;
+    }
+    end_fetch(fetch, NULL);
+}
+
+
+// The response to the oldest unanswered URL is complete. Returns true if
+// the connection can carry the next response.
+static bool next_response(Fetch *fetch)
+{
+    bool keep_alive = fetch->parser.keep_alive;
+    report_url(fetch, fetch->answered, NULL);
+    fetch->answered++;
+    fetch->answered_here++;
+    http_parser_init(&fetch->parser, NULL, NULL);
+    return keep_alive;
+}
+
+
+static void handle_connecting(Fetch *fetch)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fetch->sock, SOL_SOCKET, SO_ERROR, &error, &len) == -1 ||
+        error != 0) {
+        close(fetch->sock);
+        fetch->sock = -1;
+        connect_next_address(fetch);
+        return;
+    }
+    fetch->state = FETCH_SENDING;
+}
+
+
+static void handle_sending(Fetch *fetch)
+{
+    while (fetch->sent < fetch->request_len) {
+        ssize_t sent = send(fetch->sock, fetch->request + fetch->sent,
+                            fetch->request_len - fetch->sent, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (fetch->reused || fetch->answered_here > 0) {
+                resend_requests(fetch);
+            } else {
+                end_fetch(fetch, "send");
+            }
+            return;
+        }
+        fetch->sent += (size_t) sent;
+    }
+    fetch->state = FETCH_RECEIVING;
+    if (watch(fetch, EPOLLIN, EPOLL_CTL_MOD) == -1) {
+        end_fetch(fetch, "epoll");
+    }
+}
+
+
+// Parse received bytes, which may hold the end of a response and the
+// beginning of the next ones
+static void parse_received(Fetch *fetch, size_t received)
+{
+    size_t offset = 0;
+    while (offset < received) {
+        ssize_t used = http_parser_feed(&fetch->parser, scratch + offset,
+                                        received - offset);
+        if (used == -1) {
+            end_fetch(fetch, "bad-response");
+            return;
+        }
+        offset += (size_t) used;
+        if (!http_parser_done(&fetch->parser)) {
+            continue;
+        }
+        bool keep_alive = next_response(fetch);
+        if (fetch->answered == fetch->num_urls) {
+            // Bytes past the last response were not asked for
+            complete_fetch(fetch, keep_alive && offset == received);
+            return;
+        }
+        if (!keep_alive) {
+            resend_requests(fetch);
+            return;
+        }
+    }
+}
+
+
+static void handle_receiving(Fetch *fetch)
+{
+    HttpParser *parser = &fetch->parser;
+    while (fetch->state == FETCH_RECEIVING) {
+        ssize_t received = recv(fetch->sock, scratch, SCRATCH_SIZE, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (received > 0) {
+            parse_received(fetch, (size_t) received);
+            continue;
+        }
+        // The connection ended, which may end a response framed by it
+        bool nothing_yet = parser->state == PARSE_HEAD && parser->head_len == 0;
+        if (!nothing_yet && http_parser_finish(parser) == 0) {
+            next_response(fetch);
+            nothing_yet = true;
+        }
+        if (fetch->answered == fetch->num_urls) {
+            complete_fetch(fetch, false);
+        } else if (nothing_yet && (fetch->reused || fetch->answered_here > 0)) {
+            resend_requests(fetch);
+        } else {
+            end_fetch(fetch, received == 0 ? "closed" : "recv");
+        }
+        return;
+    }
+}
+
+
+static void handle_event(Fetch *fetch)
+{
+    switch (fetch->state) {
+        case FETCH_CONNECTING:
+            handle_connecting(fetch);
+            if (fetch->state != FETCH_SENDING) {
+                break;
+            }
+            // The request likely fits the socket buffer already
+            // fall through
+        case FETCH_SENDING:
+            handle_sending(fetch);
+            break;
+        case FETCH_RECEIVING:
+            handle_receiving(fetch);
+            break;
+        default:
+            break;
+    }
+}
+
+
+// Lookups finished: continue the fetches waiting for them
+static void resume_resolving(Fetch *fetches, int count)
+{
+    resolver_acknowledge();
+    for (int i = 0; i < count; i++) {
+        if (fetches[i].state == FETCH_RESOLVING) {
+            resolve_and_connect(&fetches[i]);
+        }
+    }
+}
+
+
+static void expire_fetches(Fetch *fetches, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (fetches[i].state != FETCH_IDLE &&
+            elapsed_ms(&fetches[i].started) >= FETCH_TIMEOUT * 1000L) {
+            end_fetch(&fetches[i], "timeout");
+        }
+    }
+}
+
+
+int run_batch(FILE *urls, int concurrency, int pipeline)
+{
+    Fetch *fetches = calloc((size_t) concurrency, sizeof(Fetch));
+    struct epoll_event *events = malloc(concurrency * sizeof(struct epoll_event));
+    epoll_fd = epoll_create1(0);
+    int resolver_fd = init_resolver();
+    struct epoll_event resolver_event;
+    resolver_event.events = EPOLLIN;
+    resolver_event.data.ptr = NULL; // not a fetch
+    if (fetches == NULL || events == NULL || epoll_fd == -1 || resolver_fd == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, resolver_fd, &resolver_event) == -1) {
+        perror("batch");
+        close_resolver();
+        if (epoll_fd != -1) {
+            close(epoll_fd);
+            epoll_fd = -1;
+        }
+        free(fetches);
+        free(events);
+        return -1;
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    bool more_urls = true;
+    while (true) {
+        // Start the next URLs in the free slots
+        for (int i = 0; i < concurrency && more_urls; i++) {
+            // A fetch can end as it starts, e.g. on a bad URL
+            while (fetches[i].state == FETCH_IDLE && more_urls) {
+                char *url = next_url(urls);
+                if (url == NULL) {
+                    more_urls = false;
+                } else {
+                    start_fetch(&fetches[i], url, urls, pipeline);
+                }
+            }
+        }
+        if (in_flight == 0 && !more_urls) {
+            break;
+        }
+
+        int ready = epoll_wait(epoll_fd, events, concurrency, 1000);
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                resume_resolving(fetches, concurrency);
+            } else {
+                handle_event(events[i].data.ptr);
+            }
+        }
+        expire_fetches(fetches, concurrency);
+    }
+
+    for (int i = 0; i < concurrency; i++) {
+        if (fetches[i].state != FETCH_IDLE) {
+            end_fetch(&fetches[i], "aborted");
+        }
+    }
+    double seconds = elapsed_ms(&started) / 1000.0;
+    printf("Fetched %ld URLs in %.2f s (%.0f/s), %ld failed\n", fetched,
+           seconds, seconds > 0 ? (fetched + failed) / seconds : 0.0, failed);
+    close_resolver();
+    close(epoll_fd);
+    epoll_fd = -1;
+    free(fetches);
+    free(events);
+    return (int) failed;
+}
@@ -0,0 +1,61 @@
+#ifndef _BATCH_FETCH_H_
+#define _BATCH_FETCH_H_
+
+#include "http_parser.h"
+#include "url.h"
+#include "resolver.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define DEFAULT_CONCURRENCY 32
+#define MAX_CONCURRENCY 10000
+// Seconds a fetch may take before it is given up
+#define FETCH_TIMEOUT 30
+// Most requests written back to back on one connection
+#define MAX_PIPELINE 64
+
+typedef enum FetchState {
+    FETCH_IDLE,
+    FETCH_RESOLVING,
+    FETCH_CONNECTING,
+    FETCH_SENDING,
+    FETCH_RECEIVING
+} FetchState;
+
+// URLs of one host being fetched on a non-blocking socket. With pipelining
+// their requests are all written at once and the responses come in order.
+typedef struct Fetch {
+    FetchState state;
+    int sock;
+    bool reused;             // the connection came from the pool
+    char host[URL_HOST_SIZE];
+    int port;
+    HostAddresses addresses;
+    int address;             // the next one to connect to
+    char *urls[MAX_PIPELINE];
+    int num_urls;
+    int answered;            // URLs whose response was parsed
+    int answered_here;       // of them, on the current connection
+    char *request;           // the requests of the unanswered URLs
+    size_t request_len;
+    size_t sent;
+    HttpParser parser;       // of the response to urls[answered]
+    struct timespec started;
+} Fetch;
+
+/**
+ * Fetch the URLs listed one per line (empty lines and lines starting with
+ * '#' are skipped), up to concurrency of them at a time, and print a line
+ * per URL with its status, body bytes and time, then a summary. Redirects
+ * are reported, not followed.
+ * @param urls the list, read as the fetches progress
+ * @param concurrency most connections in use
+ * @param pipeline most requests in flight on a connection: consecutive URLs
+ * of the same host and port are sent back to back, 1 to wait for each
+ * response before sending the next request
+ * @return the number of URLs that failed, -1 if the engine couldn't start.
+ */
+int run_batch(FILE *urls, int concurrency, int pipeline);
+
+#endif /* _BATCH_FETCH_H_ */
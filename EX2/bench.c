@@ -0,0 +1,454 @@
+#include "bench.h"
+#include "resolver.h"
+#include "url.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define BENCH_BUFFER_SIZE 65536
+#define BENCH_EVENTS 256
+
+// Shared by the threads, written before they start
+static char request[URL_PATH_SIZE + URL_HOST_SIZE + 64];
+static size_t request_len;
+static struct sockaddr_storage target;
+static socklen_t target_len;
+static struct timespec deadline;
+static bool has_deadline;
+static long max_requests;
+static long issued = 0; // requests started, when max_requests is set
+
+
+static bool deadline_passed(void)
+{
+    if (!has_deadline) {
+        return false;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline.tv_sec ||
+           (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+
+static bool requests_exhausted(void)
+{
+    return max_requests > 0 && __atomic_load_n(&issued, __ATOMIC_RELAXED) >= max_requests;
+}
+
+
+static long elapsed_us(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L +
+           (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+
+static int watch(BenchConnection *connection, uint32_t events, int operation)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = connection;
+    return epoll_ctl(connection->thread->epoll_fd, operation, connection->sock, &event);
+}
+
+
+// Close the connection, it is opened again by the thread loop
+static void reset_connection(BenchConnection *connection)
+{
+    if (connection->sock != -1) {
+        close(connection->sock);
+        connection->sock = -1;
+    }
+    connection->connecting = false;
+    connection->waiting = false;
+}
+
+
+static void bench_connect(BenchConnection *connection)
+{
+    connection->sock = socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (connection->sock == -1) {
+        connection->thread->connect_errors++;
+        return;
+    }
+    int result = connect(connection->sock, (struct sockaddr *) &target, target_len);
+    if ((result == -1 && errno != EINPROGRESS) ||
+        watch(connection, EPOLLOUT, EPOLL_CTL_ADD) == -1) {
+        connection->thread->connect_errors++;
+        reset_connection(connection);
+        return;
+    }
+    connection->connecting = true;
+}
+
+
+static void send_request(BenchConnection *connection)
+{
+    while (connection->sent < request_len) {
+        ssize_t sent = send(connection->sock, request + connection->sent,
+                            request_len - connection->sent, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            connection->thread->write_errors++;
+            reset_connection(connection);
+            return;
+        }
+        connection->sent += (size_t) sent;
+    }
+    if (watch(connection, EPOLLIN, EPOLL_CTL_MOD) == -1) {
+        connection->thread->read_errors++;
+        reset_connection(connection);
+    }
+}
+
+
+static void next_request(BenchConnection *connection)
+{
+    if (max_requests > 0 &&
+        __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED) >= max_requests) {
+        reset_connection(connection);
+        return;
+    }
+    connection->waiting = true;
+    connection->sent = 0;
+    clock_gettime(CLOCK_MONOTONIC, &connection->sent_at);
+    http_parser_init(&connection->parser, NULL, NULL);
+    if (watch(connection, EPOLLOUT, EPOLL_CTL_MOD) == -1) {
+        connection->thread->write_errors++;
+        reset_connection(connection);
+        return;
+    }
+    send_request(connection);
+}
+
+
+static void complete_request(BenchConnection *connection, bool reusable)
+{
+    BenchThread *thread = connection->thread;
+    int status = connection->parser.status_code;
+    histogram_record(&thread->latency, elapsed_us(&connection->sent_at));
+    thread->completed++;
+    if (status < 200 || status >= 400) {
+        thread->bad_status++;
+    }
+    connection->waiting = false;
+    if (reusable && connection->parser.keep_alive) {
+        next_request(connection);
+    } else {
+        reset_connection(connection);
+    }
+}
+
+
+static void handle_writable(BenchConnection *connection)
+{
+    if (connection->connecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(connection->sock, SOL_SOCKET, SO_ERROR, &error, &len) == -1 ||
+            error != 0) {
+            connection->thread->connect_errors++;
+            reset_connection(connection);
+            return;
+        }
+        connection->connecting = false;
+        next_request(connection);
+        return;
+    }
+    send_request(connection);
+}
+
+
+static void handle_readable(BenchConnection *connection, char *buffer)
+{
+    BenchThread *thread = connection->thread;
+    while (connection->waiting) {
+        ssize_t received = recv(connection->sock, buffer, BENCH_BUFFER_SIZE, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (received <= 0) {
+            // The end of the connection may end a response framed by it
+            if (http_parser_finish(&connection->parser) == 0) {
+                complete_request(connection, false);
+            } else {
+                thread->read_errors++;
+            }
+            reset_connection(connection);
+            return;
+        }
+        thread->bytes += received;
+        ssize_t used = http_parser_feed(&connection->parser, buffer, (size_t) received);
+        if (used == -1) {
+            thread->read_errors++;
+            reset_connection(connection);
+            return;
+        }
+        if (http_parser_done(&connection->parser)) {
+            // Bytes past the response were not asked for
+            complete_request(connection, used == received);
+            return;
+        }
+    }
+}
+
+
+static void expire_requests(BenchThread *thread)
+{
+    for (int i = 0; i < thread->num_connections; i++) {
+        BenchConnection *connection = &thread->connections[i];
+        if (connection->waiting &&
+            elapsed_us(&connection->sent_at) >= BENCH_TIMEOUT * 1000000L) {
+            thread->timeouts++;
+            reset_connection(connection);
+        }
+    }
+}
+
+
+static void *bench_thread(void *arg)
+{
+    BenchThread *thread = arg;
+    char buffer[BENCH_BUFFER_SIZE];
+    struct epoll_event events[BENCH_EVENTS];
+    while (!deadline_passed()) {
+        // (Re)open the connections that are closed
+        bool open = false;
+        for (int i = 0; i < thread->num_connections; i++) {
+            BenchConnection *connection = &thread->connections[i];
+            if (connection->sock == -1 && !requests_exhausted()) {
+                bench_connect(connection);
+            }
+            open |= connection->sock != -1;
+        }
+        if (!open) {
+            break;
+        }
+
+        int ready = epoll_wait(thread->epoll_fd, events, BENCH_EVENTS, 100);
+        for (int i = 0; i < ready; i++) {
+            BenchConnection *connection = events[i].data.ptr;
+            if (connection->sock == -1) {
+                continue;
+            }
+            if (connection->connecting || connection->sent < request_len) {
+                handle_writable(connection);
+            } else {
+                handle_readable(connection, buffer);
+            }
+        }
+        expire_requests(thread);
+    }
+    for (int i = 0; i < thread->num_connections; i++) {
+        reset_connection(&thread->connections[i]);
+    }
+    return NULL;
+}
+
+
+// Send one unmeasured request on a blocking socket. Returns 0 if the
+// whole response arrived.
+static int warm_up(int sock)
+{
+    char buffer[BENCH_BUFFER_SIZE];
+    HttpParser parser;
+    http_parser_init(&parser, NULL, NULL);
+    struct timeval timeout = {BENCH_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (send(sock, request, request_len, MSG_NOSIGNAL) != (ssize_t) request_len) {
+        return -1;
+    }
+    while (!http_parser_done(&parser)) {
+        ssize_t received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            return http_parser_finish(&parser);
+        }
+        if (http_parser_feed(&parser, buffer, (size_t) received) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Find an address of the host that answers the request
+static int find_target(const char *host, int port)
+{
+    HostAddresses addresses;
+    if (resolve_host(host, port, &addresses) != 0) {
+        fprintf(stderr, "No such host\n");
+        return -1;
+    }
+    for (int i = 0; i < addresses.count; i++) {
+        struct sockaddr *address = (struct sockaddr *) &addresses.addresses[i];
+        int sock = socket(address->sa_family, SOCK_STREAM, 0);
+        if (sock == -1) {
+            continue;
+        }
+        int result = connect(sock, address, addresses.lengths[i]);
+        if (result == 0) {
+            result = warm_up(sock);
+        }
+        close(sock);
+        if (result == 0) {
+            memcpy(&target, address, addresses.lengths[i]);
+            target_len = addresses.lengths[i];
+            return 0;
+        }
+    }
+    fprintf(stderr, "The server didn't answer\n");
+    return -1;
+}
+
+
+static void format_latency(char *text, size_t size, double us)
+{
+    if (us < 1000) {
+        snprintf(text, size, "%.0fus", us);
+    } else if (us < 1000000) {
+        snprintf(text, size, "%.2fms", us / 1000);
+    } else {
+        snprintf(text, size, "%.2fs", us / 1000000);
+    }
+}
+
+
+static void format_bytes(char *text, size_t size, double bytes)
+{
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(text, size, "%.2f%s", bytes, units[unit]);
+}
+
+
+static void print_report(const BenchThread *threads, int num_threads, double seconds)
+{
+    static Histogram latency;
+    histogram_init(&latency);
+    long completed = 0, bytes = 0, bad_status = 0;
+    long connect_errors = 0, read_errors = 0, write_errors = 0, timeouts = 0;
+    for (int i = 0; i < num_threads; i++) {
+        histogram_merge(&latency, &threads[i].latency);
+        completed += threads[i].completed;
+        bytes += threads[i].bytes;
+        bad_status += threads[i].bad_status;
+        connect_errors += threads[i].connect_errors;
+        read_errors += threads[i].read_errors;
+        write_errors += threads[i].write_errors;
+        timeouts += threads[i].timeouts;
+    }
+
+    char mean[32], p50[32], p99[32], p999[32], max[32], read[32], rate[32];
+    format_latency(mean, sizeof(mean), histogram_mean(&latency));
+    format_latency(p50, sizeof(p50), (double) histogram_percentile(&latency, 50));
+    format_latency(p99, sizeof(p99), (double) histogram_percentile(&latency, 99));
+    format_latency(p999, sizeof(p999), (double) histogram_percentile(&latency, 99.9));
+    format_latency(max, sizeof(max), (double) latency.max);
+    format_bytes(read, sizeof(read), (double) bytes);
+    format_bytes(rate, sizeof(rate), seconds > 0 ? bytes / seconds : 0);
+    printf("  Latency   mean %s  p50 %s  p99 %s  p99.9 %s  max %s\n",
+           mean, p50, p99, p999, max);
+    printf("  %ld requests in %.2fs, %s read\n", completed, seconds, read);
+    if (bad_status > 0) {
+        printf("  Non-2xx or 3xx responses: %ld\n", bad_status);
+    }
+    if (connect_errors + read_errors + write_errors + timeouts > 0) {
+        printf("  Socket errors: connect %ld, read %ld, write %ld, timeout %ld\n",
+               connect_errors, read_errors, write_errors, timeouts);
+    }
+    printf("Requests/sec: %.2f\n", seconds > 0 ? completed / seconds : 0.0);
+    printf("Transfer/sec: %s\n", rate);
+}
+
+
+int run_bench(const BenchOptions *options)
+{
+    char host[URL_HOST_SIZE], path[URL_PATH_SIZE];
+    int port;
+    if (split_url(options->url, host, path, &port) != 0) {
+        fprintf(stderr, "Invalid URL\n");
+        return -1;
+    }
+    char host_header[URL_HOST_HEADER_SIZE];
+    format_host_header(host, port, host_header);
+    request_len = (size_t) snprintf(request, sizeof(request),
+                                    "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, host_header);
+    if (find_target(host, port) != 0) {
+        return -1;
+    }
+
+    int num_threads = options->threads < options->connections ? options->threads
+                                                              : options->connections;
+    BenchThread *threads = calloc((size_t) num_threads, sizeof(BenchThread));
+    BenchConnection *connections = calloc((size_t) options->connections,
+                                          sizeof(BenchConnection));
+    if (threads == NULL || connections == NULL) {
+        perror("bench");
+        free(threads);
+        free(connections);
+        return -1;
+    }
+
+    max_requests = options->requests;
+    issued = 0;
+    has_deadline = options->seconds > 0;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    deadline = started;
+    deadline.tv_sec += options->seconds;
+    if (has_deadline) {
+        printf("Running %ds test @ %s\n", options->seconds, options->url);
+    } else {
+        printf("Running %ld requests @ %s\n", options->requests, options->url);
+    }
+    printf("  %d threads and %d connections\n", num_threads, options->connections);
+
+    // Spread the connections evenly over the threads
+    int first = 0;
+    int started_threads = 0;
+    for (int i = 0; i < num_threads; i++) {
+        BenchThread *thread = &threads[i];
+        thread->num_connections = options->connections / num_threads +
+                                  (i < options->connections % num_threads);
+        thread->connections = connections + first;
+        first += thread->num_connections;
+        for (int j = 0; j < thread->num_connections; j++) {
+            thread->connections[j].sock = -1;
+            thread->connections[j].thread = thread;
+        }
+        histogram_init(&thread->latency);
+        thread->epoll_fd = epoll_create1(0);
+        if (thread->epoll_fd == -1 ||
+            pthread_create(&thread->thread, NULL, bench_thread, thread) != 0) {
+            perror("bench thread");
+            if (thread->epoll_fd != -1) {
+                close(thread->epoll_fd);
+            }
+            break;
+        }
+        started_threads++;
+    }
+    for (int i = 0; i < started_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        close(threads[i].epoll_fd);
+    }
+
+    print_report(threads, started_threads, elapsed_us(&started) / 1000000.0);
+    free(threads);
+    free(connections);
+    return started_threads == num_threads ? 0 : -1;
+}
@@ -0,0 +1,63 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include "histogram.h"
+#include "http_parser.h"
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_CONNECTIONS 10
+#define BENCH_DEFAULT_THREADS 2
+#define BENCH_DEFAULT_SECONDS 10
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_CONNECTIONS 10000
+// Seconds a response may take before the connection is given up
+#define BENCH_TIMEOUT 30
+
+typedef struct BenchOptions {
+    const char *url;
+    int connections;
+    int threads;
+    int seconds;    // 0 to only stop after requests
+    long requests;  // 0 to only stop after seconds
+} BenchOptions;
+
+struct BenchThread;
+
+// A keep-alive connection sending one request after the other
+typedef struct BenchConnection {
+    int sock;
+    bool connecting;
+    bool waiting;              // a request is in flight
+    size_t sent;               // bytes of the request written
+    struct timespec sent_at;
+    HttpParser parser;
+    struct BenchThread *thread;
+} BenchConnection;
+
+// A thread running its connections on its own epoll instance
+typedef struct BenchThread {
+    pthread_t thread;
+    int epoll_fd;
+    BenchConnection *connections;
+    int num_connections;
+    long completed;
+    long bytes;
+    long bad_status;           // responses that aren't 2xx or 3xx
+    long connect_errors;
+    long read_errors;
+    long write_errors;
+    long timeouts;
+    Histogram latency;         // in microseconds
+} BenchThread;
+
+/**
+ * Send the GET request of a URL over and over on keep-alive connections
+ * spread over threads, then print the request rate, the throughput and the
+ * latency percentiles.
+ * @return 0 on success, -1 if the benchmark couldn't start.
+ */
+int run_bench(const BenchOptions *options);
+
+#endif /* _BENCH_H_ */
@@ -10,11 +10,30 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdbool.h>
-
-#define BUFFER_SIZE 4096
+#include "conn_pool.h"
+#include "url.h"
+#include "batch_fetch.h"
+#include "http_parser.h"
+#include "resolver.h"
+#include "bench.h"
+#include "http_cache.h"
+#include "range_download.h"
+#include "zero_copy.h"
+
+#define BUFFER_SIZE 65536
+#define REQUEST_SIZE 2048
+#define MAX_REDIRECTS 10
+
+// Where the body of the final response goes, NULL to only count it
+FILE *body_output = NULL;
+// Where the request and the byte count are printed: stderr when the body
+// goes to stdout
+FILE *log_output = NULL;
 
 void usage() {
-    fprintf(stderr, "Usage: client [-r n <pr1=value1 pr2=value2 ...>] <URL>\n");
+    fprintf(stderr, "Usage: client [-o <file|->] [-C <cache-dir>] [-P segments] [-r n <pr1=value1 pr2=value2 ...>] <URL>\n"
+                    "       client -b <url-file|-> [-c concurrency] [-p pipeline]\n"
+                    "       client -B <URL> [-c connections] [-t threads] [-d seconds] [-n requests]\n");
     exit(EXIT_FAILURE);
 }
 
@@ -50,38 +69,9 @@ int check_params(const char *params) {
 
 
 void parse_url(const char *url, char *host, char *path, int *port) {
-    const char *http_prefix = "http://";
-    if (strncmp(url, http_prefix, strlen(http_prefix)) != 0) {
+    if (split_url(url, host, path, port) != 0) {
         usage();
     }
-
-    url += strlen(http_prefix);
-
-    const char *colon = strchr(url, ':');
-    const char *slash = strchr(url, '/');
-
-    if (colon && (!slash || colon < slash)) {
-        strncpy(host, url, colon - url);
-        host[colon - url] = '\0';
-        *port = atoi(colon + 1);
-        if (*port <= 0 || *port >= 65536) {
-            usage();
-        }
-    } else {
-        if (slash) {
-            strncpy(host, url, slash - url);
-            host[slash - url] = '\0';
-        } else {
-            strcpy(host, url);
-        }
-        *port = 80; // default HTTP port
-    }
-
-    if (slash) {
-        strcpy(path, slash);
-    } else {
-        strcpy(path, "/");
-    }
 }
 
 bool starts_with_www(const char *host) {
@@ -110,129 +100,395 @@ char *ensure_www_prefix(const char *host) {
     return new_host; // Return the modified host
 }
 
-void build_request(char *request, const char *host, const char *path, const char *params) {
-    char * new_host = ensure_www_prefix(host);
+// headers: extra header lines, each ending with "\r\n". An IPv6 address
+// isn't a name, so it doesn't get the "www." prefix.
+void build_request(char *request, const char *host, int port, const char *path,
+                   const char *params, const char *headers) {
+    char host_header[URL_HOST_HEADER_SIZE];
+    char * new_host = strchr(host, ':') ? strdup(host) : ensure_www_prefix(host);
+    if (new_host == NULL) {
+        perror("Memory allocation failed");
+        exit(1);
+    }
+    format_host_header(new_host, port, host_header);
     if (params && strlen(params) > 1) {
-        snprintf(request, 1024, "GET %s%s HTTP/1.1\r\nHost: %s\r\n\r\n", path, params, new_host);
+        snprintf(request, REQUEST_SIZE, "GET %s%s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, params, host_header, headers);
     } else {
-        snprintf(request, 1024, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, new_host);
+        snprintf(request, REQUEST_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, host_header, headers);
     }
     free(new_host);
 }
 
+// Connect to the first address of the host (IPv4 or IPv6) that accepts.
+// The addresses come from the resolver cache, so redirects to the same
+// host skip the lookup.
 int connect_to_host(const char *host, int port) {
+    HostAddresses server;
+    if (resolve_host(host, port, &server) != 0) {
+        fprintf(stderr, "No such host\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // Connect to server
-        struct sockaddr_in server_addr;
-        struct hostent *server;
-
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
+    for (int i = 0; i < server.count; i++) {
+        struct sockaddr *server_addr = (struct sockaddr *) &server.addresses[i];
+        int sock = socket(server_addr->sa_family, SOCK_STREAM, 0);
         if (sock < 0) {
-            perror("Socket creation failed");
-            exit(EXIT_FAILURE);
+            continue;
+        }
+        if (connect(sock, server_addr, server.lengths[i]) == 0) {
+            return sock;
         }
+        close(sock);
+    }
+    perror("Connection failed");
+    exit(EXIT_FAILURE);
+}
 
-        server = gethostbyname(host);
-        if (server == NULL) {
-            fprintf(stderr, "No such host\n");
+
+// Returns -1 if the request couldn't be sent, e.g. on a pooled connection
+// the server closed meanwhile
+int send_http_request(int sock, const char *host, int port, const char *path,const char *params,
+                      const char *headers) {
+    char request[REQUEST_SIZE];
+
+    // Create the HTTP GET request
+    build_request(request,host,port,path,params,headers);
+    fprintf(log_output, "HTTP request =\n%s\nLEN = %d\n", request, (int) strlen(request));
+
+    // Send the HTTP request
+    if (send(sock, request, strlen(request), MSG_NOSIGNAL) == -1) {
+        perror("send failed");
+        return -1;
+    }
+    return 0;
+}
+
+
+int handle_response(int sock, const char *host, int port, char *location,
+                    const char *cache_key, CacheEntry *stale);
+
+
+// Write the body of a cached response as if it was received
+void serve_cached(const CacheEntry *entry) {
+    long bytes = cache_copy_body(entry, body_output);
+    if (bytes < 0) {
+        perror("Reading the cache failed");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(log_output, "\nServed from the cache: %ld body bytes\n", bytes);
+}
+
+
+// Request path from host:port, on an idle pooled connection if there is
+// one, and handle the response. location gets the target of a redirect,
+// empty if the response isn't one. With a cache, a fresh stored response
+// is used without a request, and a stale one is revalidated.
+void request_once(const char *host, int port, const char *path, const char *params,
+                  char *location) {
+    char key[CACHE_KEY_SIZE];
+    char validators[1024] = "";
+    CacheEntry entry;
+    bool cached = false;
+    const char *cache_key = NULL;
+    if (cache_enabled()) {
+        snprintf(key, sizeof(key), "http://%s:%d%s%s", host, port, path, params ? params : "");
+        cache_key = key;
+        cached = cache_lookup(key, &entry) == 0;
+        if (cached && cache_is_fresh(&entry)) {
+            location[0] = '\0';
+            serve_cached(&entry);
+            return;
+        }
+        if (cached) {
+            cache_validators(&entry, validators, sizeof(validators));
+        }
+    }
+
+    int status = -1;
+    int sock = pool_take(host, port);
+    bool reused = sock >= 0;
+    if (!reused) {
+        sock = connect_to_host(host, port);
+    }
+    CacheEntry *stale = cached ? &entry : NULL;
+    if (send_http_request(sock, host, port, path, params, validators) == 0) {
+        status = handle_response(sock, host, port, location, cache_key, stale);
+    } else {
+        close(sock); // handle_response closes it otherwise
+    }
+    if (status == -1 && !reused) {
+        exit(EXIT_FAILURE);
+    }
+    if (status == -1) {
+        // The server closed the idle connection just as it was reused
+        sock = connect_to_host(host, port);
+        if (send_http_request(sock, host, port, path, params, validators) != 0 ||
+            (status = handle_response(sock, host, port, location, cache_key, stale)) == -1) {
             exit(EXIT_FAILURE);
         }
+    }
+    if (cached && status == 304) {
+        // Still valid: the stored body is the response
+        serve_cached(&entry);
+    }
+}
 
-        memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sin_family = AF_INET;
-        memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-        server_addr.sin_port = htons(port);
 
-        if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-            perror("Connection failed");
+// Request path from host:port and follow the redirects, one after the
+// other: at most MAX_REDIRECTS of them, and never back to a URL already
+// requested. Redirects to the same host reuse the pooled connection.
+void fetch(const char *host, int port, const char *path, const char *params) {
+    char current_host[URL_HOST_SIZE], current_path[URL_PATH_SIZE];
+    char location[URL_PATH_SIZE];
+    char visited[MAX_REDIRECTS + 1][URL_HOST_SIZE + URL_PATH_SIZE * 2];
+    int current_port = port;
+    snprintf(current_host, sizeof(current_host), "%s", host);
+    snprintf(current_path, sizeof(current_path), "%s", path);
+
+    for (int hops = 0; ; hops++) {
+        const char *query = hops == 0 && params ? params : "";
+        snprintf(visited[hops], sizeof(visited[hops]), "%s:%d%s%s",
+                 current_host, current_port, current_path, query);
+        request_once(current_host, current_port, current_path, query, location);
+        if (location[0] == '\0') {
+            return;
+        }
+        if (hops == MAX_REDIRECTS) {
+            fprintf(stderr, "Too many redirects\n");
             exit(EXIT_FAILURE);
         }
-        return sock;
+        // Handle only HTTP URLs
+        if (resolve_location(location, current_host, &current_port, current_path) != 0) {
+            usage();
+        }
+        char next[sizeof(visited[0])];
+        snprintf(next, sizeof(next), "%s:%d%s", current_host, current_port, current_path);
+        for (int i = 0; i <= hops; i++) {
+            if (strcmp(visited[i], next) == 0) {
+                fprintf(stderr, "Redirect loop at %s\n", location);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
 }
 
 
-void send_http_request(int sock, const char *host, const char *path,const char *params) {
-    char request[1024];
+// Where the body of a response goes
+typedef struct ResponseSink {
+    const HttpParser *parser;
+    const char *cache_key;  // NULL if the response isn't to be cached
+    bool store_started;
+    CacheStore store;
+} ResponseSink;
 
-    // Create the HTTP GET request
-    build_request(request,host,path,params);
-    printf("HTTP request =\n%s\nLEN = %d\n", request, strlen(request));
 
-    // Send the HTTP request
-    if (send(sock, request, strlen(request), 0) == -1) {
-        perror("send failed");
-        close(sock);
+// Store the response in the cache, if it can be, once its head is parsed
+void start_store(ResponseSink *sink) {
+    sink->store_started = true;
+    cache_begin_store(sink->cache_key, sink->parser, &sink->store);
+}
+
+
+// Write the body of a response to the output and the cache, unless it is a
+// redirect's
+void write_body(void *context, const char *data, size_t len) {
+    ResponseSink *sink = context;
+    if (sink->parser->status_code >= 300 && sink->parser->status_code < 400) {
         return;
     }
-
+    if (sink->cache_key != NULL && !sink->store_started) {
+        start_store(sink);
+    }
+    if (sink->store.file != NULL && fwrite(data, 1, len, sink->store.file) != len) {
+        cache_end_store(&sink->store, false);
+    }
+    if (body_output != NULL && fwrite(data, 1, len, body_output) != len) {
+        perror("Writing the body failed");
+        exit(EXIT_FAILURE);
+    }
 }
 
 
-void handle_response(int sock) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    char *location_header = NULL;
-    int status_code = 0;
+// Whether the rest of the body can move from the socket straight to the
+// output, without going through the parser: it is framed by its length or
+// the end of the connection, isn't a redirect's and isn't being cached
+bool can_copy_body(const HttpParser *parser, const char *cache_key) {
+    return body_output != NULL && cache_key == NULL &&
+           (parser->state == PARSE_BODY_LENGTH || parser->state == PARSE_BODY_CLOSE) &&
+           (parser->status_code < 300 || parser->status_code >= 400);
+}
 
-    // Read the HTTP response
-    while ((bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0'; // Null-terminate the buffer
 
-        // Print the response to the console
-        //printf("%s", buffer);
+// Move the rest of the body to the output with copy_socket_to_fd (spliced,
+// not copied through user space) and count it in the parser.
+// Returns the number of bytes moved.
+long copy_body(int sock, HttpParser *parser) {
+    long wanted = parser->state == PARSE_BODY_LENGTH ? parser->remaining : -1;
+    if (fflush(body_output) != 0) {
+        perror("Writing the body failed");
+        exit(EXIT_FAILURE);
+    }
+    long moved = copy_socket_to_fd(sock, fileno(body_output), wanted);
+    if (moved == -1) {
+        perror("Writing the body failed");
+        exit(EXIT_FAILURE);
+    }
+    http_parser_skip_body(parser, moved);
+    return moved;
+}
+
 
-        // Parse the HTTP status code (only checks the first line)
-        if (status_code == 0) { // Parse status code only once
-            sscanf(buffer, "HTTP/1.1 %d", &status_code);
+// Read a whole response through the incremental parser, which frames the
+// body by its Content-Length, chunked encoding or the end of the connection
+// and streams it to the output (if any): the bytes received with the head
+// through one fixed-size buffer, the rest of a body framed by its length or
+// the end of the connection straight from the socket (copy_body). A
+// connection the server keeps open goes back to the pool. location (at
+// least URL_PATH_SIZE bytes) gets the Location of a redirect, empty if the
+// response isn't one. A response with a cache_key is stored in the cache
+// (if it can be) as it is received. A 304 refreshes the stale stored
+// response that was revalidated (if any) with its headers.
+// Returns the status code, -1 if nothing was received.
+int handle_response(int sock, const char *host, int port, char *location,
+                    const char *cache_key, CacheEntry *stale) {
+    char buffer[BUFFER_SIZE];
+    long total_bytes = 0;
+    ssize_t bytes_received = 0;
+    ssize_t parsed = 0;
+    HttpParser parser;
+    ResponseSink sink = {&parser, cache_key, false, {NULL, "", ""}};
+    bool use_sink = body_output != NULL || cache_key != NULL;
+    http_parser_init(&parser, use_sink ? write_body : NULL, &sink);
+
+    while (!http_parser_done(&parser)) {
+        if (can_copy_body(&parser, cache_key)) {
+            long moved = copy_body(sock, &parser);
+            total_bytes += moved;
+            parsed = bytes_received; // nothing read past the body
+            if (!http_parser_done(&parser)) {
+                break; // the connection ended
+            }
+            continue;
         }
-        if (status_code >= 200 && status_code < 300) { // Parse status code only once
-            printf("\nTotal received response bytes: %d\n",bytes_received);
+        bytes_received = recv(sock, buffer, sizeof(buffer), 0);
+        if (bytes_received <= 0) {
             break;
         }
-        // Look for "Location" header if status is 3XX
-        if (status_code >= 300 && status_code < 400) {
-            printf("\nTotal received response bytes: %d\n",bytes_received);
-            char *location = strstr(buffer, "Location: ");
-            if (location) {
-                location += 10; // Move past "Location: "
-                char *end = strchr(location, '\r'); // Find end of the line
-                if (end) *end = '\0'; // Null-terminate the URL
-
-                location_header = strdup(location); // Save the new URL
-                break; // Exit loop once the location is found
-            }
+        total_bytes += bytes_received;
+        parsed = http_parser_feed(&parser, buffer, (size_t) bytes_received);
+        if (parsed == -1) {
+            fprintf(stderr, "Malformed response\n");
+            close(sock);
+            exit(EXIT_FAILURE);
         }
+    }
+    if (total_bytes == 0) {
+        close(sock);
+        return -1;
+    }
+    if (!http_parser_done(&parser) && http_parser_finish(&parser) != 0) {
+        fprintf(stderr, "The response was cut short\n");
+    }
+    if (cache_key != NULL) {
+        bool complete = http_parser_done(&parser);
+        if (complete && !sink.store_started) {
+            start_store(&sink); // a response without a body
+        }
+        cache_end_store(&sink.store, complete);
+    }
+    if (stale != NULL && parser.status_code == 304) {
+        cache_refresh(stale, parser.head);
+    }
+    fprintf(log_output, "\nTotal received response bytes: %ld\n", total_bytes);
 
+    // Bytes past the response were not asked for
+    if (parser.keep_alive && parsed == bytes_received) {
+        pool_put(host, port, sock);
+    } else {
+        close(sock);
     }
 
-    // Handle redirection if 3XX and Location header found
-    if (status_code >= 300 && status_code < 400 && location_header) {
-        if (strncmp(location_header, "http://", 7) == 0) { // Handle only HTTP URLs
-            //printf("\nRedirecting to: %s\n", location_header);
-            close(sock); // Close the current connection
-            // Parse the new URL
-            char host[256], path[256];
-            int port;
-            parse_url(location_header, host, path, &port);
-
-            // Now, use the parsed components to initiate a new connection
-            int new_sock = connect_to_host(host, port); // You'll need a function to handle socket connection
-            if (new_sock != -1) {
-                // Send a new HTTP request to the new URL (using the parsed host and path)
-                //add NULL only
-                send_http_request(new_sock, host, path,NULL); // Implement this function to send the request
-                handle_response(new_sock); // Recursively handle the new response
-                close(sock);
-            } else {
-                printf("Unsupported redirection to non-HTTP URL.\n");
-            }
-            free(location_header); // Free dynamically allocated memory
+    // Pass the target of a 3XX back to fetch, which follows it
+    const char *redirect = http_parser_header(&parser, "Location");
+    location[0] = '\0';
+    if (redirect != NULL && parser.status_code >= 300 && parser.status_code < 400) {
+        size_t len = strcspn(redirect, "\r");
+        if (len >= URL_PATH_SIZE) {
+            fprintf(stderr, "Redirect location too long\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(location, redirect, len);
+        location[len] = '\0';
+    }
+    return parser.status_code;
+}
+
+
+// client -B <URL> [-c connections] [-t threads] [-d seconds] [-n requests]:
+// benchmark the URL
+int bench_mode(int argc, char *argv[]) {
+    BenchOptions options;
+    options.url = argc >= 3 ? argv[2] : NULL;
+    options.connections = BENCH_DEFAULT_CONNECTIONS;
+    options.threads = BENCH_DEFAULT_THREADS;
+    options.seconds = 0;
+    options.requests = 0;
+    if (argc < 3 || argc % 2 == 0) {
+        usage();
+    }
+    for (int i = 3; i < argc; i += 2) {
+        long value = atol(argv[i + 1]);
+        if (strcmp(argv[i], "-c") == 0 && value > 0 && value <= BENCH_MAX_CONNECTIONS) {
+            options.connections = (int) value;
+        } else if (strcmp(argv[i], "-t") == 0 && value > 0 && value <= BENCH_MAX_THREADS) {
+            options.threads = (int) value;
+        } else if (strcmp(argv[i], "-d") == 0 && value > 0 && value <= 86400) {
+            options.seconds = (int) value;
+        } else if (strcmp(argv[i], "-n") == 0 && value > 0) {
+            options.requests = value;
+        } else {
+            usage();
         }
-        else{
+    }
+    if (options.seconds == 0 && options.requests == 0) {
+        options.seconds = BENCH_DEFAULT_SECONDS;
+    }
+    int result = run_bench(&options);
+    close_resolver();
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+// client -b <url-file|-> [-c concurrency] [-p pipeline]: fetch the listed
+// URLs concurrently
+int batch_mode(int argc, char *argv[]) {
+    int concurrency = DEFAULT_CONCURRENCY;
+    int pipeline = 1;
+    if (argc < 3 || argc % 2 == 0) {
+        usage();
+    }
+    for (int i = 3; i < argc; i += 2) {
+        int value = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "-c") == 0 && value > 0 && value <= MAX_CONCURRENCY) {
+            concurrency = value;
+        } else if (strcmp(argv[i], "-p") == 0 && value > 0 && value <= MAX_PIPELINE) {
+            pipeline = value;
+        } else {
             usage();
         }
     }
 
+    FILE *urls = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+    if (urls == NULL) {
+        perror("Opening the URL list failed");
+        exit(EXIT_FAILURE);
+    }
+    int failed = run_batch(urls, concurrency, pipeline);
+    if (urls != stdin) {
+        fclose(urls);
+    }
+    pool_close_all();
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 
@@ -241,6 +497,33 @@ int main(int argc, char *argv[]) {
     if (argc < 2) {
         usage();
     }
+    if (strcmp(argv[1], "-b") == 0) {
+        return batch_mode(argc, argv);
+    }
+    if (strcmp(argv[1], "-B") == 0) {
+        return bench_mode(argc, argv);
+    }
+    log_output = stdout;
+    const char *output = NULL;
+    int segments = 0;
+    while (argc >= 4 && (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "-C") == 0 ||
+                         strcmp(argv[1], "-P") == 0)) {
+        if (strcmp(argv[1], "-C") == 0) {
+            if (cache_open(argv[2]) != 0) {
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[1], "-P") == 0) {
+            segments = atoi(argv[2]);
+            if (segments <= 0 || segments > RANGE_MAX_SEGMENTS) {
+                usage();
+            }
+        } else {
+            output = argv[2];
+        }
+        // The rest of the arguments are parsed as without -o, -C and -P
+        argv += 2;
+        argc -= 2;
+    }
     char host[256], path[1024] = "", params[1024] = "";
     int port;
 
@@ -283,13 +566,39 @@ int main(int argc, char *argv[]) {
 
     parse_url(argv[argc-1], host, path, &port);
 
-    int sock = connect_to_host(host,port);
-
-    send_http_request(sock,host,path,params);
-
+    if (segments > 0) {
+        // Ranges are written in place, the output must be a file
+        if (output == NULL || strcmp(output, "-") == 0) {
+            usage();
+        }
+        char full_path[2048];
+        snprintf(full_path, sizeof(full_path), "%s%s", path, params);
+        int result = download_ranges(host, port, full_path, output, segments);
+        if (result != 1) {
+            close_resolver();
+            return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        fprintf(log_output, "The server doesn't send ranges, downloading at once\n");
+    }
+    if (output != NULL && strcmp(output, "-") == 0) {
+        body_output = stdout;
+        log_output = stderr;
+    } else if (output != NULL) {
+        body_output = fopen(output, "wb");
+        if (body_output == NULL) {
+            perror("Opening the output file failed");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    // Handle the server response
-    handle_response(sock);
+    // Send the request and handle the server response
+    fetch(host, port, path, params);
 
+    pool_close_all();
+    close_resolver();
+    if (body_output != NULL && fclose(body_output) != 0) {
+        perror("Writing the body failed");
+        exit(EXIT_FAILURE);
+    }
     return 0;
 }
@@ -0,0 +1,101 @@
+#include "conn_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+static PooledConnection *idle_connections = NULL; // most recent first
+
+
+static int same_origin(const PooledConnection *connection, const char *host,
+                       int port)
+{
+    return connection->port == port && strcmp(connection->host, host) == 0;
+}
+
+
+// A connection the server closed (or wrote to unasked) can't carry a request
+static int is_alive(int sock)
+{
+    char byte;
+    ssize_t result = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+// Close the connections idle for too long
+static void evict_idle(time_t now)
+{
+    PooledConnection **link = &idle_connections;
+    while (*link != NULL) {
+        PooledConnection *connection = *link;
+        if (now - connection->idle_since >= POOL_IDLE_TIMEOUT) {
+            *link = connection->next;
+            close(connection->sock);
+            free(connection);
+        } else {
+            link = &connection->next;
+        }
+    }
+}
+
+
+int pool_take(const char *host, int port)
+{
+    evict_idle(time(NULL));
+    PooledConnection **link = &idle_connections;
+    while (*link != NULL) {
+        PooledConnection *connection = *link;
+        if (!same_origin(connection, host, port)) {
+            link = &connection->next;
+            continue;
+        }
+        *link = connection->next;
+        int sock = connection->sock;
+        free(connection);
+        if (is_alive(sock)) {
+            return sock;
+        }
+        close(sock);
+    }
+    return -1;
+}
+
+
+void pool_put(const char *host, int port, int sock)
+{
+    time_t now = time(NULL);
+    evict_idle(now);
+    int idle = 0;
+    for (PooledConnection *connection = idle_connections; connection != NULL;
+         connection = connection->next) {
+        idle += same_origin(connection, host, port);
+    }
+    PooledConnection *connection = NULL;
+    if (idle < POOL_MAX_PER_HOST && strlen(host) < POOL_HOST_SIZE) {
+        connection = malloc(sizeof(PooledConnection));
+    }
+    if (connection == NULL) {
+        close(sock);
+        return;
+    }
+    connection->sock = sock;
+    strcpy(connection->host, host);
+    connection->port = port;
+    connection->idle_since = now;
+    connection->next = idle_connections;
+    idle_connections = connection;
+}
+
+
+void pool_close_all(void)
+{
+    while (idle_connections != NULL) {
+        PooledConnection *connection = idle_connections;
+        idle_connections = connection->next;
+        close(connection->sock);
+        free(connection);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _CONN_POOL_H_
+#define _CONN_POOL_H_
+
+#include <time.h>
+
+#define POOL_MAX_PER_HOST 4
+// Seconds an unused connection is kept open
+#define POOL_IDLE_TIMEOUT 30
+#define POOL_HOST_SIZE 256
+
+// An open keep-alive connection waiting for its next request
+typedef struct PooledConnection {
+    int sock;
+    char host[POOL_HOST_SIZE];
+    int port;
+    time_t idle_since;
+    struct PooledConnection *next;
+} PooledConnection;
+
+/**
+ * Take an idle connection to host:port out of the pool. Connections that
+ * timed out or that the server closed meanwhile are closed on the way.
+ * @return the socket, -1 if the pool has none for this host.
+ */
+int pool_take(const char *host, int port);
+
+/**
+ * Give back a connection whose response was read completely, so the next
+ * request to host:port can skip the handshake. The connection is closed
+ * if the host already has POOL_MAX_PER_HOST idle connections.
+ */
+void pool_put(const char *host, int port, int sock);
+
+/**
+ * Close all the idle connections.
+ */
+void pool_close_all(void);
+
+#endif /* _CONN_POOL_H_ */
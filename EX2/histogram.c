@@ -0,0 +1,105 @@
+#include "histogram.h"
+#include <string.h>
+
+#define HALF_SUB_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+
+// Values below HISTOGRAM_SUB_BUCKETS are counted exactly in the first
+// bucket. Every later bucket covers twice the values of the one before it
+// with half the sub buckets, the other half overlapping the buckets before.
+static int index_of(long value)
+{
+    int bucket = 63 - __builtin_clzl((unsigned long) value | (HISTOGRAM_SUB_BUCKETS - 1)) -
+                 (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    int sub_bucket = (int) (value >> bucket);
+    return (bucket << (HISTOGRAM_SUB_BUCKET_BITS - 1)) + sub_bucket;
+}
+
+
+// The highest value counted at an index
+static long highest_value_at(int index)
+{
+    int bucket = (index >> (HISTOGRAM_SUB_BUCKET_BITS - 1)) - 1;
+    long sub_bucket = (index & (HALF_SUB_BUCKETS - 1)) + HALF_SUB_BUCKETS;
+    if (bucket < 0) {
+        bucket = 0;
+        sub_bucket -= HALF_SUB_BUCKETS;
+    }
+    return ((sub_bucket + 1) << bucket) - 1;
+}
+
+
+void histogram_init(Histogram *histogram)
+{
+    memset(histogram->counts, 0, sizeof(histogram->counts));
+    histogram->total = 0;
+    histogram->min = 0;
+    histogram->max = 0;
+    histogram->sum = 0;
+}
+
+
+void histogram_record(Histogram *histogram, long value)
+{
+    if (value < 0) {
+        value = 0;
+    }
+    if (value > HISTOGRAM_MAX_VALUE) {
+        value = HISTOGRAM_MAX_VALUE;
+    }
+    histogram->counts[index_of(value)]++;
+    if (histogram->total == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->total++;
+    histogram->sum += (double) value;
+}
+
+
+void histogram_merge(Histogram *into, const Histogram *from)
+{
+    if (from->total == 0) {
+        return;
+    }
+    for (int i = 0; i < HISTOGRAM_COUNTS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    if (into->total == 0 || from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+}
+
+
+long histogram_percentile(const Histogram *histogram, double percentile)
+{
+    if (histogram->total == 0) {
+        return 0;
+    }
+    long wanted = (long) (percentile / 100.0 * (double) histogram->total + 0.5);
+    if (wanted < 1) {
+        wanted = 1;
+    }
+    long seen = 0;
+    for (int i = 0; i < HISTOGRAM_COUNTS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= wanted) {
+            long value = highest_value_at(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+
+double histogram_mean(const Histogram *histogram)
+{
+    return histogram->total ? histogram->sum / (double) histogram->total : 0.0;
+}
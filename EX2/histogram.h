@@ -0,0 +1,52 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+// An HDR histogram of latencies in microseconds: values are counted in
+// buckets that double in width, each split in HISTOGRAM_SUB_BUCKETS, so
+// every value is kept to 3 significant digits up to HISTOGRAM_MAX_VALUE.
+#define HISTOGRAM_SUB_BUCKET_BITS 11
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS 16
+#define HISTOGRAM_COUNTS ((HISTOGRAM_BUCKETS + 1) * (HISTOGRAM_SUB_BUCKETS / 2))
+// About 67 seconds, larger values are counted as this one
+#define HISTOGRAM_MAX_VALUE ((1L << (HISTOGRAM_BUCKETS + HISTOGRAM_SUB_BUCKET_BITS - 1)) - 1)
+
+typedef struct Histogram {
+    long counts[HISTOGRAM_COUNTS];
+    long total;
+    long min;
+    long max;
+    double sum;
+} Histogram;
+
+/**
+ * Empty a histogram.
+ */
+void histogram_init(Histogram *histogram);
+
+/**
+ * Count a value.
+ * @param histogram
+ * @param value not negative
+ */
+void histogram_record(Histogram *histogram, long value);
+
+/**
+ * Add the values of another histogram.
+ */
+void histogram_merge(Histogram *into, const Histogram *from);
+
+/**
+ * @param histogram
+ * @param percentile between 0 and 100
+ * @return the smallest value that percentile of the values don't exceed,
+ * 0 if the histogram is empty.
+ */
+long histogram_percentile(const Histogram *histogram, double percentile);
+
+/**
+ * @return the mean of the values, 0 if the histogram is empty.
+ */
+double histogram_mean(const Histogram *histogram);
+
+#endif /* _HISTOGRAM_H_ */
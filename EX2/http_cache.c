@@ -0,0 +1,338 @@
+#define _GNU_SOURCE // strptime, timegm
+#include "http_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// Width of the stored time in an entry file
+#define STORED_WIDTH 20
+
+static char cache_directory[CACHE_PATH_SIZE] = "";
+
+
+// The file of a key: its FNV-1a hash, the key itself is checked on lookup
+static int entry_file(const char *key, char *file, const char *suffix)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = key; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    }
+    int len = snprintf(file, CACHE_PATH_SIZE, "%s/%016llx%s", cache_directory,
+                       (unsigned long long) hash, suffix);
+    return len < CACHE_PATH_SIZE ? 0 : -1;
+}
+
+
+static time_t parse_http_date(const char *value)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (value == NULL || strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return (time_t) -1;
+    }
+    return timegm(&tm);
+}
+
+
+// The value of a Cache-Control directive like "max-age=60": -1 if the
+// header doesn't have the directive, 0 if it has no value
+static long cache_directive(const char *head, const char *directive)
+{
+    const char *value = http_find_header(head, "Cache-Control");
+    size_t len = strlen(directive);
+    while (value != NULL && *value != '\r' && *value != '\0') {
+        value += strspn(value, " ,");
+        if (strncasecmp(value, directive, len) == 0 &&
+            strchr("=, \r", value[len]) != NULL) {
+            return value[len] == '=' ? strtol(value + len + 1, NULL, 10) : 0;
+        }
+        value = strpbrk(value, ",\r");
+    }
+    return -1;
+}
+
+
+// Seconds a response is fresh: its max-age, or from its Date to its
+// Expires, 0 (revalidate every time) without either or with no-cache
+static long freshness_lifetime(const char *head)
+{
+    if (cache_directive(head, "no-cache") != -1) {
+        return 0;
+    }
+    long max_age = cache_directive(head, "max-age");
+    if (max_age >= 0) {
+        return max_age;
+    }
+    time_t expires = parse_http_date(http_find_header(head, "Expires"));
+    time_t date = parse_http_date(http_find_header(head, "Date"));
+    if (expires != (time_t) -1 && date != (time_t) -1 && expires > date) {
+        return (long) (expires - date);
+    }
+    return 0;
+}
+
+
+int cache_open(const char *directory)
+{
+    if (strlen(directory) >= CACHE_PATH_SIZE - 64) {
+        fprintf(stderr, "Cache directory name too long\n");
+        return -1;
+    }
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+        perror("Creating the cache directory failed");
+        return -1;
+    }
+    strcpy(cache_directory, directory);
+    return 0;
+}
+
+
+bool cache_enabled(void)
+{
+    return cache_directory[0] != '\0';
+}
+
+
+int cache_lookup(const char *key, CacheEntry *entry)
+{
+    if (!cache_enabled() || entry_file(key, entry->file, "") != 0) {
+        return -1;
+    }
+    FILE *file = fopen(entry->file, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    // The key line, the stored time, then the head up to its empty line
+    char stored_key[CACHE_KEY_SIZE];
+    long stored;
+    int result = -1;
+    if (fgets(stored_key, sizeof(stored_key), file) != NULL &&
+        strcspn(stored_key, "\n") == strlen(key) &&
+        strncmp(stored_key, key, strlen(key)) == 0 &&
+        fscanf(file, "%ld\n", &stored) == 1) {
+        size_t len = 0;
+        int c;
+        while (len < HTTP_HEAD_SIZE - 1 && (c = getc(file)) != EOF) {
+            entry->head[len++] = (char) c;
+            if (len >= 4 && memcmp(entry->head + len - 4, "\r\n\r\n", 4) == 0) {
+                entry->head[len - 2] = '\0'; // keep the end of the last line
+                entry->body_offset = ftell(file);
+                entry->stored = (time_t) stored;
+                entry->lifetime = freshness_lifetime(entry->head);
+                result = 0;
+                break;
+            }
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+
+bool cache_is_fresh(const CacheEntry *entry)
+{
+    const char *age = http_find_header(entry->head, "Age");
+    long current_age = (long) (time(NULL) - entry->stored) + (age ? atol(age) : 0);
+    return current_age < entry->lifetime;
+}
+
+
+int cache_validators(const CacheEntry *entry, char *headers, size_t size)
+{
+    const char *etag = http_find_header(entry->head, "ETag");
+    const char *modified = http_find_header(entry->head, "Last-Modified");
+    int len = 0;
+    if (etag != NULL) {
+        len += snprintf(headers + len, size - (size_t) len, "If-None-Match: %.*s\r\n",
+                        (int) strcspn(etag, "\r"), etag);
+    }
+    if (modified != NULL && (size_t) len < size) {
+        len += snprintf(headers + len, size - (size_t) len, "If-Modified-Since: %.*s\r\n",
+                        (int) strcspn(modified, "\r"), modified);
+    }
+    if ((size_t) len >= size) {
+        headers[0] = '\0';
+        return 0;
+    }
+    return len;
+}
+
+
+long cache_copy_body(const CacheEntry *entry, FILE *out)
+{
+    FILE *file = fopen(entry->file, "rb");
+    if (file == NULL || fseek(file, entry->body_offset, SEEK_SET) != 0) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        return -1;
+    }
+    char buffer[65536];
+    long total = 0;
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        if (out != NULL && fwrite(buffer, 1, read, out) != read) {
+            total = -1;
+            break;
+        }
+        total += (long) read;
+    }
+    fclose(file);
+    return total;
+}
+
+
+// Headers of a 304 that describe the 304 itself, not the stored response
+static bool updates_stored(const char *line)
+{
+    static const char *const skipped[] = {"Content-Length", "Content-Range",
+                                          "Transfer-Encoding", "Connection",
+                                          "Keep-Alive"};
+    for (size_t i = 0; i < sizeof(skipped) / sizeof(skipped[0]); i++) {
+        size_t len = strlen(skipped[i]);
+        if (strncasecmp(line, skipped[i], len) == 0 && line[len] == ':') {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Whether a head has a header line with the name of the given line that
+// updates the stored one
+static bool replaces_line(const char *head, const char *line)
+{
+    char name[128];
+    size_t len = strcspn(line, ":\r");
+    if (line[len] != ':' || len >= sizeof(name)) {
+        return false;
+    }
+    memcpy(name, line, len);
+    name[len] = '\0';
+    return updates_stored(line) && http_find_header(head, name) != NULL;
+}
+
+
+// Append the header lines of a head that pass the filter to merged, from
+// the line after the status line. Returns -1 if merged is full.
+static int append_lines(char *merged, size_t *len, const char *head,
+                        const char *other, bool from_304)
+{
+    const char *line = strstr(head, "\r\n");
+    while (line != NULL && line[2] != '\0') {
+        line += 2;
+        const char *end = strstr(line, "\r\n");
+        size_t line_len = end != NULL ? (size_t) (end - line) + 2 : strlen(line);
+        bool keep = from_304 ? updates_stored(line) : !replaces_line(other, line);
+        if (keep) {
+            if (*len + line_len >= HTTP_HEAD_SIZE) {
+                return -1;
+            }
+            memcpy(merged + *len, line, line_len);
+            *len += line_len;
+        }
+        line = end;
+    }
+    merged[*len] = '\0';
+    return 0;
+}
+
+
+void cache_refresh(CacheEntry *entry, const char *head)
+{
+    // The stored status line and headers, with those of the 304 in place of
+    // the ones of the same name
+    char merged[HTTP_HEAD_SIZE];
+    size_t len = strcspn(entry->head, "\r") + 2;
+    if (len >= HTTP_HEAD_SIZE || strlen(entry->head) < len) {
+        return;
+    }
+    memcpy(merged, entry->head, len);
+    merged[len] = '\0';
+    if (append_lines(merged, &len, entry->head, head, false) != 0 ||
+        append_lines(merged, &len, head, NULL, true) != 0) {
+        return;
+    }
+
+    // Write the entry again, with its body, and rename it over the old one
+    FILE *file = fopen(entry->file, "rb");
+    char key[CACHE_KEY_SIZE];
+    char temp[CACHE_PATH_SIZE];
+    if (file == NULL) {
+        return;
+    }
+    if (fgets(key, sizeof(key), file) == NULL ||
+        snprintf(temp, sizeof(temp), "%s.tmp%ld", entry->file, (long) getpid()) >=
+        (int) sizeof(temp) || fseek(file, entry->body_offset, SEEK_SET) != 0) {
+        fclose(file);
+        return;
+    }
+    key[strcspn(key, "\n")] = '\0';
+    FILE *out = fopen(temp, "wb");
+    if (out == NULL) {
+        fclose(file);
+        return;
+    }
+    time_t now = time(NULL);
+    fprintf(out, "%s\n%0*ld\n%s\r\n", key, STORED_WIDTH, (long) now, merged);
+    long body_offset = ftell(out);
+    char buffer[65536];
+    size_t read;
+    bool written = true;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        if (fwrite(buffer, 1, read, out) != read) {
+            written = false;
+            break;
+        }
+    }
+    written = !ferror(file) && written;
+    fclose(file);
+    if (fclose(out) != 0 || !written || rename(temp, entry->file) != 0) {
+        unlink(temp);
+        return;
+    }
+    memcpy(entry->head, merged, len + 1);
+    entry->body_offset = body_offset;
+    entry->stored = now;
+    entry->lifetime = freshness_lifetime(entry->head);
+}
+
+
+int cache_begin_store(const char *key, const HttpParser *parser, CacheStore *store)
+{
+    store->file = NULL;
+    if (!cache_enabled() || parser->status_code != 200 ||
+        cache_directive(parser->head, "no-store") != -1) {
+        return -1;
+    }
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp%ld", (long) getpid());
+    if (entry_file(key, store->final, "") != 0 ||
+        entry_file(key, store->temp, suffix) != 0) {
+        return -1;
+    }
+    store->file = fopen(store->temp, "wb");
+    if (store->file == NULL) {
+        return -1;
+    }
+    fprintf(store->file, "%s\n%0*ld\n%s\r\n", key, STORED_WIDTH, (long) time(NULL),
+            parser->head);
+    return 0;
+}
+
+
+void cache_end_store(CacheStore *store, bool complete)
+{
+    if (store->file == NULL) {
+        return;
+    }
+    bool written = fclose(store->file) == 0;
+    store->file = NULL;
+    if (!complete || !written || rename(store->temp, store->final) != 0) {
+        unlink(store->temp);
+    }
+}
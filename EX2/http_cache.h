@@ -0,0 +1,91 @@
+#ifndef _HTTP_CACHE_H_
+#define _HTTP_CACHE_H_
+
+#include "http_parser.h"
+#include "url.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define CACHE_KEY_SIZE (URL_HOST_SIZE + URL_PATH_SIZE * 2 + 16)
+#define CACHE_PATH_SIZE 4096
+
+// A response stored in the cache directory. Its file holds the key (the
+// URL), the time it was stored or last revalidated, the head of the
+// response and its body.
+typedef struct CacheEntry {
+    char file[CACHE_PATH_SIZE];
+    char head[HTTP_HEAD_SIZE];   // status line and headers, null-terminated
+    long body_offset;            // in the file
+    time_t stored;
+    long lifetime;               // seconds it is fresh after stored
+} CacheEntry;
+
+// A response being written to the cache as it is received
+typedef struct CacheStore {
+    FILE *file;                  // NULL if the response isn't stored
+    char temp[CACHE_PATH_SIZE];  // renamed to final once complete
+    char final[CACHE_PATH_SIZE];
+} CacheStore;
+
+/**
+ * Keep the cache in a directory, created if missing.
+ * @return 0 on success, -1 if the directory can't be used.
+ */
+int cache_open(const char *directory);
+
+/**
+ * @return true once cache_open succeeded.
+ */
+bool cache_enabled(void);
+
+/**
+ * Find the response stored for a URL.
+ * @return 0 if there is one, -1 otherwise.
+ */
+int cache_lookup(const char *key, CacheEntry *entry);
+
+/**
+ * @return true if the response can be used without asking the server, per
+ * its Cache-Control max-age (or Expires) and no-cache.
+ */
+bool cache_is_fresh(const CacheEntry *entry);
+
+/**
+ * Write the If-None-Match and If-Modified-Since header lines that ask the
+ * server whether a stale response is still valid.
+ * @return the length written, 0 if the response has no validator.
+ */
+int cache_validators(const CacheEntry *entry, char *headers, size_t size);
+
+/**
+ * Write the body of a stored response.
+ * @param entry
+ * @param out NULL to only count it
+ * @return the number of body bytes, -1 in case of error.
+ */
+long cache_copy_body(const CacheEntry *entry, FILE *out);
+
+/**
+ * The server said a stale response is still valid (304): it is fresh again
+ * from now on, and the headers of the 304 replace the stored ones of the
+ * same name, so it gets their lifetime and validators.
+ * @param entry updated to the refreshed response
+ * @param head of the 304
+ */
+void cache_refresh(CacheEntry *entry, const char *head);
+
+/**
+ * Start storing a response whose head was parsed, unless it can't be
+ * cached (not a 200, or Cache-Control: no-store).
+ * @return 0 if the body is to be written to store->file, -1 otherwise.
+ */
+int cache_begin_store(const char *key, const HttpParser *parser, CacheStore *store);
+
+/**
+ * Finish storing a response: it replaces the stored one if complete, and
+ * is dropped otherwise.
+ */
+void cache_end_store(CacheStore *store, bool complete);
+
+#endif /* _HTTP_CACHE_H_ */
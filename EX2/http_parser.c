@@ -0,0 +1,265 @@
+#include "http_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+
+void http_parser_init(HttpParser *parser, BodySink sink, void *context)
+{
+    parser->state = PARSE_HEAD;
+    parser->head_len = 0;
+    parser->head[0] = '\0';
+    parser->line_len = 0;
+    parser->status_code = 0;
+    parser->content_length = -1;
+    parser->chunked = false;
+    parser->keep_alive = false;
+    parser->no_body = false;
+    parser->remaining = 0;
+    parser->body_bytes = 0;
+    parser->sink = sink;
+    parser->sink_context = context;
+}
+
+
+const char *http_parser_header(const HttpParser *parser, const char *name)
+{
+    return http_find_header(parser->head, name);
+}
+
+
+const char *http_find_header(const char *head, const char *name)
+{
+    size_t name_len = strlen(name);
+    const char *line = strstr(head, "\r\n");
+    while (line != NULL) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            return value;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+
+// Whether a comma separated header value has the given token
+static bool has_token(const char *value, const char *token)
+{
+    size_t token_len = strlen(token);
+    while (value != NULL && *value != '\r' && *value != '\0') {
+        while (*value == ' ' || *value == ',') {
+            value++;
+        }
+        if (strncasecmp(value, token, token_len) == 0 &&
+            strchr(" ,\r", value[token_len]) != NULL) {
+            return true;
+        }
+        value = strpbrk(value, ",\r");
+    }
+    return false;
+}
+
+
+// The head is complete: find how the body is framed
+static int parse_head(HttpParser *parser)
+{
+    int minor;
+    if (sscanf(parser->head, "HTTP/1.%d %d", &minor, &parser->status_code) != 2) {
+        return -1;
+    }
+    const char *connection = http_parser_header(parser, "Connection");
+    parser->keep_alive = minor >= 1 ? !has_token(connection, "close")
+                                    : has_token(connection, "keep-alive");
+    const char *encoding = http_parser_header(parser, "Transfer-Encoding");
+    const char *length = http_parser_header(parser, "Content-Length");
+    parser->chunked = has_token(encoding, "chunked");
+    if (length != NULL) {
+        char *end;
+        parser->content_length = strtol(length, &end, 10);
+        if (end == length || parser->content_length < 0) {
+            return -1;
+        }
+    }
+
+    int status = parser->status_code;
+    if (status >= 100 && status < 200) {
+        // An interim response, the real one follows it
+        parser->head_len = 0;
+        parser->content_length = -1;
+        parser->chunked = false;
+        return 0;
+    }
+    if (parser->no_body || status == 204 || status == 304) {
+        parser->state = PARSE_DONE;
+    } else if (parser->chunked) {
+        parser->state = PARSE_CHUNK_SIZE;
+    } else if (parser->content_length >= 0) {
+        parser->remaining = parser->content_length;
+        parser->state = parser->remaining > 0 ? PARSE_BODY_LENGTH : PARSE_DONE;
+    } else {
+        parser->state = PARSE_BODY_CLOSE;
+        parser->keep_alive = false;
+    }
+    return 0;
+}
+
+
+// Collect the bytes of the status line and headers. Returns the number of
+// bytes used, -1 if the head is too large or malformed.
+static ssize_t feed_head(HttpParser *parser, const char *data, size_t len)
+{
+    // The end of the head may start in the bytes already collected
+    size_t start = parser->head_len > 3 ? parser->head_len - 3 : 0;
+    size_t room = HTTP_HEAD_SIZE - 1 - parser->head_len;
+    size_t copied = len < room ? len : room;
+    memcpy(parser->head + parser->head_len, data, copied);
+    parser->head_len += copied;
+    parser->head[parser->head_len] = '\0';
+
+    char *end = strstr(parser->head + start, "\r\n\r\n");
+    if (end == NULL) {
+        return copied == len ? (ssize_t) len : -1;
+    }
+    size_t head_end = (size_t) (end - parser->head) + 4;
+    size_t used = copied - (parser->head_len - head_end);
+    parser->head_len = head_end;
+    end[2] = '\0'; // keep the line end of the last header
+    if (parse_head(parser) != 0) {
+        return -1;
+    }
+    return (ssize_t) used;
+}
+
+
+// Collect a line of the chunked framing. Returns the number of bytes used,
+// -1 if the line is too long. The line is complete when it ends with '\n'.
+static ssize_t feed_line(HttpParser *parser, const char *data, size_t len)
+{
+    const char *newline = memchr(data, '\n', len);
+    size_t used = newline ? (size_t) (newline - data) + 1 : len;
+    if (parser->line_len + used >= HTTP_LINE_SIZE) {
+        return -1;
+    }
+    memcpy(parser->line + parser->line_len, data, used);
+    parser->line_len += used;
+    parser->line[parser->line_len] = '\0';
+    return (ssize_t) used;
+}
+
+
+static bool line_complete(const HttpParser *parser)
+{
+    return parser->line_len > 0 && parser->line[parser->line_len - 1] == '\n';
+}
+
+
+static size_t feed_body(HttpParser *parser, const char *data, size_t len)
+{
+    if (parser->state != PARSE_BODY_CLOSE && (long) len > parser->remaining) {
+        len = (size_t) parser->remaining;
+    }
+    if (parser->sink != NULL && len > 0) {
+        parser->sink(parser->sink_context, data, len);
+    }
+    parser->body_bytes += (long) len;
+    parser->remaining -= (long) len;
+    return len;
+}
+
+
+ssize_t http_parser_feed(HttpParser *parser, const char *data, size_t len)
+{
+    size_t offset = 0;
+    while (offset < len && parser->state != PARSE_DONE) {
+        const char *next = data + offset;
+        size_t left = len - offset;
+        ssize_t used;
+        switch (parser->state) {
+            case PARSE_HEAD:
+                used = feed_head(parser, next, left);
+                break;
+            case PARSE_BODY_LENGTH:
+                used = (ssize_t) feed_body(parser, next, left);
+                if (parser->remaining == 0) {
+                    parser->state = PARSE_DONE;
+                }
+                break;
+            case PARSE_BODY_CLOSE:
+                used = (ssize_t) feed_body(parser, next, left);
+                break;
+            case PARSE_CHUNK_DATA:
+                used = (ssize_t) feed_body(parser, next, left);
+                if (parser->remaining == 0) {
+                    parser->state = PARSE_CHUNK_END;
+                }
+                break;
+            case PARSE_CHUNK_SIZE:
+            case PARSE_CHUNK_END:
+            case PARSE_TRAILERS:
+                used = feed_line(parser, next, left);
+                if (used < 0 || !line_complete(parser)) {
+                    break;
+                }
+                if (parser->state == PARSE_CHUNK_SIZE) {
+                    // The size may be followed by extensions after a ';'
+                    char *end;
+                    long size = strtol(parser->line, &end, 16);
+                    if (end == parser->line || size < 0) {
+                        used = -1;
+                        break;
+                    }
+                    parser->remaining = size;
+                    parser->state = size > 0 ? PARSE_CHUNK_DATA
+                                             : PARSE_TRAILERS;
+                } else if (parser->state == PARSE_CHUNK_END) {
+                    parser->state = PARSE_CHUNK_SIZE;
+                } else if (strcmp(parser->line, "\r\n") == 0 ||
+                           strcmp(parser->line, "\n") == 0) {
+                    parser->state = PARSE_DONE; // the empty line after them
+                }
+                parser->line_len = 0;
+                break;
+            default:
+                used = -1;
+                break;
+        }
+        if (used < 0) {
+            parser->state = PARSE_ERROR;
+            return -1;
+        }
+        offset += (size_t) used;
+    }
+    return (ssize_t) offset;
+}
+
+
+void http_parser_skip_body(HttpParser *parser, long len)
+{
+    parser->body_bytes += len;
+    parser->remaining -= len;
+    if (parser->state == PARSE_BODY_LENGTH && parser->remaining == 0) {
+        parser->state = PARSE_DONE;
+    }
+}
+
+
+int http_parser_finish(HttpParser *parser)
+{
+    if (parser->state == PARSE_BODY_CLOSE) {
+        parser->state = PARSE_DONE;
+    }
+    parser->keep_alive = false;
+    return parser->state == PARSE_DONE ? 0 : -1;
+}
+
+
+bool http_parser_done(const HttpParser *parser)
+{
+    return parser->state == PARSE_DONE;
+}
@@ -0,0 +1,98 @@
+#ifndef _HTTP_PARSER_H_
+#define _HTTP_PARSER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Most bytes of a status line and headers
+#define HTTP_HEAD_SIZE 8192
+// Most bytes of a chunk size line or a trailer line
+#define HTTP_LINE_SIZE 1024
+
+typedef enum HttpParseState {
+    PARSE_HEAD,
+    PARSE_BODY_LENGTH,  // body framed by Content-Length
+    PARSE_BODY_CLOSE,   // body framed by the end of the connection
+    PARSE_CHUNK_SIZE,
+    PARSE_CHUNK_DATA,
+    PARSE_CHUNK_END,    // the line end after the data of a chunk
+    PARSE_TRAILERS,
+    PARSE_DONE,
+    PARSE_ERROR
+} HttpParseState;
+
+// Receives the body of a response as it arrives, in pieces
+typedef void (*BodySink)(void *context, const char *data, size_t len);
+
+// Incremental parser of one response. Bytes are fed as they are received,
+// in pieces of any size; the body goes to the sink without being buffered.
+typedef struct HttpParser {
+    HttpParseState state;
+    char head[HTTP_HEAD_SIZE]; // status line and headers, null-terminated
+    size_t head_len;           // once complete
+    char line[HTTP_LINE_SIZE];
+    size_t line_len;
+    int status_code;
+    long content_length;       // -1 when not given
+    bool chunked;
+    bool keep_alive;           // the connection can carry another request
+    bool no_body;              // set by the caller for a HEAD request
+    long remaining;            // bytes of the body or of the current chunk
+    long body_bytes;           // body bytes handed to the sink so far
+    BodySink sink;             // NULL to drop the body
+    void *sink_context;
+} HttpParser;
+
+/**
+ * Prepare a parser for a new response.
+ * @param parser
+ * @param sink receives the body, NULL to only count it
+ * @param context passed to the sink
+ */
+void http_parser_init(HttpParser *parser, BodySink sink, void *context);
+
+/**
+ * Parse the next received bytes.
+ * @return the number of bytes that belong to this response: less than len
+ * once the response is complete (the rest belongs to the next response on
+ * the connection), -1 if the response is malformed.
+ */
+ssize_t http_parser_feed(HttpParser *parser, const char *data, size_t len);
+
+/**
+ * Count body bytes the caller moved from the connection itself, without
+ * feeding them (e.g. spliced straight to a file). Only for a body framed by
+ * Content-Length (at most the bytes remaining) or by the end of the
+ * connection.
+ * @param parser
+ * @param len
+ */
+void http_parser_skip_body(HttpParser *parser, long len);
+
+/**
+ * The connection ended. That completes a body framed by it.
+ * @return 0 if the response is complete, -1 if it was cut short.
+ */
+int http_parser_finish(HttpParser *parser);
+
+/**
+ * @return true once the whole response was parsed.
+ */
+bool http_parser_done(const HttpParser *parser);
+
+/**
+ * Find a header in a head: a status line and header lines, each ending
+ * with "\r\n", null-terminated.
+ * @return its value, up to the end of its line, NULL if there is none.
+ */
+const char *http_find_header(const char *head, const char *name);
+
+/**
+ * Find a header of a parsed head.
+ * @return its value, up to the end of its line, NULL if the response
+ * doesn't have it.
+ */
+const char *http_parser_header(const HttpParser *parser, const char *name);
+
+#endif /* _HTTP_PARSER_H_ */
@@ -0,0 +1,381 @@
+#include "range_download.h"
+#include "resolver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define RANGE_BUFFER_SIZE 65536
+
+
+static int open_connection(const RangeDownload *download)
+{
+    HostAddresses server;
+    if (resolve_host(download->host, download->port, &server) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < server.count; i++) {
+        struct sockaddr *address = (struct sockaddr *) &server.addresses[i];
+        int sock = socket(address->sa_family, SOCK_STREAM, 0);
+        if (sock == -1) {
+            continue;
+        }
+        if (connect(sock, address, server.lengths[i]) == 0) {
+            return sock;
+        }
+        close(sock);
+    }
+    return -1;
+}
+
+
+// Send a request and parse its response. The sink can set *stop (if not
+// NULL) to give up on the response: the connection is closed without
+// reading the rest. Returns -1 if the connection failed, the response is
+// malformed or cut short, or it was given up on.
+static int exchange(const RangeDownload *download, const char *request, HttpParser *parser,
+                    const bool *stop)
+{
+    int sock = open_connection(download);
+    if (sock == -1) {
+        return -1;
+    }
+    char buffer[RANGE_BUFFER_SIZE];
+    int result = -1;
+    if (send(sock, request, strlen(request), MSG_NOSIGNAL) == (ssize_t) strlen(request)) {
+        while (!http_parser_done(parser)) {
+            ssize_t received = recv(sock, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                http_parser_finish(parser);
+                break;
+            }
+            if (http_parser_feed(parser, buffer, (size_t) received) == -1 ||
+                (stop != NULL && *stop)) {
+                break;
+            }
+        }
+        result = http_parser_done(parser) ? 0 : -1;
+    }
+    close(sock);
+    return result;
+}
+
+
+// Copy a header value up to the end of its line. Returns -1 if it doesn't fit.
+static int copy_value(char *to, size_t size, const char *value)
+{
+    size_t len = strcspn(value, "\r");
+    if (len >= size) {
+        return -1;
+    }
+    memcpy(to, value, len);
+    to[len] = '\0';
+    return 0;
+}
+
+
+// HEAD the resource for its size, its validator and range support.
+// Returns 1 if it can't be downloaded in ranges.
+static int probe(RangeDownload *download)
+{
+    char request[URL_PATH_SIZE + URL_HOST_HEADER_SIZE + 64];
+    char host_header[URL_HOST_HEADER_SIZE];
+    format_host_header(download->host, download->port, host_header);
+    snprintf(request, sizeof(request), "HEAD %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+             download->path, host_header);
+    HttpParser parser;
+    http_parser_init(&parser, NULL, NULL);
+    parser.no_body = true;
+    if (exchange(download, request, &parser, NULL) != 0) {
+        fprintf(stderr, "HEAD request failed\n");
+        return -1;
+    }
+    const char *ranges = http_parser_header(&parser, "Accept-Ranges");
+    if (parser.status_code != 200 || parser.content_length < 0 ||
+        ranges == NULL || strncmp(ranges, "bytes", 5) != 0) {
+        return 1;
+    }
+    download->size = parser.content_length;
+
+    // A weak ETag can't be used in If-Range
+    const char *etag = http_parser_header(&parser, "ETag");
+    const char *modified = http_parser_header(&parser, "Last-Modified");
+    download->validator[0] = '\0';
+    if (etag != NULL && strncmp(etag, "W/", 2) != 0) {
+        copy_value(download->validator, RANGE_VALIDATOR_SIZE, etag);
+    } else if (modified != NULL) {
+        copy_value(download->validator, RANGE_VALIDATOR_SIZE, modified);
+    }
+    return 0;
+}
+
+
+// Write the progress file: the size and validator of the resource, then a
+// line per range. The progress lock must be held.
+static void save_progress(RangeDownload *download)
+{
+    char temp[sizeof(download->progress_file) + 4];
+    snprintf(temp, sizeof(temp), "%s.tmp", download->progress_file);
+    FILE *file = fopen(temp, "w");
+    if (file == NULL) {
+        return;
+    }
+    fprintf(file, "%ld\n%s\n", download->size, download->validator);
+    for (int i = 0; i < download->num_segments; i++) {
+        const RangeSegment *segment = &download->segments[i];
+        long done = __atomic_load_n(&segment->done, __ATOMIC_RELAXED);
+        fprintf(file, "%ld %ld %ld\n", segment->start, segment->end, done);
+    }
+    if (fclose(file) != 0 || rename(temp, download->progress_file) != 0) {
+        unlink(temp);
+    }
+}
+
+
+// Continue a download from its progress file, if it is of the same
+// version of the resource. Returns -1 if there is nothing to continue.
+static int load_progress(RangeDownload *download)
+{
+    FILE *file = fopen(download->progress_file, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    long size;
+    char validator[RANGE_VALIDATOR_SIZE];
+    int count = 0;
+    if (fscanf(file, "%ld\n", &size) == 1 && size == download->size &&
+        fgets(validator, sizeof(validator), file) != NULL) {
+        validator[strcspn(validator, "\n")] = '\0';
+        RangeSegment *segment = &download->segments[0];
+        while (count < RANGE_MAX_SEGMENTS &&
+               fscanf(file, "%ld %ld %ld\n", &segment->start, &segment->end,
+                      &segment->done) == 3) {
+            segment = &download->segments[++count];
+        }
+        if (strcmp(validator, download->validator) != 0 || validator[0] == '\0') {
+            count = 0; // changed, or no way to tell
+        }
+    }
+    fclose(file);
+    download->num_segments = count;
+    return count > 0 ? 0 : -1;
+}
+
+
+// Split the resource in ranges of about the same size
+static void split_ranges(RangeDownload *download, int segments)
+{
+    long most = download->size / RANGE_MIN_SEGMENT;
+    if (segments > most) {
+        segments = most > 0 ? (int) most : 1;
+    }
+    long length = download->size / segments;
+    for (int i = 0; i < segments; i++) {
+        RangeSegment *segment = &download->segments[i];
+        segment->start = i * length;
+        segment->end = i == segments - 1 ? download->size - 1 : (i + 1) * length - 1;
+        segment->done = 0;
+    }
+    download->num_segments = segments;
+}
+
+
+static long segment_length(const RangeSegment *segment)
+{
+    return segment->end - segment->start + 1;
+}
+
+
+// Receives the body of a range response and writes it at its offset
+static void write_range(void *context, const char *data, size_t len)
+{
+    RangeSegment *segment = context;
+    RangeDownload *download = segment->download;
+    if (segment->failed) {
+        return;
+    }
+    if (__atomic_load_n(&download->changed, __ATOMIC_RELAXED)) {
+        segment->failed = true; // another range found it changed
+        return;
+    }
+    if (!segment->checked) {
+        // A 200 is the whole resource: the range was ignored, or it changed
+        const char *range = http_parser_header(&segment->parser, "Content-Range");
+        long first;
+        if (segment->parser.status_code == 200) {
+            __atomic_store_n(&download->changed, true, __ATOMIC_RELAXED);
+        }
+        if (segment->parser.status_code != 206 || range == NULL ||
+            sscanf(range, "bytes %ld-", &first) != 1 ||
+            first != segment->start + segment->done) {
+            segment->failed = true;
+            return;
+        }
+        segment->checked = true;
+    }
+    long left = segment_length(segment) - segment->done;
+    if ((long) len > left) {
+        len = (size_t) left;
+    }
+    while (len > 0) {
+        ssize_t written = pwrite(download->fd, data, len, segment->start + segment->done);
+        if (written <= 0) {
+            segment->failed = true;
+            return;
+        }
+        __atomic_store_n(&segment->done, segment->done + written, __ATOMIC_RELAXED);
+        data += written;
+        len -= (size_t) written;
+    }
+    if (segment->done - segment->saved >= RANGE_SAVE_INTERVAL) {
+        segment->saved = segment->done;
+        pthread_mutex_lock(&download->progress_lock);
+        save_progress(download);
+        pthread_mutex_unlock(&download->progress_lock);
+    }
+}
+
+
+static void *download_segment(void *arg)
+{
+    RangeSegment *segment = arg;
+    RangeDownload *download = segment->download;
+    for (int tries = 0; tries < RANGE_TRIES && segment->done < segment_length(segment);
+         tries++) {
+        char request[URL_PATH_SIZE + URL_HOST_HEADER_SIZE + RANGE_VALIDATOR_SIZE + 128];
+        char host_header[URL_HOST_HEADER_SIZE];
+        format_host_header(download->host, download->port, host_header);
+        int len = snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%ld-%ld\r\n",
+                           download->path, host_header,
+                           segment->start + segment->done, segment->end);
+        if (download->validator[0] != '\0') {
+            len += snprintf(request + len, sizeof(request) - (size_t) len,
+                            "If-Range: %s\r\n", download->validator);
+        }
+        snprintf(request + len, sizeof(request) - (size_t) len, "\r\n");
+        segment->checked = false;
+        segment->failed = false;
+        http_parser_init(&segment->parser, write_range, segment);
+        exchange(download, request, &segment->parser, &segment->failed);
+        if (__atomic_load_n(&download->changed, __ATOMIC_RELAXED)) {
+            break; // the resource changed since the probe
+        }
+    }
+    return NULL;
+}
+
+
+// One try at the download. Returns 2 if the resource changed during it,
+// otherwise as download_ranges.
+static int download_once(const char *host, int port, const char *path, const char *output,
+                         int segments)
+{
+    static RangeDownload download;
+    memset(&download, 0, sizeof(download));
+    snprintf(download.host, sizeof(download.host), "%s", host);
+    snprintf(download.path, sizeof(download.path), "%s", path);
+    download.port = port;
+    int result = probe(&download);
+    if (result != 0) {
+        return result;
+    }
+
+    snprintf(download.progress_file, sizeof(download.progress_file), "%s.part", output);
+    bool resumed = load_progress(&download) == 0;
+    struct stat existing;
+    if (resumed && (stat(output, &existing) != 0 || existing.st_size != download.size)) {
+        resumed = false; // the file isn't the one the progress is about
+    }
+    download.fd = open(output, O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+    if (download.fd == -1) {
+        perror("Opening the output file failed");
+        return -1;
+    }
+    if (!resumed) {
+        split_ranges(&download, segments);
+        // Reserve the whole file up front, the ranges fill it in any order
+        if (posix_fallocate(download.fd, 0, download.size) != 0 &&
+            ftruncate(download.fd, download.size) != 0) {
+            perror("Preallocating the output file failed");
+            close(download.fd);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&download.progress_lock, NULL);
+    save_progress(&download);
+
+    long remaining = 0;
+    for (int i = 0; i < download.num_segments; i++) {
+        remaining += segment_length(&download.segments[i]) - download.segments[i].done;
+    }
+    printf("Downloading %ld of %ld bytes in %d ranges%s\n", remaining, download.size,
+           download.num_segments, resumed ? " (resumed)" : "");
+
+    struct timespec started, ended;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int running = 0;
+    bool started_thread[RANGE_MAX_SEGMENTS];
+    for (int i = 0; i < download.num_segments; i++) {
+        RangeSegment *segment = &download.segments[i];
+        segment->download = &download;
+        segment->saved = segment->done;
+        started_thread[i] = segment->done < segment_length(segment) &&
+                            pthread_create(&segment->thread, NULL, download_segment,
+                                           segment) == 0;
+        running += started_thread[i];
+    }
+    for (int i = 0; i < download.num_segments; i++) {
+        if (started_thread[i]) {
+            pthread_join(download.segments[i].thread, NULL);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+
+    long received = remaining;
+    bool complete = true;
+    for (int i = 0; i < download.num_segments; i++) {
+        RangeSegment *segment = &download.segments[i];
+        received -= segment_length(segment) - segment->done;
+        complete &= segment->done == segment_length(segment);
+    }
+    if (download.changed) {
+        // The progress is about the old resource
+        pthread_mutex_destroy(&download.progress_lock);
+        close(download.fd);
+        unlink(download.progress_file);
+        fprintf(stderr, "\nThe resource changed during the download\n");
+        return 2;
+    }
+    save_progress(&download);
+    pthread_mutex_destroy(&download.progress_lock);
+    close(download.fd);
+
+    double seconds = (double) (ended.tv_sec - started.tv_sec) +
+                     (double) (ended.tv_nsec - started.tv_nsec) / 1e9;
+    printf("\nTotal received body bytes: %ld in %.2f s over %d connections\n",
+           received, seconds, running);
+    if (!complete) {
+        fprintf(stderr, "Download incomplete, run again to continue it\n");
+        return -1;
+    }
+    unlink(download.progress_file);
+    return 0;
+}
+
+
+int download_ranges(const char *host, int port, const char *path, const char *output,
+                    int segments)
+{
+    int result = download_once(host, port, path, output, segments);
+    for (int restarts = 0; result == 2 && restarts < RANGE_RESTARTS; restarts++) {
+        printf("Downloading it again from the start\n");
+        result = download_once(host, port, path, output, segments);
+    }
+    return result == 2 ? -1 : result;
+}
@@ -0,0 +1,68 @@
+#ifndef _RANGE_DOWNLOAD_H_
+#define _RANGE_DOWNLOAD_H_
+
+#include "http_parser.h"
+#include "url.h"
+#include <stdbool.h>
+#include <pthread.h>
+
+#define RANGE_MAX_SEGMENTS 16
+// Smallest range worth its own connection
+#define RANGE_MIN_SEGMENT (64 * 1024)
+// Connections a range is tried on before the download fails
+#define RANGE_TRIES 3
+// Bytes of a range written between two saves of the progress file
+#define RANGE_SAVE_INTERVAL (1024 * 1024)
+#define RANGE_VALIDATOR_SIZE 256
+// Times a download starts over when the resource changes during it
+#define RANGE_RESTARTS 1
+
+struct RangeDownload;
+
+// A byte range of the file, downloaded on its own connection by its own
+// thread and written at its offset
+typedef struct RangeSegment {
+    long start;
+    long end;                  // inclusive
+    long done;                 // bytes written so far
+    long saved;                // done when the progress was last saved
+    bool checked;              // the Content-Range of the response matched
+    bool failed;               // the rest of the response is not read
+    pthread_t thread;
+    HttpParser parser;
+    struct RangeDownload *download;
+} RangeSegment;
+
+typedef struct RangeDownload {
+    char host[URL_HOST_SIZE];
+    int port;
+    char path[URL_PATH_SIZE];
+    long size;
+    char validator[RANGE_VALIDATOR_SIZE]; // strong ETag or Last-Modified
+    bool changed;              // a range got the whole resource (a 200)
+    int fd;                    // the output file
+    char progress_file[URL_PATH_SIZE + 8];
+    pthread_mutex_t progress_lock;
+    int num_segments;
+    RangeSegment segments[RANGE_MAX_SEGMENTS];
+} RangeDownload;
+
+/**
+ * Download a resource over parallel connections, one byte range each,
+ * into a file preallocated to its size. A HEAD request first finds the
+ * size and whether the server accepts ranges. The progress is kept in
+ * <output>.part, so a download that failed continues where it stopped when
+ * run again (if the resource didn't change). When the resource changes
+ * during the download, it starts over with the new one.
+ * @param host
+ * @param port
+ * @param path with its query
+ * @param output the file
+ * @param segments connections to use
+ * @return 0 on success, -1 if the download failed, 1 if the server can't
+ * send ranges of the resource (the caller downloads it as one response).
+ */
+int download_ranges(const char *host, int port, const char *path, const char *output,
+                    int segments);
+
+#endif /* _RANGE_DOWNLOAD_H_ */
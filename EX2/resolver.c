@@ -0,0 +1,282 @@
+#include "resolver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+
+static CachedHost *cache = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lookup_queued = PTHREAD_COND_INITIALIZER;
+static pthread_t threads[RESOLVER_THREADS];
+static int num_threads = 0;
+static bool stopping = false;
+static int event_fd = -1; // written by a resolver thread after each lookup
+
+
+// Run getaddrinfo(). Returns -1 if the host has no address.
+static int lookup(const char *host, HostAddresses *addresses)
+{
+    struct addrinfo hints;
+    struct addrinfo *results;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &results) != 0) {
+        return -1;
+    }
+    addresses->count = 0;
+    for (struct addrinfo *result = results;
+         result != NULL && addresses->count < RESOLVER_MAX_ADDRESSES;
+         result = result->ai_next) {
+        if (result->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        memcpy(&addresses->addresses[addresses->count], result->ai_addr,
+               result->ai_addrlen);
+        addresses->lengths[addresses->count] = result->ai_addrlen;
+        addresses->count++;
+    }
+    freeaddrinfo(results);
+    return addresses->count > 0 ? 0 : -1;
+}
+
+
+static void copy_addresses(const HostAddresses *addresses, int port,
+                           HostAddresses *out)
+{
+    *out = *addresses;
+    for (int i = 0; i < out->count; i++) {
+        struct sockaddr *address = (struct sockaddr *) &out->addresses[i];
+        if (address->sa_family == AF_INET6) {
+            ((struct sockaddr_in6 *) address)->sin6_port = htons(port);
+        } else {
+            ((struct sockaddr_in *) address)->sin_port = htons(port);
+        }
+    }
+}
+
+
+// Drop the lookups that expired. The cache lock must be held.
+static void evict_expired(time_t now)
+{
+    CachedHost **link = &cache;
+    while (*link != NULL) {
+        CachedHost *entry = *link;
+        bool finished = entry->state == LOOKUP_READY ||
+                        entry->state == LOOKUP_FAILED;
+        if (finished && now >= entry->expires) {
+            *link = entry->next;
+            free(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+
+// The cache lock must be held
+static CachedHost *find_host(const char *host)
+{
+    evict_expired(time(NULL));
+    for (CachedHost *entry = cache; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+// The cache lock must be held. Returns NULL if the host can't be cached.
+static CachedHost *add_host(const char *host, LookupState state)
+{
+    if (strlen(host) >= URL_HOST_SIZE) {
+        return NULL;
+    }
+    CachedHost *entry = malloc(sizeof(CachedHost));
+    if (entry == NULL) {
+        return NULL;
+    }
+    strcpy(entry->host, host);
+    entry->state = state;
+    entry->addresses.count = 0;
+    entry->expires = 0;
+    entry->next = cache;
+    cache = entry;
+    return entry;
+}
+
+
+// Store the result of a lookup. The cache lock must be held.
+static void finish_lookup(CachedHost *entry, int result,
+                          const HostAddresses *addresses)
+{
+    if (result == 0) {
+        entry->addresses = *addresses;
+        entry->state = LOOKUP_READY;
+        entry->expires = time(NULL) + RESOLVER_TTL;
+    } else {
+        entry->state = LOOKUP_FAILED;
+        entry->expires = time(NULL) + RESOLVER_FAILED_TTL;
+    }
+}
+
+
+static void notify_lookup_done(void)
+{
+    uint64_t one = 1;
+    if (event_fd != -1 && write(event_fd, &one, sizeof(one)) == -1) {
+        perror("resolver notify");
+    }
+}
+
+
+static void *resolver_thread(void *unused)
+{
+    (void) unused;
+    pthread_mutex_lock(&cache_lock);
+    while (!stopping) {
+        CachedHost *entry = cache;
+        while (entry != NULL && entry->state != LOOKUP_QUEUED) {
+            entry = entry->next;
+        }
+        if (entry == NULL) {
+            pthread_cond_wait(&lookup_queued, &cache_lock);
+            continue;
+        }
+        // A running lookup is never evicted, so the entry stays valid
+        entry->state = LOOKUP_RUNNING;
+        char host[URL_HOST_SIZE];
+        strcpy(host, entry->host);
+        pthread_mutex_unlock(&cache_lock);
+
+        HostAddresses addresses;
+        int result = lookup(host, &addresses);
+
+        pthread_mutex_lock(&cache_lock);
+        finish_lookup(entry, result, &addresses);
+        notify_lookup_done();
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+}
+
+
+int init_resolver(void)
+{
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    stopping = false;
+    // Without threads the lookups run in the caller
+    while (num_threads < RESOLVER_THREADS &&
+           pthread_create(&threads[num_threads], NULL, resolver_thread, NULL) == 0) {
+        num_threads++;
+    }
+    return event_fd;
+}
+
+
+int resolve_host(const char *host, int port, HostAddresses *out)
+{
+    pthread_mutex_lock(&cache_lock);
+    CachedHost *entry = find_host(host);
+    if (entry != NULL && entry->state == LOOKUP_READY) {
+        copy_addresses(&entry->addresses, port, out);
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    if (entry != NULL && entry->state == LOOKUP_FAILED) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    HostAddresses addresses;
+    int result = lookup(host, &addresses);
+
+    pthread_mutex_lock(&cache_lock);
+    entry = find_host(host);
+    bool waited_for = entry != NULL;
+    if (entry == NULL) {
+        entry = add_host(host, LOOKUP_RUNNING);
+    }
+    if (entry != NULL) {
+        finish_lookup(entry, result, &addresses);
+    }
+    if (waited_for) {
+        notify_lookup_done(); // asynchronous callers wait for this host
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (result == 0) {
+        copy_addresses(&addresses, port, out);
+    }
+    return result;
+}
+
+
+int resolve_host_async(const char *host, int port, HostAddresses *out)
+{
+    if (num_threads == 0) {
+        return resolve_host(host, port, out);
+    }
+    pthread_mutex_lock(&cache_lock);
+    CachedHost *entry = find_host(host);
+    if (entry == NULL) {
+        entry = add_host(host, LOOKUP_QUEUED);
+        if (entry == NULL) {
+            pthread_mutex_unlock(&cache_lock);
+            return resolve_host(host, port, out);
+        }
+        pthread_cond_signal(&lookup_queued);
+    }
+    int result = 1;
+    if (entry->state == LOOKUP_READY) {
+        copy_addresses(&entry->addresses, port, out);
+        result = 0;
+    } else if (entry->state == LOOKUP_FAILED) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+
+void resolver_acknowledge(void)
+{
+    uint64_t count;
+    if (read(event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("resolver acknowledge");
+    }
+}
+
+
+void close_resolver(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    stopping = true;
+    pthread_cond_broadcast(&lookup_queued);
+    pthread_mutex_unlock(&cache_lock);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    num_threads = 0;
+    if (event_fd != -1) {
+        close(event_fd);
+        event_fd = -1;
+    }
+    while (cache != NULL) {
+        CachedHost *next = cache->next;
+        free(cache);
+        cache = next;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include "url.h"
+#include <time.h>
+#include <sys/socket.h>
+
+// Seconds a resolved host is reused. getaddrinfo() doesn't tell the TTL of
+// the DNS records, so every host gets the same.
+#define RESOLVER_TTL 60
+// Seconds a host that couldn't be resolved isn't tried again
+#define RESOLVER_FAILED_TTL 5
+#define RESOLVER_MAX_ADDRESSES 8
+// Threads running getaddrinfo() for resolve_host_async
+#define RESOLVER_THREADS 4
+
+// Addresses of a host (IPv4 and IPv6), in the order to try them
+typedef struct HostAddresses {
+    int count;
+    struct sockaddr_storage addresses[RESOLVER_MAX_ADDRESSES];
+    socklen_t lengths[RESOLVER_MAX_ADDRESSES];
+} HostAddresses;
+
+typedef enum LookupState {
+    LOOKUP_QUEUED,   // waiting for a resolver thread
+    LOOKUP_RUNNING,
+    LOOKUP_READY,
+    LOOKUP_FAILED
+} LookupState;
+
+typedef struct CachedHost {
+    char host[URL_HOST_SIZE];
+    LookupState state;
+    HostAddresses addresses; // with port 0
+    time_t expires;          // once ready or failed
+    struct CachedHost *next;
+} CachedHost;
+
+/**
+ * Start the resolver threads.
+ * @return a descriptor that becomes readable when an asynchronous lookup
+ * finished, -1 in case of error.
+ */
+int init_resolver(void);
+
+/**
+ * Resolve a host, through the cache, in the calling thread.
+ * @param host a name or an IPv4/IPv6 address
+ * @param port set in the addresses
+ * @param out
+ * @return 0 on success, -1 if the host can't be resolved.
+ */
+int resolve_host(const char *host, int port, HostAddresses *out);
+
+/**
+ * Resolve a host from the cache, or start resolving it on a resolver
+ * thread. Call again once the resolver descriptor is readable.
+ * @return 0 if out was filled, 1 if the lookup is still running, -1 if the
+ * host can't be resolved.
+ */
+int resolve_host_async(const char *host, int port, HostAddresses *out);
+
+/**
+ * Clear the readiness of the resolver descriptor.
+ */
+void resolver_acknowledge(void);
+
+/**
+ * Stop the resolver threads (if started) and empty the cache.
+ */
+void close_resolver(void);
+
+#endif /* _RESOLVER_H_ */
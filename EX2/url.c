@@ -0,0 +1,159 @@
+#include "url.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+
+int split_url(const char *url, char *host, char *path, int *port)
+{
+    const char *http_prefix = "http://";
+    if (strncmp(url, http_prefix, strlen(http_prefix)) != 0) {
+        return -1;
+    }
+    url += strlen(http_prefix);
+
+    const char *slash = strchr(url, '/');
+    const char *host_start = url;
+    const char *host_end;
+    const char *colon;
+    if (*url == '[') {
+        // An IPv6 address, its colons are not the port's
+        host_start = url + 1;
+        host_end = strchr(host_start, ']');
+        if (host_end == NULL || (slash != NULL && slash < host_end)) {
+            return -1;
+        }
+        colon = host_end[1] == ':' ? host_end + 1 : NULL;
+        if (host_end[1] != '\0' && host_end[1] != ':' && host_end[1] != '/') {
+            return -1;
+        }
+    } else {
+        colon = strchr(url, ':');
+        if (colon != NULL && slash != NULL && colon > slash) {
+            colon = NULL; // a colon in the path
+        }
+        host_end = colon ? colon : slash ? slash : url + strlen(url);
+    }
+    size_t host_len = (size_t) (host_end - host_start);
+    if (host_len == 0 || host_len >= URL_HOST_SIZE) {
+        return -1;
+    }
+    memcpy(host, host_start, host_len);
+    host[host_len] = '\0';
+
+    *port = 80; // default HTTP port
+    if (colon != NULL) {
+        *port = atoi(colon + 1);
+        if (*port <= 0 || *port >= 65536) {
+            return -1;
+        }
+    }
+
+    const char *rest = slash ? slash : "/";
+    if (strlen(rest) >= URL_PATH_SIZE) {
+        return -1;
+    }
+    strcpy(path, rest);
+    return 0;
+}
+
+
+// Remove the "." and ".." segments of an absolute path, in place
+static void remove_dot_segments(char *path)
+{
+    char *query = strchr(path, '?');
+    size_t end = query ? (size_t) (query - path) : strlen(path);
+    char *out = path;   // the output is never longer than the input
+    const char *in = path;
+    while (in < path + end) {
+        const char *segment = in + 1;  // after the '/'
+        const char *next = memchr(segment, '/', (size_t) (path + end - segment));
+        if (next == NULL) {
+            next = path + end;
+        }
+        size_t len = (size_t) (next - segment);
+        bool last = next == path + end;
+        if (len == 1 && segment[0] == '.') {
+            if (last) {
+                *out++ = '/';
+            }
+        } else if (len == 2 && segment[0] == '.' && segment[1] == '.') {
+            while (out > path && *--out != '/') {
+            }
+            if (last) {
+                *out++ = '/';
+            }
+        } else {
+            memmove(out, in, len + 1);
+            out += len + 1;
+        }
+        in = next;
+    }
+    if (out == path) {
+        *out++ = '/';
+    }
+    memmove(out, path + end, strlen(path + end) + 1); // the query
+}
+
+
+int resolve_location(const char *location, char *host, int *port, char *path)
+{
+    char resolved[URL_HOST_SIZE + URL_PATH_SIZE + 16];
+    size_t location_len = strcspn(location, "#\r\n");
+    int len;
+    if (strncmp(location, "http://", 7) == 0) {
+        len = snprintf(resolved, sizeof(resolved), "%.*s", (int) location_len, location);
+    } else if (strncmp(location, "//", 2) == 0) {
+        len = snprintf(resolved, sizeof(resolved), "http:%.*s", (int) location_len, location);
+    } else if (strchr(location, ':') != NULL &&
+               strcspn(location, ":") < strcspn(location, "/?")) {
+        return -1; // another scheme
+    } else {
+        // A path, on the same host
+        char new_path[URL_PATH_SIZE];
+        if (location[0] == '/') {
+            len = snprintf(new_path, sizeof(new_path), "%.*s", (int) location_len, location);
+        } else if (location[0] == '?') {
+            // Only a new query
+            len = snprintf(new_path, sizeof(new_path), "%.*s%.*s", (int) strcspn(path, "?"),
+                           path, (int) location_len, location);
+        } else {
+            size_t directory = strcspn(path, "?");
+            while (directory > 0 && path[directory - 1] != '/') {
+                directory--;
+            }
+            len = snprintf(new_path, sizeof(new_path), "%.*s%.*s", (int) directory, path,
+                           (int) location_len, location);
+        }
+        if (len < 0 || (size_t) len >= sizeof(new_path)) {
+            return -1;
+        }
+        remove_dot_segments(new_path);
+        strcpy(path, new_path);
+        return 0;
+    }
+    if (len < 0 || (size_t) len >= sizeof(resolved)) {
+        return -1;
+    }
+    char new_host[URL_HOST_SIZE], new_path[URL_PATH_SIZE];
+    int new_port;
+    if (split_url(resolved, new_host, new_path, &new_port) != 0) {
+        return -1;
+    }
+    remove_dot_segments(new_path);
+    strcpy(host, new_host);
+    strcpy(path, new_path);
+    *port = new_port;
+    return 0;
+}
+
+
+void format_host_header(const char *host, int port, char *value)
+{
+    const char *format = strchr(host, ':') != NULL ? "[%s]" : "%s";
+    int len = snprintf(value, URL_HOST_HEADER_SIZE, format, host);
+    if (port != 80 && len < URL_HOST_HEADER_SIZE) {
+        snprintf(value + len, URL_HOST_HEADER_SIZE - (size_t) len, ":%d", port);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef _URL_H_
+#define _URL_H_
+
+#define URL_HOST_SIZE 256
+#define URL_PATH_SIZE 1024
+// A host with "www.", or brackets, and a port
+#define URL_HOST_HEADER_SIZE (URL_HOST_SIZE + 16)
+
+/**
+ * Split an http:// URL into its host, port (80 when not given) and path
+ * ("/" when not given). An IPv6 host is given in brackets, and returned
+ * without them.
+ * @param url
+ * @param host at least URL_HOST_SIZE bytes
+ * @param path at least URL_PATH_SIZE bytes
+ * @param port
+ * @return 0 on success, -1 if the URL is not a valid http:// URL.
+ */
+int split_url(const char *url, char *host, char *path, int *port);
+
+/**
+ * Format the value of the Host header of a request to host:port: an IPv6
+ * address is written in brackets, and the port is added unless it is 80.
+ * @param host as split_url gives it
+ * @param port
+ * @param value at least URL_HOST_HEADER_SIZE bytes
+ */
+void format_host_header(const char *host, int port, char *value);
+
+/**
+ * Resolve the Location of a redirect against the URL that was requested:
+ * an absolute http:// URL, a network-path ("//host/path"), an absolute
+ * path or a path relative to the directory of the requested one. Dot
+ * segments are removed and the fragment dropped.
+ * @param location
+ * @param host of the requested URL, replaced by the new one
+ * @param port of the requested URL, replaced by the new one
+ * @param path of the requested URL, replaced by the new one
+ * @return 0 on success, -1 if the location isn't an http:// URL or is too
+ * long.
+ */
+int resolve_location(const char *location, char *host, int *port, char *path);
+
+#endif /* _URL_H_ */
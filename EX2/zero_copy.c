@@ -0,0 +1,144 @@
+#define _GNU_SOURCE // splice, pipe2, F_SETPIPE_SZ
+#include "zero_copy.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+// splice() can't be used between these, nothing was moved
+#define SPLICE_UNSUPPORTED (-2)
+
+
+static size_t next_chunk(long len, long moved, size_t most)
+{
+    if (len < 0 || len - moved > (long) most) {
+        return most;
+    }
+    return (size_t) (len - moved);
+}
+
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= (size_t) written;
+    }
+    return 0;
+}
+
+
+// Read from src (the socket, or the pipe holding spliced bytes) and write
+// to fd through an aligned buffer
+static long copy_through_buffer(int src, int fd, long len, bool is_socket)
+{
+    void *buffer;
+    if (posix_memalign(&buffer, 4096, COPY_BUFFER_SIZE) != 0) {
+        return -1;
+    }
+    long moved = 0;
+    while (len < 0 || moved < len) {
+        size_t chunk = next_chunk(len, moved, COPY_BUFFER_SIZE);
+        ssize_t received = is_socket ? recv(src, buffer, chunk, 0)
+                                     : read(src, buffer, chunk);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            if (received == -1) {
+                moved = -1;
+            }
+            break;
+        }
+        if (write_all(fd, buffer, (size_t) received) == -1) {
+            moved = -1;
+            break;
+        }
+        moved += received;
+    }
+    free(buffer);
+    return moved;
+}
+
+
+static long splice_through_pipe(int sock, int fd, long len)
+{
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        return SPLICE_UNSUPPORTED;
+    }
+    // A larger pipe moves more per call; the default size works too
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+
+    long moved = 0;
+    while (len < 0 || moved < len) {
+        ssize_t in = splice(sock, NULL, pipe_fds[1], NULL,
+                            next_chunk(len, moved, SPLICE_CHUNK),
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == -1 && errno == EINTR) {
+            continue;
+        }
+        if (in == -1 && moved == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            moved = SPLICE_UNSUPPORTED;
+            break;
+        }
+        if (in <= 0) {
+            if (in == -1) {
+                moved = -1;
+            }
+            break;
+        }
+        while (in > 0) {
+            ssize_t out = splice(pipe_fds[0], NULL, fd, NULL, (size_t) in,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out == -1 && errno == EINTR) {
+                continue;
+            }
+            if (out == -1 && errno == EINVAL && moved == 0) {
+                // The file can't take spliced bytes: empty the pipe into it,
+                // then copy the rest
+                long copied = copy_through_buffer(pipe_fds[0], fd, in, false);
+                long rest = copied == in ? copy_through_buffer(sock, fd,
+                                                               len < 0 ? -1 : len - in,
+                                                               true)
+                                         : -1;
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return rest == -1 ? -1 : in + rest;
+            }
+            if (out <= 0) {
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+            in -= out;
+            moved += out;
+        }
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return moved;
+}
+
+
+long copy_socket_to_fd(int sock, int fd, long len)
+{
+    struct stat file;
+    if (fstat(fd, &file) == 0 && (S_ISREG(file.st_mode) || S_ISFIFO(file.st_mode))) {
+        long moved = splice_through_pipe(sock, fd, len);
+        if (moved != SPLICE_UNSUPPORTED) {
+            return moved;
+        }
+    }
+    return copy_through_buffer(sock, fd, len, true);
+}
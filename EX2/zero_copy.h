@@ -0,0 +1,24 @@
+#ifndef _ZERO_COPY_H_
+#define _ZERO_COPY_H_
+
+// Bytes moved per splice() call, and the size asked for the pipe between
+#define SPLICE_CHUNK (1 << 20)
+// Size of the buffer used where splice() can't be, aligned to a page
+#define COPY_BUFFER_SIZE (1 << 20)
+
+/**
+ * Move body bytes from a socket to a file descriptor. The bytes go from
+ * the socket to a pipe to the file with splice(), without being copied to
+ * user space; if the file doesn't support it (e.g. a terminal, or a file
+ * opened for appending), with recv() and write() through a large aligned
+ * buffer.
+ * @param sock
+ * @param fd a file or pipe, written at its current offset
+ * @param len bytes to move, -1 for all of them up to the end of the
+ * connection
+ * @return the number of bytes moved (less than len if the connection
+ * ended), -1 in case of error.
+ */
+long copy_socket_to_fd(int sock, int fd, long len);
+
+#endif /* _ZERO_COPY_H_ */
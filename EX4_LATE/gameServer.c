@@ -1,73 +1,164 @@
+#include "gameServer.h"
+#include "matchmaker.h"
+#include "snapshot.h"
+#include "udp_transport.h"
+#include "handoff_queue.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <signal.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
-#define MAX_PLAYERS 15
-#define BUFFER_SIZE 256
-int available_ids[MAX_PLAYERS] = {0};
+#define MAX_EVENTS 64
+// Players with more unsent output than this are disconnected
+#define DEFAULT_HIGH_WATER_MARK (64 * 1024)
+#define DEFAULT_MAX_ROOMS 4096
+// Players that don't send anything for this long are disconnected
+#define DEFAULT_IDLE_TIMEOUT 300
+// How often the players are told the time left in a timed round
+#define ROUND_REMINDER_INTERVAL 30
+// How often the rooms are saved to the snapshot file
+#define SNAPSHOT_INTERVAL 1
+// How long the seat of a player restored from a snapshot waits for it
+#define RESUME_GRACE_PERIOD 60
+// While restored seats wait, how long a new connection has to send its
+// resume line before it is given a new seat
+#define RESUME_LINE_WAIT_MS 500
+#define MAX_REACTORS 64
+#define SECONDS_TO_TICKS(seconds) ((uint64_t) (seconds) * 1000 / TIMER_TICK_MS)
+#define USAGE "Usage: ./server [-w high-water-bytes] [-r max-rooms] [-i idle-seconds] [-t round-seconds] [-f snapshot-file] [-u udp-port] [-n threads] <port> <seed> <max-number-of-players>\n"
 
-#define SERVER_SOCKET_ID  3
+// A thread running an event loop for its own rooms and their players
+typedef struct Reactor {
+    pthread_t thread;
+    int index;            // from 0
+    int wake_fd;          // eventfd: sockets were handed off, or stop
+    HandoffQueue handoff; // sockets accepted for the reactor
+    int load;             // players of the reactor, written by it only
+    int to_wake;          // set by the acceptor while it hands off a batch
+    int stop;             // set by the acceptor when the server stops
+} Reactor;
 
+// Global variables
+int server_socket;
+unsigned int game_seed; // reactor i gets game_seed + i for its rooms
+int udp_port = 0;    // 0 when the players connect over TCP only
+int udp_socket = -1;
+int max_players;     // in one room
+int max_rooms = DEFAULT_MAX_ROOMS;
+int num_reactors = 1;
+int rooms_per_reactor;
+long max_total_players; // max_players in each room of a reactor
+size_t high_water_mark = DEFAULT_HIGH_WATER_MARK;
+int idle_timeout = DEFAULT_IDLE_TIMEOUT; // seconds, 0 for none
+int round_time_limit = 0;                // seconds, 0 for none
+const char *snapshot_path = NULL; // NULL for no snapshots
+Timer snapshot_timer;
+volatile sig_atomic_t stop_requested = 0;
 
-int find_last_available_index() {
-    int last_index = -1;
+// With more than one reactor, the main thread only accepts connections and
+// hands each to the reactor with the fewest players
+Reactor *reactors = NULL; // NULL when the main thread is the only reactor
+int acceptor_epoll_fd;
+int capacity_fd; // eventfd: a full reactor got a free seat
 
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (available_ids[i] == 1) {
-            last_index = i;
-        }
-    }
+// The state below belongs to the reactor of the calling thread, so a room
+// and its players are only ever touched by one thread and need no lock
+__thread Reactor *self = NULL; // NULL in the main thread
+__thread int num_players = 0;  // in all the rooms of the reactor
+__thread TimerWheel timers;
+__thread uint64_t token_state; // of the generator of the resume tokens
 
-    return last_index;
-}
+// The seats restored from the snapshot, sorted by token, so a resuming
+// player finds its own with a binary search. The player of an entry is set
+// to NULL once the seat is taken back or given up.
+typedef struct Ghost {
+    uint64_t token;
+    Player *player;
+} Ghost;
+Ghost *ghosts = NULL;
+int num_ghosts = 0;
+int ghosts_waiting = 0; // entries whose player is not NULL
 
-void print_array() {
-    printf("Available IDs: ");
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        printf("%d ", available_ids[i]);
-    }
-    printf("\n");
-}
+// Rooms with text broadcast during the current loop iteration. The text of
+// each room is formatted once and sent as one message when the iteration
+// ends.
+__thread Room *pending_rooms = NULL;
+// Players to disconnect when the current loop iteration ends
+__thread Player *kicked_players = NULL;
 
-// Player structure
-typedef struct {
-    int socket;
-    int id;
-    char buffer[BUFFER_SIZE];
-} Player;
+__thread int epoll_fd;
 
-// Global variables
-int server_socket;
-Player players[MAX_PLAYERS];
-int num_players = 0;
+// The player owning every open socket, indexed by the socket itself, so an
+// event is matched to its player in O(1). Grows with the highest fd.
+__thread Player **player_by_fd = NULL;
+__thread int player_by_fd_size = 0;
 
-int target_number;
-fd_set master_fds, read_fds,write_fds;
+// Release the rooms and players of the calling reactor
+void release_reactor() {
+    // New connections held for their resume line don't have a seat yet
+    for (int fd = 0; fd < player_by_fd_size; fd++) {
+        Player *player = player_by_fd[fd];
+        if (player != NULL && player->room == NULL) {
+            close(fd);
+            free(player);
+        }
+    }
+    // Every other player has a seat, whichever way it is connected
+    for (int i = 0; i < rooms_opened(); i++) {
+        Room *room = get_room(i);
+        for (int seat = 0; seat < max_players; seat++) {
+            Player *player = room->seats[seat];
+            if (player != NULL) {
+                if (player->socket >= 0) {
+                    close(player->socket);
+                }
+                out_queue_free(&player->out);
+                free(player);
+            }
+        }
+    }
+    free(ghosts);
+    if (udp_socket >= 0) {
+        close_udp_transport();
+    }
+    close_matchmaker();
+    close(epoll_fd);
+    free(player_by_fd);
+}
 
 void cleanup() {
     //printf("Shutting down server...\n");
-    for (int i = 0; i < num_players; i++) {
-        if (players[i].socket > 0) {
-            close(players[i].socket);
-        }
-    }
+    release_reactor();
     close(server_socket);
     exit(0);
 }
 
+// The main loop saves a last snapshot and cleans up when it sees the flag
 void handle_signal(int signo) {
-    if (signo == SIGINT) {
-        cleanup();
+    if (signo == SIGINT || signo == SIGTERM) {
+        stop_requested = 1;
     }
 }
 
-void init_server(int port, int seed, int max_players) {
+int set_non_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+void init_server(int port, int seed) {
     struct sockaddr_in server_addr;
 
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -75,6 +166,9 @@ void init_server(int port, int seed, int max_players) {
         perror("Socket error");
         exit(1);
     }
+    // A restarted server must not wait for the old connections to time out
+    int one = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
@@ -85,166 +179,1118 @@ void init_server(int port, int seed, int max_players) {
         exit(1);
     }
 
-    if (listen(server_socket, max_players) < 0) {
+    if (listen(server_socket, SOMAXCONN) < 0) {
         perror("Listen error");
         exit(1);
     }
+    // A connection reset before accept() must not block the game
+    set_non_blocking(server_socket);
+    game_seed = (unsigned int) seed;
+}
+
+
+// Let the acceptor see how many players the reactor has
+void publish_load() {
+    if (self != NULL) {
+        __atomic_store_n(&self->load, num_players, __ATOMIC_RELEASE);
+    }
+}
+
+
+// Start (or stop) waiting for new connections. The welcome socket is not
+// polled while all the rooms are full, so pending connections wait in the
+// backlog. The acceptor thread stops by itself when all the reactors are
+// full; a reactor only tells it when it has a free seat again.
+void set_accepting(int accepting) {
+    if (self != NULL) {
+        uint64_t one = 1;
+        if (accepting && write(capacity_fd, &one, sizeof(one)) < 0) {
+            perror("Eventfd error");
+        }
+        return;
+    }
+    struct epoll_event event = {.events = accepting ? EPOLLIN : 0,
+                                .data.fd = server_socket};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server_socket, &event);
+}
+
+
+// Register the socket of a player with epoll and the fd table
+int watch_player(Player *player) {
+    int fd = player->socket;
+    if (fd >= player_by_fd_size) {
+        int size = player_by_fd_size ? player_by_fd_size : 64;
+        while (size <= fd) {
+            size *= 2;
+        }
+        Player **table = realloc(player_by_fd, size * sizeof(Player *));
+        if (!table) {
+            return -1;
+        }
+        memset(table + player_by_fd_size, 0,
+               (size - player_by_fd_size) * sizeof(Player *));
+        player_by_fd = table;
+        player_by_fd_size = size;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        return -1;
+    }
+    player_by_fd[fd] = player;
+    return 0;
+}
+
+
+Player *find_player(int fd) {
+    return fd < player_by_fd_size ? player_by_fd[fd] : NULL;
+}
+
 
-    srand(seed);
-    target_number = (int) random() % 100 + 1;
+// Wait for the socket of a player to become writable only while it has
+// queued output
+void update_player_events(Player *player) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = player->socket};
+    if (player->out.count > 0) {
+        event.events |= EPOLLOUT;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, player->socket, &event);
 }
 
 
-void notify_players(int new_socket, int new_player_id) {
-    char message[BUFFER_SIZE];
-    printf("Server is ready to write to player %d on socket %d\n",new_player_id,new_socket);
-    //printf("server is ready to write to player %d on socket %d\n",new_player_id,players[new_player_id].socket);
-    sprintf(message, "player %d joined the game\n", new_player_id);
+// Mark a player to be disconnected once the current events are handled
+void kick_player(Player *player) {
+    if (player->kicked) {
+        return;
+    }
+    player->kicked = 1;
+    player->next_kicked = kicked_players;
+    kicked_players = player;
+    out_queue_free(&player->out);
+    timer_cancel(&timers, &player->idle_timer);
+}
+
 
-    for (int i = 0; i < num_players; i++) { // Send to all except new player
-        //sleep(2);
+// Send a message to a player without blocking. Whatever the socket doesn't
+// take is queued and sent when the socket becomes writable. A player whose
+// queue grows over the high water mark can't keep up and is kicked.
+// Over UDP, a reliable message is resent until the player acknowledges it;
+// TCP is reliable anyway.
+void send_message(Player *player, Message *message, int reliable) {
+    OutQueue *queue = &player->out;
+    size_t sent = 0;
+    if (player->kicked) {
+        return;
+    }
+    if (player->session != NULL) {
+        if (udp_send(player->session, message, reliable) != 0) {
+            printf("Player %d is too slow, disconnecting\n", player->id);
+            kick_player(player);
+        }
+        return;
+    }
+    if (player->socket < 0) {
+        return;
+    }
+    if (queue->count == 0) {
+        ssize_t result = send(player->socket, message->data, message->len,
+                              MSG_NOSIGNAL);
+        if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR) {
+            kick_player(player);
+            return;
+        }
+        if (result > 0) {
+            sent = (size_t) result;
+        }
+        if (sent == message->len) {
+            return;
+        }
+    }
+    int was_empty = queue->count == 0;
+    if (out_queue_push(queue, message, sent) != 0 ||
+        queue->bytes > high_water_mark) {
+        printf("Player %d is too slow, disconnecting\n", player->id);
+        kick_player(player);
+        return;
+    }
+    if (was_empty) {
+        update_player_events(player);
+    }
+}
 
-        if(players[i].id!=new_player_id)
-        {
 
-            send(players[i].socket, message, strlen(message), 0);
+// Send the pending broadcast of a room to all its players: one message
+// shared by all of them, and (when their queue is empty) one send() each
+void flush_broadcast(Room *room, int reliable) {
+    Message *message = room->pending_broadcast;
+    if (message == NULL) {
+        return;
+    }
+    room->pending_broadcast = NULL;
+    for (int i = 0; i < max_players; i++) {
+        if (room->seats[i] != NULL) {
+            send_message(room->seats[i], message, reliable);
         }
+    }
+    message_unref(message);
+}
+
 
+// Add a message for all the players of a room to its pending broadcast
+void broadcast(Room *room, const char *format, ...) {
+    va_list args;
+    if (!room->is_pending) {
+        room->is_pending = 1;
+        room->next_pending = pending_rooms;
+        pending_rooms = room;
     }
+    va_start(args, format);
+    if (message_vappend(&room->pending_broadcast, format, args) != 0) {
+        printf("Failed to allocate a broadcast\n");
+    }
+    va_end(args);
 }
 
-int get_next_available_id() {
-    for (int i = 0; i <= MAX_PLAYERS; i++) {
-        if (available_ids[i] == 0) { // Find the lowest available ID
-            available_ids[i] = 1; // Mark as taken
-            //print_array();
-            return i;
+
+// Send a message to all the players of a room but one (NULL for all), right
+// away. The pending broadcast goes first to keep the order of the messages.
+void send_to_players(Room *room, Player *except, const char *format, ...) {
+    Message *message = NULL;
+    va_list args;
+    flush_broadcast(room, 0);
+    va_start(args, format);
+    int result = message_vappend(&message, format, args);
+    va_end(args);
+    if (result != 0) {
+        printf("Failed to allocate a message\n");
+        return;
+    }
+    for (int i = 0; i < max_players; i++) {
+        if (room->seats[i] != NULL && room->seats[i] != except) {
+            send_message(room->seats[i], message, 0);
         }
     }
-    return -1; // No available ID
+    message_unref(message);
 }
 
 
-void send_guess_feedback_to_all_players(const char *message) {
-    for (int i = 0; i < num_players; i++) {
-        send(players[i].socket, message, strlen(message), 0);
+// Same as send_to_players, for a single player. Joining messages are sent
+// reliably.
+void send_to_player(Player *player, int reliable, const char *format, ...) {
+    Message *message = NULL;
+    va_list args;
+    flush_broadcast(player->room, 0);
+    va_start(args, format);
+    int result = message_vappend(&message, format, args);
+    va_end(args);
+    if (result != 0) {
+        printf("Failed to allocate a message\n");
+        return;
     }
+    send_message(player, message, reliable);
+    message_unref(message);
 }
 
 
-void handle_player_guess(int index) {
-    int player_socket = players[index].socket;
-    char buffer[BUFFER_SIZE];
-    int bytes_read = recv(player_socket, buffer, sizeof(buffer) - 1, 0);
-    printf("server is ready to read from player %d on socket %d\n",index+1,player_socket);
-    if (bytes_read <= 0) {
-        //printf("player %d disconnected\n", players[index].id);
-
-        // Mark ID as available
-        //available_ids[players[index].id] = 0;
-
-        // Notify other players
-        char disconnect_msg[BUFFER_SIZE];
-        sprintf(disconnect_msg, "player %d disconnected\n", players[index].id);
-        //print_array();
-        for (int i = 0; i <= find_last_available_index(); i++) {
-            if (i != index && available_ids[i]!=0) {
-                send(players[i].socket, disconnect_msg, strlen(disconnect_msg), 0);
-            }
+// The socket of a player became writable: send its queued output
+void flush_player(Player *player) {
+    if (out_queue_flush(&player->out, player->socket) != 0) {
+        kick_player(player);
+    } else if (player->out.count == 0) {
+        update_player_events(player);
+    }
+}
+
+
+// Find the seat restored for the player with the given token
+Ghost *find_ghost(uint64_t token) {
+    int low = 0, high = num_ghosts;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (ghosts[middle].token < token) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
+    }
+    if (low < num_ghosts && ghosts[low].token == token &&
+        ghosts[low].player != NULL) {
+        return &ghosts[low];
+    }
+    return NULL;
+}
 
-        close(player_socket);
-        FD_CLR(player_socket, &master_fds);
 
-        // Remove player from the list
-        available_ids[index] = 0;
-        //print_array();
-        //players[index] = players[num_players - 1]; // Move last player to this position
+// Close the socket of a player and free its seat, without telling anyone.
+// Output still queued gets one last chance to be sent. A kicked player is
+// freed by finish_iteration, which owns the list it is in.
+void drop_player(Player *player) {
+    int fd = player->socket;
+    Room *room = player->room;
+    timer_cancel(&timers, &player->idle_timer);
+    if (player->session != NULL) {
+        udp_close_session(player->session);
+    } else if (fd >= 0) {
+        if (!player->kicked) {
+            out_queue_flush(&player->out, fd);
+        }
+        out_queue_free(&player->out);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        player_by_fd[fd] = NULL;
+        close(fd);
+    } else {
+        find_ghost(player->token)->player = NULL;
+        ghosts_waiting--;
+    }
+    unseat_player(player);
+    if (room->num_players == 0) {
+        timer_cancel(&timers, &room->round_timer);
+        timer_cancel(&timers, &room->reminder_timer);
+    }
+    if (player->session != NULL || fd >= 0) {
         num_players--;
+        publish_load();
+        if (num_players == max_total_players - 1) {
+            set_accepting(1);
+        }
+    }
+    if (!player->kicked) {
+        free(player);
+    }
+}
+
+
+void notify_players(Player *new_player) {
+    printf("Server is ready to write to player %d on socket %d\n",new_player->id,new_player->socket);
+    // Send to all except new player
+    send_to_players(new_player->room, new_player,
+                    "player %d joined the game\n", new_player->id);
+}
+
+
+// Remove a player and tell the others in its room it left
+void disconnect_player(Player *player) {
+    Room *room = player->room;
+    int id = player->id;
+    drop_player(player);
+    if (room->num_players > 0) {
+        broadcast(room, "player %d disconnected\n", id);
+    }
+}
+
+
+// Send the broadcasts of the last events, and disconnect the players that
+// were kicked meanwhile. Telling the others may kick more of them, so repeat
+// until none is left.
+void finish_iteration() {
+    while (pending_rooms != NULL || kicked_players != NULL) {
+        while (pending_rooms != NULL) {
+            Room *room = pending_rooms;
+            pending_rooms = room->next_pending;
+            room->is_pending = 0;
+            flush_broadcast(room, 0);
+        }
+        while (kicked_players != NULL) {
+            Player *player = kicked_players;
+            kicked_players = player->next_kicked;
+            // The player may have been dropped already, e.g. by a win
+            if (player->room != NULL) {
+                disconnect_player(player);
+            }
+            free(player);
+        }
+    }
+    if (udp_socket >= 0) {
+        udp_flush();
+    }
+}
+
+
+// The game is over: everyone leaves, and the room gets a new number when it
+// is opened again
+void end_game(Room *room) {
+    flush_broadcast(room, 1);
+    printf("Game in room %d is over\n", room->number);
+    for (int i = 0; i < max_players; i++) {
+        if (room->seats[i] != NULL) {
+            drop_player(room->seats[i]);
+        }
+    }
+}
+
+
+void player_idle(Timer *timer) {
+    Player *player = container_of(timer, Player, idle_timer);
+    printf("Player %d in room %d was idle, disconnecting\n", player->id, player->room->number);
+    kick_player(player);
+}
+
+
+// The player of a restored seat didn't come back in time
+void ghost_expired(Timer *timer) {
+    Player *ghost = container_of(timer, Player, idle_timer);
+    printf("Player %d in room %d did not resume, freeing its seat\n",
+           ghost->id, ghost->room->number);
+    disconnect_player(ghost);
+}
+
+
+void round_time_up(Timer *timer) {
+    Room *room = container_of(timer, Room, round_timer);
+    broadcast(room, "Time is up! The correct number was %d\n", room->target_number);
+    end_game(room);
+}
+
 
+void remind_round_time(Timer *timer) {
+    Room *room = container_of(timer, Room, reminder_timer);
+    uint64_t ticks_left = room->round_timer.expires - timers.now;
+    int seconds_left = (int) (ticks_left * TIMER_TICK_MS / 1000);
+    broadcast(room, "%d seconds left in this round\n", seconds_left);
+    if (seconds_left > ROUND_REMINDER_INTERVAL) {
+        timer_add(&timers, &room->reminder_timer,
+                  SECONDS_TO_TICKS(ROUND_REMINDER_INTERVAL));
+    }
+}
+
+
+// Start the clock of a room that got its first player, or that was
+// restored with ticks_left of its round (0 for a whole round)
+void start_round(Room *room, uint64_t ticks_left) {
+    init_timer(&room->round_timer, round_time_up);
+    init_timer(&room->reminder_timer, remind_round_time);
+    if (round_time_limit == 0) {
         return;
     }
+    uint64_t round_ticks = SECONDS_TO_TICKS(round_time_limit);
+    if (ticks_left == 0 || ticks_left > round_ticks) {
+        ticks_left = round_ticks;
+    }
+    timer_add(&timers, &room->round_timer, ticks_left);
+    // The reminders come every interval since the start of the round
+    uint64_t interval = SECONDS_TO_TICKS(ROUND_REMINDER_INTERVAL);
+    uint64_t next_reminder = interval - (round_ticks - ticks_left) % interval;
+    if (next_reminder < ticks_left) {
+        timer_add(&timers, &room->reminder_timer, next_reminder);
+    }
+}
+
+
+// The seat restored for a resume token given in hexadecimal, NULL if there
+// is none
+Ghost *find_ghost_text(const char *token_text) {
+    char *end;
+    uint64_t token = strtoull(token_text, &end, 16);
+    return *end == '\0' ? find_ghost(token) : NULL;
+}
+
 
-    buffer[bytes_read] = '\0';
-    int guess = atoi(buffer);
-    char res[BUFFER_SIZE];
-    sprintf(res, "Player %d guessed %d\n", players[index].id, guess);
+// Put a player in the seat it had before the server restarted, in place of
+// the ghost holding it
+void take_ghost_seat(Player *player, Ghost *ghost) {
+    Player *seat = ghost->player;
+    ghost->player = NULL;
+    ghosts_waiting--;
+    timer_cancel(&timers, &seat->idle_timer);
 
-    for (int i = 0; i < num_players; i++) {
-        send(players[i].socket, res, strlen(res), 0);
+    Room *room = seat->room;
+    room->seats[seat->id - 1] = player;
+    player->room = room;
+    player->id = seat->id;
+    player->token = seat->token;
+    free(seat);
+    printf("Player %d resumed in room %d\n", player->id, room->number);
+    send_to_player(player, 1, "Welcome back to room %d, your id is %d\n",
+                   room->number, player->id);
+    send_to_players(room, player, "player %d rejoined the game\n", player->id);
+}
+
+
+// A player that already has a seat asked for the one it had before the
+// server restarted: it leaves the seat it was given and takes its old one
+// back
+void resume_player(Player *player, const char *token_text) {
+    Ghost *ghost = find_ghost_text(token_text);
+    if (ghost == NULL) {
+        send_to_player(player, 0, "Unknown resume token\n");
+        return;
     }
-    printf("Server is ready to write to player %d on socket %d\n",index+1,player_socket);
-    char response[BUFFER_SIZE];
 
-    // Send feedback to all players
+    Room *old_room = player->room;
+    int old_id = player->id;
+    // The player still gets what was broadcast while it had the seat, but
+    // not that it left, even when its old seat is in the same room
+    flush_broadcast(old_room, 0);
+    unseat_player(player);
+    if (old_room->num_players == 0) {
+        timer_cancel(&timers, &old_room->round_timer);
+        timer_cancel(&timers, &old_room->reminder_timer);
+    } else {
+        send_to_players(old_room, NULL, "player %d disconnected\n", old_id);
+    }
+    take_ghost_seat(player, ghost);
+}
+
 
+// Handle one guess of a player. The player is dropped if it wins.
+// Returns 1 when the game is over.
+int handle_player_guess(Player *player, const char *line) {
+    Room *room = player->room;
+    int guess = atoi(line);
+    broadcast(room, "Player %d guessed %d\n", player->id, guess);
 
-    if (guess < target_number) {
-        sprintf(response, "The guess %d is too low\n", guess);
-        send_guess_feedback_to_all_players(response);
-    } else if (guess > target_number) {
-        sprintf(response, "The guess %d is too high\n", guess);
-        send_guess_feedback_to_all_players(response);
+    // Send feedback to all players, in the same message as the guess
+    if (guess < room->target_number) {
+        broadcast(room, "The guess %d is too low\n", guess);
+    } else if (guess > room->target_number) {
+        broadcast(room, "The guess %d is too high\n", guess);
     } else {
         // Player guessed correctly
-        sprintf(response, "Player %d wins! The correct number is %d\n", players[index].id, target_number);
-        for (int i = 0; i < num_players; i++) {
-            send(players[i].socket, response, strlen(response), 0);
-            close(players[i].socket);
+        broadcast(room, "Player %d wins! The correct number is %d\n", player->id, room->target_number);
+        end_game(room);
+        return 1;
+    }
+    return 0;
+}
+
+
+// Handle every complete line of the input of a player, which just got
+// bytes_read more bytes, as a guess or as a request to resume. A line split
+// between reads waits in the input buffer of the player for its end.
+void handle_player_lines(Player *player, size_t bytes_read) {
+    if (idle_timeout > 0) {
+        timer_add(&timers, &player->idle_timer, SECONDS_TO_TICKS(idle_timeout));
+    }
+    char *start = player->in;
+    char *end = player->in + player->in_len + bytes_read;
+    char *newline;
+    while ((newline = memchr(start, '\n', (size_t) (end - start))) != NULL) {
+        *newline = '\0';
+        if (newline > start && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        if (strncmp(start, "resume ", 7) == 0) {
+            resume_player(player, start + 7);
+        } else if (*start != '\0') {
+            if (handle_player_guess(player, start) != 0 || player->kicked) {
+                return; // the game is over, or the player is leaving
+            }
+        }
+        start = newline + 1;
+    }
+
+    player->in_len = (size_t) (end - start);
+    if (player->in_len == sizeof(player->in)) {
+        // A whole buffer without a line end isn't a guess
+        printf("Player %d sent a line too long, disconnecting\n", player->id);
+        kick_player(player);
+        return;
+    }
+    memmove(player->in, start, player->in_len);
+}
+
+
+// Seed the generator of the resume tokens, so a restarted server doesn't
+// give the same tokens again
+void seed_tokens() {
+    FILE *fp = fopen("/dev/urandom", "rb");
+    if (fp == NULL || fread(&token_state, sizeof(token_state), 1, fp) != 1) {
+        token_state = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+}
+
+
+// Next resume token (splitmix64), never 0
+uint64_t new_token() {
+    uint64_t token;
+    do {
+        token = (token_state += 0x9e3779b97f4a7c15ULL);
+        token = (token ^ (token >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        token = (token ^ (token >> 27)) * 0x94d049bb133111ebULL;
+        token ^= token >> 31;
+    } while (token == 0);
+    return token;
+}
+
+
+void take_snapshot(Timer *timer) {
+    if (save_snapshot(snapshot_path, max_players, &timers) != 0) {
+        perror("Snapshot error");
+    }
+    timer_add(&timers, timer, SECONDS_TO_TICKS(SNAPSHOT_INTERVAL));
+}
+
+
+// Keep a restored seat for its player until it resumes or the grace period
+// ends
+void restore_ghost(Room *room, int id, uint64_t token) {
+    static int ghosts_capacity = 0;
+    if (num_ghosts == ghosts_capacity) {
+        int capacity = ghosts_capacity ? ghosts_capacity * 2 : 64;
+        Ghost *table = realloc(ghosts, capacity * sizeof(Ghost));
+        if (table == NULL) {
+            return;
+        }
+        ghosts = table;
+        ghosts_capacity = capacity;
+    }
+    Player *ghost = calloc(1, sizeof(Player));
+    if (ghost == NULL) {
+        return;
+    }
+    ghost->socket = -1;
+    ghost->token = token;
+    restore_seat(ghost, room, id);
+    init_timer(&ghost->idle_timer, ghost_expired);
+    timer_add(&timers, &ghost->idle_timer, SECONDS_TO_TICKS(RESUME_GRACE_PERIOD));
+    ghosts[num_ghosts++] = (Ghost) {token, ghost};
+    ghosts_waiting++;
+}
+
+
+void restore_round(Room *room, uint64_t ticks_left) {
+    if (room->num_players > 0) {
+        start_round(room, ticks_left);
+    }
+}
+
+
+int compare_ghosts(const void *a, const void *b) {
+    const Ghost *first = a, *second = b;
+    return (first->token > second->token) - (first->token < second->token);
+}
+
+
+// Bring back the rooms of the last snapshot, if there is one
+void restore_snapshot() {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int seats = load_snapshot(snapshot_path, max_players, restore_round,
+                              restore_ghost);
+    if (seats < 0) {
+        return;
+    }
+    qsort(ghosts, (size_t) num_ghosts, sizeof(Ghost), compare_ghosts);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Restored %d players in %d rooms from %s in %.1f ms\n",
+           num_ghosts, rooms_opened(), snapshot_path,
+           (end.tv_sec - start.tv_sec) * 1e3 +
+           (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+
+// Save the rooms one last time and exit
+void shutdown_server() {
+    if (snapshot_path != NULL &&
+        save_snapshot(snapshot_path, max_players, &timers) != 0) {
+        perror("Snapshot error");
+    }
+    cleanup();
+}
+
+
+// Count a connected player and start its idle clock
+void start_player(Player *player) {
+    if (++num_players == max_total_players) {
+        set_accepting(0);
+    }
+    publish_load();
+    init_timer(&player->idle_timer, player_idle);
+    if (idle_timeout > 0) {
+        timer_add(&timers, &player->idle_timer, SECONDS_TO_TICKS(idle_timeout));
+    }
+}
+
+
+// Start the game of a player that just got a seat
+void welcome_player(Player *player) {
+    start_player(player);
+    printf("Player %d joined room %d\n", player->id, player->room->number);
+    if (player->room->num_players == 1) {
+        start_round(player->room, 0);
+    }
+
+    send_to_player(player, 1, "Welcome to the game, your id is %d\n"
+                              "Your resume token is %016" PRIx64 "\n",
+                   player->id, player->token);
+
+    notify_players(player); // Notify other players
+}
+
+
+// Close the connection of a player that doesn't have a seat
+void close_unseated(Player *player) {
+    timer_cancel(&timers, &player->idle_timer);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, player->socket, NULL);
+    player_by_fd[player->socket] = NULL;
+    close(player->socket);
+    free(player);
+}
+
+
+// Give the player of a new connection a seat and start its game. Returns
+// -1 if all the rooms are full, the player is then gone.
+int seat_new_player(Player *player) {
+    timer_cancel(&timers, &player->idle_timer);
+    if (seat_player(player) < 0) {
+        printf("All the rooms are full, rejecting connection\n");
+        close_unseated(player);
+        return -1;
+    }
+    welcome_player(player);
+    return 0;
+}
+
+
+// A new connection didn't ask to resume in time
+void resume_line_expired(Timer *timer) {
+    seat_new_player(container_of(timer, Player, idle_timer));
+}
+
+
+// The first bytes of a connection held for its resume line. A first line
+// "resume <token>" takes the restored seat right away, without a seat of
+// its own first, so it works even when the ghosts fill all the rooms. Any
+// other first line gets a new seat, then is handled as usual.
+void handle_unseated_input(Player *player, size_t bytes_read) {
+    size_t len = player->in_len + bytes_read;
+    char *newline = memchr(player->in, '\n', len);
+    if (newline == NULL && len < sizeof(player->in)) {
+        player->in_len = len;
+        return; // the rest of the line is on its way
+    }
+    player->in_len = 0;
+    if (newline != NULL && strncmp(player->in, "resume ", 7) == 0) {
+        size_t line_len = (size_t) (newline - player->in) + 1;
+        char token_text[MAX_BUFFER];
+        size_t token_len = line_len - 8;
+        if (token_len > 0 && player->in[7 + token_len - 1] == '\r') {
+            token_len--;
+        }
+        memcpy(token_text, player->in + 7, token_len);
+        token_text[token_len] = '\0';
+        Ghost *ghost = find_ghost_text(token_text);
+        if (ghost != NULL) {
+            timer_cancel(&timers, &player->idle_timer);
+            start_player(player);
+            take_ghost_seat(player, ghost);
+            memmove(player->in, player->in + line_len, len - line_len);
+            handle_player_lines(player, len - line_len);
+            return;
+        }
+        // An unknown token is answered once the player is seated
+    }
+    if (seat_new_player(player) == 0) {
+        handle_player_lines(player, len);
+    }
+}
+
+
+// Read what the socket of a player has for it
+void handle_player_input(Player *player) {
+    int player_socket = player->socket;
+    ssize_t bytes_read = recv(player_socket, player->in + player->in_len,
+                              sizeof(player->in) - player->in_len, 0);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                           errno == EINTR)) {
+        return;
+    }
+    printf("server is ready to read from player %d on socket %d\n",player->id,player_socket);
+    if (bytes_read <= 0) {
+        if (player->room == NULL) {
+            close_unseated(player);
+        } else {
+            disconnect_player(player);
         }
-        num_players = 0;
-        target_number = rand() % 100 + 1;
-        printf("Game reset with new target number: %d\n", target_number);
+        return;
+    }
+    printf("Server is ready to write to player %d on socket %d\n",player->id,player_socket);
+    if (player->room == NULL) {
+        handle_unseated_input(player, (size_t) bytes_read);
+        return;
+    }
+    handle_player_lines(player, (size_t) bytes_read);
+}
+
+
+// Seat the player of a new connection in a room of the reactor. While
+// restored seats wait for their players, the connection is held without a
+// seat until its first line, which may be a resume request.
+void add_connection(int new_socket) {
+    Player *player = calloc(1, sizeof(Player));
+    if (player == NULL) {
+        printf("Failed to allocate a player\n");
+        close(new_socket);
+        return;
     }
-    printf("server is ready to write to player %d on socket %d\n",players[index].id, player_socket);
+    player->socket = new_socket;
+    player->token = new_token();
+    // Messages are small and must not wait for the ACK of the previous one
+    int one = 1;
+    setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (set_non_blocking(new_socket) < 0 || watch_player(player) < 0) {
+        perror("Epoll error");
+        free(player);
+        close(new_socket);
+        return;
+    }
+    if (ghosts_waiting > 0) {
+        init_timer(&player->idle_timer, resume_line_expired);
+        timer_add(&timers, &player->idle_timer,
+                  RESUME_LINE_WAIT_MS / TIMER_TICK_MS);
+        return;
+    }
+    seat_new_player(player);
 }
 
 
-void handle_new_connection() {
-//    for(int k=0;k<MAX_PLAYERS;k++)
-//    {
-//        if(available_ids[k]==1)
-//        {
-//            handle_player_guess(k);
-//        }
-//    }
+// Accept a new connection and seat it in a room. Returns -1 when there is
+// no connection left to accept.
+int handle_new_connection() {
     printf("Server is ready to read from welcome socket %d\n",server_socket);
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
     int new_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
     if (new_socket < 0) {
-        perror("Accept error");
-        return;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("Accept error");
+        }
+        return -1;
     }
+    add_connection(new_socket);
+    return 0;
+}
 
-    if (num_players >= MAX_PLAYERS) {
-        printf("Max players reached, rejecting connection\n");
-        close(new_socket);
+
+// Seat the connections the acceptor handed to this reactor
+void adopt_connections() {
+    uint64_t count;
+    if (read(self->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Eventfd error");
+    }
+    int fd;
+    while ((fd = handoff_pop(&self->handoff)) >= 0) {
+        add_connection(fd);
+    }
+}
+
+
+// A new player asked to join over UDP
+void udp_player_joined(UdpSession *session) {
+    Player *player = calloc(1, sizeof(Player));
+    if (player == NULL) {
+        printf("Failed to allocate a player\n");
+        return;
+    }
+    player->socket = -1;
+    player->session = session;
+    player->token = new_token();
+    if (seat_player(player) < 0) {
+        printf("All the rooms are full, rejecting player\n");
+        free(player);
         return;
     }
+    session->player = player;
+    welcome_player(player);
+}
 
-    int new_id = get_next_available_id()+1;
-    if (new_id == -1) {
-        printf("No available player IDs\n");
-        close(new_socket);
+
+// A datagram from a UDP player. It holds whole lines, the last one may
+// lack its line end.
+void udp_player_input(UdpSession *session, const char *data, size_t len) {
+    Player *player = session->player;
+    if (player->kicked) {
+        return;
+    }
+    if (len >= sizeof(player->in) - player->in_len) {
+        printf("Player %d sent a line too long, disconnecting\n", player->id);
+        kick_player(player);
         return;
     }
+    memcpy(player->in + player->in_len, data, len);
+    if (len == 0 || data[len - 1] != '\n') {
+        player->in[player->in_len + len++] = '\n';
+    }
+    handle_player_lines(player, len);
+}
+
+
+// A UDP player said goodbye, or stopped answering
+void udp_player_lost(UdpSession *session) {
+    kick_player(session->player);
+}
+
+
+// Let the players join over UDP as well, on one socket for all of them
+void init_udp(int port) {
+    udp_socket = init_udp_transport(port, &timers, udp_player_joined,
+                                    udp_player_input, udp_player_lost);
+    if (udp_socket < 0) {
+        perror("UDP socket error");
+        exit(1);
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = udp_socket};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_socket, &event) < 0) {
+        perror("Epoll error");
+        exit(1);
+    }
+}
+
+
+// Set up the rooms and the event loop of the calling thread. A reactor
+// waits for the sockets the acceptor hands to it, the only reactor of the
+// main thread accepts them itself.
+void init_reactor(int first_room) {
+    // Each reactor has its own stream of target numbers, so a seed gives the
+    // same games whatever the order the threads open their rooms in
+    unsigned int seed = game_seed + (unsigned int) (self != NULL ? self->index : 0);
+    if (init_matchmaker(max_players, rooms_per_reactor, first_room, seed) < 0) {
+        perror("Allocation error");
+        exit(1);
+    }
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("Epoll error");
+        exit(1);
+    }
+    int fd = self != NULL ? self->wake_fd : server_socket;
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("Epoll error");
+        exit(1);
+    }
+    init_timer_wheel(&timers, timer_now());
+    seed_tokens();
+}
+
+
+// Handle the events of the reactor of the calling thread until the server
+// is stopped
+void run_reactor() {
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS,
+                                    timer_wheel_timeout(&timers));
+        if (self == NULL && stop_requested) {
+            shutdown_server();
+        }
+        if (self != NULL && __atomic_load_n(&self->stop, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Epoll error");
+            exit(1);
+        }
+        // Run the timers that expired, and make the timers set while
+        // handling the events count from now
+        timer_wheel_advance(&timers, timer_now());
+
+        // FIRST LOOP: Handle all player messages first
+        int new_connection = 0;
+        int handed_off = 0;
+        for (int i = 0; i < num_events; i++) {
+            int fd = events[i].data.fd;
+            if (self != NULL && fd == self->wake_fd) {
+                handed_off = 1;
+                continue;
+            }
+            if (self == NULL && fd == server_socket) {
+                new_connection = 1;
+                continue;
+            }
+            if (fd == udp_socket) {
+                udp_receive();
+                continue;
+            }
+            // The player may have left during an earlier event of this batch
+            Player *player = find_player(fd);
+            if (player == NULL) {
+                continue;
+            }
+            if (!player->kicked && (events[i].events & EPOLLOUT)) {
+                flush_player(player);
+            }
+            if (!player->kicked &&
+                (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                handle_player_input(player);
+            }
+        }
+        finish_iteration();
+        // SECOND LOOP: Now handle new connections, after the events of this
+        // batch so none of them refers to a reused fd
+        for (int i = 0; new_connection && i < MAX_EVENTS &&
+                        num_players < max_total_players; i++) {
+            if (handle_new_connection() < 0) {
+                break;
+            }
+        }
+        if (handed_off) {
+            adopt_connections();
+        }
+        finish_iteration();
+    }
+}
+
+
+void *reactor_thread(void *arg) {
+    self = arg;
+    init_reactor(self->index * rooms_per_reactor + 1);
+    run_reactor();
+    release_reactor();
+    return NULL;
+}
+
+
+// The reactor with the fewest players, counting those handed to it and not
+// seated yet. NULL if all of them are full.
+Reactor *least_loaded_reactor() {
+    Reactor *best = NULL;
+    long best_load = max_total_players;
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor *reactor = &reactors[i];
+        unsigned int queued = handoff_size(&reactor->handoff);
+        long load = __atomic_load_n(&reactor->load, __ATOMIC_ACQUIRE) +
+                    (long) queued;
+        if (load < best_load && queued < HANDOFF_QUEUE_CAPACITY) {
+            best = reactor;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+
+// Accept the waiting connections and hand each to the least loaded
+// reactor, waking every reactor that got some once. Returns 0 if all the
+// reactors are full.
+int hand_off_connections() {
+    int result = 1;
+    for (int i = 0; i < MAX_EVENTS; i++) {
+        Reactor *reactor = least_loaded_reactor();
+        if (reactor == NULL) {
+            result = 0;
+            break;
+        }
+        int fd = accept(server_socket, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept error");
+            }
+            break;
+        }
+        handoff_push(&reactor->handoff, fd);
+        reactor->to_wake = 1;
+    }
+    for (int i = 0; i < num_reactors; i++) {
+        uint64_t one = 1;
+        if (reactors[i].to_wake &&
+            write(reactors[i].wake_fd, &one, sizeof(one)) < 0) {
+            perror("Eventfd error");
+        }
+        reactors[i].to_wake = 0;
+    }
+    return result;
+}
 
-//    players[num_players].socket = new_socket;
-//    num_players++;
-//    players[num_players].id = new_id;
-    players[new_id-1].socket = new_socket;
-    num_players++;
-    players[new_id-1].id = new_id;
-    FD_SET(new_socket, &master_fds);
 
-    char welcome_msg[BUFFER_SIZE];
-    sprintf(welcome_msg, "Welcome to the game, your id is %d\n", new_id);
-    send(new_socket, welcome_msg, strlen(welcome_msg), 0);
+// Start the reactor threads and accept connections for them until the
+// server is stopped. The threads don't take the signals, so they wake the
+// main thread.
+void run_acceptor() {
+    // The handoff queues keep their ends on separate cache lines, which
+    // calloc() doesn't align to
+    size_t reactors_size = (size_t) num_reactors * sizeof(Reactor);
+    void *memory = NULL;
+    if (posix_memalign(&memory, CACHE_LINE_SIZE, reactors_size) != 0) {
+        memory = NULL;
+    }
+    reactors = memory;
+    capacity_fd = eventfd(0, EFD_NONBLOCK);
+    acceptor_epoll_fd = epoll_create1(0);
+    if (reactors == NULL || capacity_fd < 0 || acceptor_epoll_fd < 0) {
+        perror("Reactor error");
+        exit(1);
+    }
+    memset(reactors, 0, reactors_size);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = capacity_fd};
+    epoll_ctl(acceptor_epoll_fd, EPOLL_CTL_ADD, capacity_fd, &event);
+    event.data.fd = server_socket;
+    epoll_ctl(acceptor_epoll_fd, EPOLL_CTL_ADD, server_socket, &event);
 
+    sigset_t signals, old_signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+    for (int i = 0; i < num_reactors; i++) {
+        reactors[i].index = i;
+        reactors[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (reactors[i].wake_fd < 0 ||
+            pthread_create(&reactors[i].thread, NULL, reactor_thread,
+                           &reactors[i]) != 0) {
+            perror("Reactor error");
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    printf("Started %d reactors with %d rooms each\n", num_reactors,
+           rooms_per_reactor);
 
-    notify_players(new_socket,new_id); // Notify other players
+    int accepting = 1;
+    while (!stop_requested) {
+        struct epoll_event events[2];
+        int num_events = epoll_wait(acceptor_epoll_fd, events, 2, -1);
+        if (num_events < 0 && errno != EINTR) {
+            perror("Epoll error");
+            break;
+        }
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.fd == capacity_fd) {
+                uint64_t count;
+                if (read(capacity_fd, &count, sizeof(count)) < 0) {
+                    perror("Eventfd error");
+                }
+            }
+        }
+        if (num_events > 0 && !stop_requested) {
+            int available = hand_off_connections();
+            if (available != accepting) {
+                // Leave the connections in the backlog while all the
+                // reactors are full
+                event.events = available ? EPOLLIN : 0;
+                epoll_ctl(acceptor_epoll_fd, EPOLL_CTL_MOD, server_socket,
+                          &event);
+                accepting = available;
+            }
+        }
+    }
 
+    for (int i = 0; i < num_reactors; i++) {
+        uint64_t one = 1;
+        __atomic_store_n(&reactors[i].stop, 1, __ATOMIC_RELEASE);
+        if (write(reactors[i].wake_fd, &one, sizeof(one)) < 0) {
+            perror("Eventfd error");
+        }
+    }
+    for (int i = 0; i < num_reactors; i++) {
+        pthread_join(reactors[i].thread, NULL);
+        int fd;
+        while ((fd = handoff_pop(&reactors[i].handoff)) >= 0) {
+            close(fd);
+        }
+        close(reactors[i].wake_fd);
+    }
+    free(reactors);
+    close(capacity_fd);
+    close(acceptor_epoll_fd);
+    close(server_socket);
+    exit(0);
 }
 
 
@@ -255,8 +1301,49 @@ int is_number(const char *str) {
 }
 
 int main(int argc, char *argv[]) {
+    // Optional "-w <bytes>", "-r <rooms>", "-i <seconds>", "-t <seconds>",
+    // "-f <file>", "-u <port>" and "-n <threads>" before the other
+    // arguments. 0 seconds turns the idle timeout or the round time limit
+    // off.
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-f") == 0) {
+            snapshot_path = argv[2];
+            argc -= 2;
+            argv += 2;
+            continue;
+        }
+        long value = strtol(argv[2], NULL, 10);
+        if (value < 0 || (value == 0 && (strcmp(argv[1], "-w") == 0 ||
+                                         strcmp(argv[1], "-r") == 0 ||
+                                         strcmp(argv[1], "-u") == 0 ||
+                                         strcmp(argv[1], "-n") == 0)) ||
+            (strcmp(argv[1], "-u") == 0 && value > 65535) ||
+            (strcmp(argv[1], "-n") == 0 && value > MAX_REACTORS)) {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+        if (strcmp(argv[1], "-w") == 0) {
+            high_water_mark = (size_t) value;
+        } else if (strcmp(argv[1], "-r") == 0) {
+            max_rooms = (int) value;
+        } else if (strcmp(argv[1], "-i") == 0) {
+            idle_timeout = (int) value;
+        } else if (strcmp(argv[1], "-t") == 0) {
+            round_time_limit = (int) value;
+        } else if (strcmp(argv[1], "-u") == 0) {
+            udp_port = (int) value;
+        } else if (strcmp(argv[1], "-n") == 0) {
+            num_reactors = (int) value;
+        } else {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
     if (argc != 4) {
-        fprintf(stderr, "Usage: ./server <port> <seed> <max-number-of-players>\n");
+        fprintf(stderr, USAGE);
         exit(1);
     }
 
@@ -266,55 +1353,46 @@ int main(int argc, char *argv[]) {
     int port = atoi(argv[1]);
 
     if (port < 1 || port > 65535) {  // Typical port range check
-        fprintf(stderr, "Usage: ./server <port> <seed> <max-number-of-players>\n");
+        fprintf(stderr, USAGE);
         exit(1);
     }
 
     if (!is_number(seed)) {
-        fprintf(stderr, "Usage: ./server <port> <seed> <max-number-of-players>\n");
+        fprintf(stderr, USAGE);
         exit(1);
     }
 
     int seed_to_int = (int)strtol(argv[2], &endptr, 10);
 
-    int max_players = (int) strtol(argv[3], &endptr, 10);
+    max_players = (int) strtol(argv[3], &endptr, 10);
 
     if (max_players <= 0) {
-        fprintf(stderr, "Usage: ./server <port> <seed> <max-number-of-players>\n");
+        fprintf(stderr, USAGE);
         exit(1);
     }
+    if (num_reactors > 1 && (udp_port != 0 || snapshot_path != NULL)) {
+        fprintf(stderr, "UDP players and snapshots need a single thread\n");
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    // The rooms are split between the reactors
+    rooms_per_reactor = (max_rooms + num_reactors - 1) / num_reactors;
+    max_total_players = (long) max_players * rooms_per_reactor;
     signal(SIGINT, handle_signal);
-    init_server(port, seed_to_int, max_players);
-
-    FD_ZERO(&master_fds);
-    FD_SET(server_socket, &master_fds);
-    struct timeval timeout;
-    timeout.tv_sec = 5; // 5-second timeout
-    timeout.tv_usec = 0;
-    while (1) {
-        read_fds = master_fds;
-        write_fds = master_fds;
-        if (select(FD_SETSIZE, &read_fds, &write_fds, NULL, &timeout) < 0) {
-            perror("Select error");
-            exit(1);
-        }
-
-// FIRST LOOP: Handle all player messages first
-        for (int i = 0; i < FD_SETSIZE; i++) {
-            if (FD_ISSET(i, &read_fds) && i != server_socket) { // Ignore server_socket in this loop
-                for (int j = 0; j < MAX_PLAYERS; j++) {
-                    if (players[j].socket == i) {
-                       // handle_player_guess(players[j].id-1); // Handle player guess first
-                        handle_player_guess(j);
-                        break;
-                    }
-                }
-            }
-        }
-    //sleep(1);
-// SECOND LOOP: Now handle new connections
-        if (FD_ISSET(server_socket, &read_fds) && num_players < max_players) {
-            handle_new_connection();
-        }
+    signal(SIGTERM, handle_signal);
+    init_server(port, seed_to_int);
+    if (num_reactors > 1) {
+        run_acceptor();
+    }
+    init_reactor(1);
+    if (udp_port != 0) {
+        init_udp(udp_port);
     }
+    if (snapshot_path != NULL) {
+        restore_snapshot();
+        init_timer(&snapshot_timer, take_snapshot);
+        timer_add(&timers, &snapshot_timer, SECONDS_TO_TICKS(SNAPSHOT_INTERVAL));
+    }
+
+    run_reactor();
 }
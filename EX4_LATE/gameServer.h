@@ -1,35 +1,47 @@
 #ifndef GUESS_NUMBER_SERVER_H
 #define GUESS_NUMBER_SERVER_H
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <sys/select.h>
-#include <signal.h>
-#include <errno.h>
+#include "out_queue.h"
+#include "timer_wheel.h"
+#include <stdint.h>
 
 #define MAX_BUFFER 256
 
-// Global Variables
-extern int server_socket;
-extern int target_number;
-extern int max_players;
-extern fd_set master_read_set, master_write_set;
-extern int client_sockets[];
-extern char messages[][MAX_BUFFER];
+typedef struct Room Room;
+typedef struct UdpSession UdpSession;
 
-// Function Declarations
-void init_server(int port, int max_players);
-void handle_new_connection();
-void handle_player_guess(int player_id);
-void remove_player(int player_id);
-void broadcast_message(const char *message, int exclude_id);
-void cleanup();
-void signal_handler(int signo);
+// Player structure
+typedef struct Player {
+    int socket;      // -1 for a UDP player, or the seat of a player
+                     // waiting to resume
+    UdpSession *session; // NULL for a TCP player
+    uint64_t token;  // lets the player take its seat back after a restart
+    int id;          // seat in the room, from 1
+    Room *room;      // NULL once the player left
+    char in[MAX_BUFFER]; // input received but not handled yet
+    size_t in_len;   // an incomplete line, between two reads
+    OutQueue out;    // output the socket didn't take yet
+    int kicked;      // set when the player must be disconnected
+    Timer idle_timer; // kicks the player when it stops guessing, or frees
+                      // the seat of a player that doesn't resume
+    struct Player *next_kicked;
+} Player;
+
+// A game with its own number to guess and its own players
+struct Room {
+    int number;              // from 1, for the log
+    int target_number;
+    int num_players;
+    Player **seats;          // indexed by id - 1, NULL for a free seat
+    int lowest_free_seat;    // no seat below it is free
+    Message *pending_broadcast;
+    Room *next_pending;      // in the list of rooms with a pending broadcast
+    int is_pending;          // 1 while in that list
+    Room *next;              // in the matchmaker's list of open or free rooms
+    Room *prev;
+    int is_open;             // 1 while in the list of open rooms
+    Timer round_timer;       // ends the game when the round time is up
+    Timer reminder_timer;    // tells the players how much time is left
+};
 
 #endif // GUESS_NUMBER_SERVER_H
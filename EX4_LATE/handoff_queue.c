@@ -0,0 +1,36 @@
+#include "handoff_queue.h"
+
+
+int handoff_push(HandoffQueue *queue, int fd)
+{
+    unsigned int tail = queue->tail;
+    unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head == HANDOFF_QUEUE_CAPACITY) {
+        return -1;
+    }
+    queue->fds[tail & (HANDOFF_QUEUE_CAPACITY - 1)] = fd;
+    // The socket must be in place before the consumer sees the new tail
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+int handoff_pop(HandoffQueue *queue)
+{
+    unsigned int head = queue->head;
+    unsigned int tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return -1;
+    }
+    int fd = queue->fds[head & (HANDOFF_QUEUE_CAPACITY - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return fd;
+}
+
+
+unsigned int handoff_size(HandoffQueue *queue)
+{
+    unsigned int tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
@@ -0,0 +1,34 @@
+#ifndef _HANDOFF_QUEUE_H_
+#define _HANDOFF_QUEUE_H_
+
+#define HANDOFF_QUEUE_CAPACITY 1024 // a power of two
+#define CACHE_LINE_SIZE 64
+
+// Sockets passed from the acceptor thread to a reactor thread without a
+// lock. There must be a single producer and a single consumer. The indexes
+// only grow; each is written by one side and read by the other, on its own
+// cache line so the two threads don't fight over it.
+typedef struct HandoffQueue {
+    int fds[HANDOFF_QUEUE_CAPACITY];
+    unsigned int head __attribute__((aligned(CACHE_LINE_SIZE))); // next to pop
+    unsigned int tail __attribute__((aligned(CACHE_LINE_SIZE))); // next to push
+} HandoffQueue;
+
+/**
+ * Append a socket to the queue. Called by the producer only.
+ * @return 0 on success, -1 if the queue is full.
+ */
+int handoff_push(HandoffQueue *queue, int fd);
+
+/**
+ * Take the oldest socket out of the queue. Called by the consumer only.
+ * @return the socket, -1 if the queue is empty.
+ */
+int handoff_pop(HandoffQueue *queue);
+
+/**
+ * Get the number of sockets in the queue, as seen from either side.
+ */
+unsigned int handoff_size(HandoffQueue *queue);
+
+#endif /* _HANDOFF_QUEUE_H_ */
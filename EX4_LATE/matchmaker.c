@@ -0,0 +1,217 @@
+#define _GNU_SOURCE // random_r
+#include "matchmaker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every reactor thread has its own matchmaker, so the rooms of a thread are
+// only ever touched by it
+static __thread Room *rooms = NULL; // opened lowest first
+static __thread int num_rooms = 0;
+static __thread int rooms_used = 0; // rooms[0 .. rooms_used) were opened before
+static __thread int first_number = 1; // of rooms[0]
+static __thread int seats_per_room = 0;
+static __thread Room *open_rooms = NULL; // rooms with players and free seats
+static __thread Room *free_rooms = NULL; // empty rooms to open again
+// The target numbers of the rooms, a stream of their own per thread
+static __thread struct random_data random_state;
+static __thread char random_buffer[128]; // the size srand() uses
+
+
+int init_matchmaker(int players_per_room, int max_rooms, int first_room,
+                    unsigned int seed)
+{
+    rooms = calloc((size_t) max_rooms, sizeof(Room));
+    if (!rooms) {
+        return -1;
+    }
+    memset(&random_state, 0, sizeof(random_state));
+    initstate_r(seed, random_buffer, sizeof(random_buffer), &random_state);
+    num_rooms = max_rooms;
+    seats_per_room = players_per_room;
+    first_number = first_room;
+    return 0;
+}
+
+
+static void list_open_room(Room *room)
+{
+    room->prev = NULL;
+    room->next = open_rooms;
+    if (open_rooms != NULL) {
+        open_rooms->prev = room;
+    }
+    open_rooms = room;
+    room->is_open = 1;
+}
+
+
+static void unlist_open_room(Room *room)
+{
+    if (room->prev != NULL) {
+        room->prev->next = room->next;
+    } else {
+        open_rooms = room->next;
+    }
+    if (room->next != NULL) {
+        room->next->prev = room->prev;
+    }
+    room->is_open = 0;
+}
+
+
+// Set up the next room that was never used
+static Room *use_new_room(void)
+{
+    Room *room = &rooms[rooms_used];
+    room->seats = calloc((size_t) seats_per_room, sizeof(Player *));
+    if (!room->seats) {
+        return NULL;
+    }
+    room->number = first_number + rooms_used++;
+    return room;
+}
+
+
+// Take an empty room and start a new game in it
+static Room *open_room(void)
+{
+    Room *room = free_rooms;
+    if (room != NULL) {
+        free_rooms = room->next;
+    } else if (rooms_used < num_rooms) {
+        room = use_new_room();
+        if (room == NULL) {
+            return NULL;
+        }
+    } else {
+        return NULL;
+    }
+    int32_t value;
+    random_r(&random_state, &value);
+    room->target_number = value % 100 + 1;
+    room->lowest_free_seat = 0;
+    printf("Room %d opened with target number %d\n", room->number,
+           room->target_number);
+    return room;
+}
+
+
+int seat_player(Player *player)
+{
+    Room *room = open_rooms;
+    if (room == NULL) {
+        room = open_room();
+        if (room == NULL) {
+            return -1;
+        }
+        list_open_room(room);
+    }
+    int seat = room->lowest_free_seat;
+    room->seats[seat] = player;
+    room->num_players++;
+    while (room->lowest_free_seat < seats_per_room &&
+           room->seats[room->lowest_free_seat] != NULL) {
+        room->lowest_free_seat++;
+    }
+    if (room->num_players == seats_per_room) {
+        unlist_open_room(room);
+    }
+    player->room = room;
+    player->id = seat + 1;
+    return 0;
+}
+
+
+void unseat_player(Player *player)
+{
+    Room *room = player->room;
+    int seat = player->id - 1;
+    room->seats[seat] = NULL;
+    if (seat < room->lowest_free_seat) {
+        room->lowest_free_seat = seat;
+    }
+    player->room = NULL;
+
+    if (--room->num_players == 0) {
+        if (room->is_open) {
+            unlist_open_room(room);
+        }
+        room->next = free_rooms;
+        free_rooms = room;
+    } else if (!room->is_open) {
+        list_open_room(room);
+    }
+}
+
+
+int rooms_opened(void)
+{
+    return rooms_used;
+}
+
+
+Room *get_room(int index)
+{
+    return &rooms[index];
+}
+
+
+Room *restore_room(int number, int target_number)
+{
+    int index = number - first_number;
+    if (index < rooms_used || index >= num_rooms) {
+        return NULL;
+    }
+    // The rooms skipped are empty
+    while (rooms_used < index) {
+        Room *room = use_new_room();
+        if (room == NULL) {
+            return NULL;
+        }
+        room->next = free_rooms;
+        free_rooms = room;
+    }
+    Room *room = use_new_room();
+    if (room == NULL) {
+        return NULL;
+    }
+    room->target_number = target_number;
+    room->lowest_free_seat = 0;
+    return room;
+}
+
+
+void restore_seat(Player *player, Room *room, int id)
+{
+    room->seats[id - 1] = player;
+    room->num_players++;
+    while (room->lowest_free_seat < seats_per_room &&
+           room->seats[room->lowest_free_seat] != NULL) {
+        room->lowest_free_seat++;
+    }
+    if (room->num_players == seats_per_room) {
+        if (room->is_open) {
+            unlist_open_room(room);
+        }
+    } else if (!room->is_open) {
+        list_open_room(room);
+    }
+    player->room = room;
+    player->id = id;
+}
+
+
+void close_matchmaker(void)
+{
+    for (int i = 0; i < rooms_used; i++) {
+        if (rooms[i].pending_broadcast != NULL) {
+            message_unref(rooms[i].pending_broadcast);
+        }
+        free(rooms[i].seats);
+    }
+    free(rooms);
+    rooms = NULL;
+    num_rooms = rooms_used = 0;
+    open_rooms = free_rooms = NULL;
+}
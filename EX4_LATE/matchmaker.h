@@ -0,0 +1,66 @@
+#ifndef _MATCHMAKER_H_
+#define _MATCHMAKER_H_
+
+#include "gameServer.h"
+
+/**
+ * Set up the rooms of the calling thread.
+ * @param players_per_room number of players a game can have
+ * @param max_rooms number of games that can run at the same time
+ * @param first_room number of the first room, the others follow it
+ * @param seed of the target numbers, the same as srand() would give for
+ * the same seed
+ * @return 0 on success, -1 in case of allocation error.
+ */
+int init_matchmaker(int players_per_room, int max_rooms, int first_room,
+                    unsigned int seed);
+
+/**
+ * Seat a new player in a game. Games that already have players are filled
+ * first; a new game (with a new number to guess) is opened only when all of
+ * them are full. Takes O(1) apart from finding the lowest free seat.
+ * @param player the player, its room and id are set
+ * @return 0 on success, -1 if all the rooms are full.
+ */
+int seat_player(Player *player);
+
+/**
+ * Free the seat of a player. A room left empty is closed, and gets a new
+ * number to guess when it is opened again.
+ */
+void unseat_player(Player *player);
+
+/**
+ * Get the number of rooms opened since the start.
+ */
+int rooms_opened(void);
+
+/**
+ * Get a room by the order it was first opened in, from 0 to
+ * rooms_opened() - 1.
+ */
+Room *get_room(int index);
+
+/**
+ * Open a given room again with a given number to guess, when restoring a
+ * snapshot. Rooms must be restored in increasing number, before any player
+ * is seated.
+ * @return the room, NULL if the number is out of range or in case of
+ * allocation error.
+ */
+Room *restore_room(int number, int target_number);
+
+/**
+ * Seat a player in a given seat of a restored room.
+ * @param player the player, its room and id are set
+ * @param room
+ * @param id the seat, from 1
+ */
+void restore_seat(Player *player, Room *room, int id);
+
+/**
+ * Release all the rooms.
+ */
+void close_matchmaker(void);
+
+#endif /* _MATCHMAKER_H_ */
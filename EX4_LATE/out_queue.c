@@ -0,0 +1,147 @@
+#include "out_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define MESSAGE_INITIAL_CAPACITY 128
+
+
+int message_vappend(Message **message, const char *format, va_list args)
+{
+    va_list copy;
+    va_copy(copy, args);
+    int needed = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (needed < 0) {
+        return -1;
+    }
+
+    Message *current = *message;
+    size_t len = current ? current->len : 0;
+    size_t capacity = current ? current->capacity : 0;
+    if (len + (size_t) needed + 1 > capacity) {
+        capacity = capacity ? capacity : MESSAGE_INITIAL_CAPACITY;
+        while (capacity < len + (size_t) needed + 1) {
+            capacity *= 2;
+        }
+        Message *grown = realloc(current, sizeof(Message) + capacity);
+        if (!grown) {
+            return -1;
+        }
+        if (!current) {
+            grown->refs = 1;
+            grown->len = 0;
+        }
+        grown->capacity = capacity;
+        current = grown;
+        *message = current;
+    }
+    vsnprintf(current->data + len, (size_t) needed + 1, format, args);
+    current->len += (size_t) needed;
+    return 0;
+}
+
+
+void message_unref(Message *message)
+{
+    if (--message->refs == 0) {
+        free(message);
+    }
+}
+
+
+static int grow_queue(OutQueue *queue)
+{
+    size_t capacity = queue->capacity ?
+                      queue->capacity * 2 : OUT_QUEUE_INITIAL_CAPACITY;
+    OutChunk *chunks = malloc(capacity * sizeof(OutChunk));
+    if (!chunks) {
+        return -1;
+    }
+    // Unwrap the queued chunks to the start of the new buffer
+    for (size_t i = 0; i < queue->count; i++) {
+        chunks[i] = queue->chunks[(queue->head + i) & (queue->capacity - 1)];
+    }
+    free(queue->chunks);
+    queue->chunks = chunks;
+    queue->capacity = capacity;
+    queue->head = 0;
+    return 0;
+}
+
+
+int out_queue_push(OutQueue *queue, Message *message, size_t offset)
+{
+    if (queue->count == queue->capacity && grow_queue(queue) != 0) {
+        return -1;
+    }
+    size_t tail = (queue->head + queue->count) & (queue->capacity - 1);
+    queue->chunks[tail] = (OutChunk) {message, offset};
+    queue->count++;
+    queue->bytes += message->len - offset;
+    message->refs++;
+    return 0;
+}
+
+
+int out_queue_flush(OutQueue *queue, int fd)
+{
+    while (queue->count > 0) {
+        struct iovec iov[OUT_QUEUE_MAX_IOV];
+        struct msghdr msg = {0};
+        size_t n = 0;
+        while (n < queue->count && n < OUT_QUEUE_MAX_IOV) {
+            OutChunk *chunk =
+                    &queue->chunks[(queue->head + n) & (queue->capacity - 1)];
+            iov[n].iov_base = chunk->message->data + chunk->offset;
+            iov[n].iov_len = chunk->message->len - chunk->offset;
+            n++;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        queue->bytes -= (size_t) sent;
+
+        // Release the chunks that were sent completely
+        size_t left = (size_t) sent;
+        while (left > 0) {
+            OutChunk *chunk = &queue->chunks[queue->head];
+            size_t chunk_len = chunk->message->len - chunk->offset;
+            if (left < chunk_len) {
+                chunk->offset += left;
+                break;
+            }
+            left -= chunk_len;
+            message_unref(chunk->message);
+            queue->head = (queue->head + 1) & (queue->capacity - 1);
+            queue->count--;
+        }
+    }
+    queue->head = 0;
+    return 0;
+}
+
+
+void out_queue_free(OutQueue *queue)
+{
+    for (size_t i = 0; i < queue->count; i++) {
+        message_unref(
+                queue->chunks[(queue->head + i) & (queue->capacity - 1)].message);
+    }
+    free(queue->chunks);
+    queue->chunks = NULL;
+    queue->capacity = 0;
+    queue->head = 0;
+    queue->count = 0;
+    queue->bytes = 0;
+}
@@ -0,0 +1,74 @@
+#ifndef _OUT_QUEUE_H_
+#define _OUT_QUEUE_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#define OUT_QUEUE_INITIAL_CAPACITY 16
+// Most chunks handed to one sendmsg() call
+#define OUT_QUEUE_MAX_IOV 64
+
+// Text formatted once and shared by every player it is sent to. It is
+// freed when the last queue holding it is done with it.
+typedef struct Message {
+    int refs;
+    size_t len;
+    size_t capacity; // bytes allocated for data
+    char data[];
+} Message;
+
+// A message, or the part of it the socket didn't take yet
+typedef struct OutChunk {
+    Message *message;
+    size_t offset; // bytes of the message already sent
+} OutChunk;
+
+// Output waiting to be sent to a player: a ring buffer of chunks that grows
+// (doubling) when full
+typedef struct OutQueue {
+    OutChunk *chunks;
+    size_t capacity; // always a power of two, 0 before the first push
+    size_t head;     // index of the first chunk
+    size_t count;    // number of queued chunks
+    size_t bytes;    // number of unsent bytes in all the chunks
+} OutQueue;
+
+/**
+ * Append formatted text to a message nobody holds yet. The message is
+ * allocated (with one reference, owned by the caller) if *message is NULL,
+ * and grown as needed.
+ * @return 0 on success, -1 in case of allocation error.
+ */
+int message_vappend(Message **message, const char *format, va_list args);
+
+/**
+ * Drop a reference to the message, freeing it with the last one.
+ */
+void message_unref(Message *message);
+
+/**
+ * Append the unsent part of a message to the end of the queue. The queue
+ * takes its own reference to the message.
+ * @param queue
+ * @param message
+ * @param offset bytes of the message already sent
+ * @return 0 on success, -1 in case of allocation error.
+ */
+int out_queue_push(OutQueue *queue, Message *message, size_t offset);
+
+/**
+ * Send as much of the queue as the non blocking socket accepts, many
+ * chunks per call.
+ * @param queue
+ * @param fd the socket of the player
+ * @return 0 if the queue was sent or the socket is full, -1 if the
+ * connection failed.
+ */
+int out_queue_flush(OutQueue *queue, int fd);
+
+/**
+ * Release all the queued messages and the queue itself.
+ */
+void out_queue_free(OutQueue *queue);
+
+#endif /* _OUT_QUEUE_H_ */
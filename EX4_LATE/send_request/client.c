@@ -2,6 +2,7 @@
 // Created by Rani Abu Raia on 05/02/2025.
 //
 
+#include "load_generator.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,7 @@
 #include <signal.h>
 
 #define BUFFER_SIZE 256
+#define USAGE "Usage: ./client [-l players [-g guesses-per-second] [-s binary|random] [-d seconds]] <server-ip> <port>\n"
 
 int client_socket;
 
@@ -26,8 +28,31 @@ void handle_signal1(int signo) {
 }
 
 int main(int argc, char *argv[]) {
+    // Options before the other arguments. "-l" runs headless players to load
+    // the server instead of playing from stdin.
+    LoadOptions load = {0, 0, STRATEGY_BINARY, 10, 1};
+    while (argc > 3 && argv[1][0] == '-') {
+        const char *value = argv[2];
+        if (strcmp(argv[1], "-l") == 0 && atoi(value) > 0) {
+            load.connections = atoi(value);
+        } else if (strcmp(argv[1], "-g") == 0 && atof(value) >= 0) {
+            load.guesses_per_second = atof(value);
+        } else if (strcmp(argv[1], "-s") == 0 && strcmp(value, "binary") == 0) {
+            load.strategy = STRATEGY_BINARY;
+        } else if (strcmp(argv[1], "-s") == 0 && strcmp(value, "random") == 0) {
+            load.strategy = STRATEGY_RANDOM;
+        } else if (strcmp(argv[1], "-d") == 0 && atoi(value) > 0) {
+            load.duration = atoi(value);
+        } else {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
     if (argc != 3) {
-        fprintf(stderr, "Usage: ./client <server-ip> <port>\n");
+        fprintf(stderr, USAGE);
         exit(1);
     }
 
@@ -39,6 +64,10 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    if (load.connections > 0) {
+        return run_load(server_ip, port, &load);
+    }
+
     signal(SIGINT, handle_signal1);
 
     struct sockaddr_in server_addr;
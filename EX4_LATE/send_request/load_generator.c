@@ -0,0 +1,487 @@
+#define _POSIX_C_SOURCE 200809L
+#include "load_generator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define BOT_BUFFER_SIZE 1024
+#define MAX_EVENTS 256
+#define MIN_NUMBER 1
+#define MAX_NUMBER 100
+#define NS_PER_SECOND 1000000000ULL
+// How long to wait for events when no guess is due
+#define IDLE_TIMEOUT_MS 100
+
+typedef enum BotState {
+    BOT_CONNECTING, // connect() in progress
+    BOT_JOINING,    // waiting for the welcome message
+    BOT_PLAYING
+} BotState;
+
+// One player of the load
+typedef struct Bot {
+    int fd;
+    BotState state;
+    int id;            // given by the server
+    int low, high;     // the number is known to be in [low, high]
+    int guess;         // the guess waiting for its answer, 0 if none
+    int last_guesser;  // the player the next feedback line is about
+    int queue_slot;    // its place in the send queue, -1 if not in it
+    uint64_t start;    // when the join or the guess started
+    char in[BOT_BUFFER_SIZE];
+    size_t in_len;
+} Bot;
+
+// Latencies in microseconds
+typedef struct Samples {
+    uint32_t *values;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+// Bots waiting to send their next guess, a min-heap by due time. Every bot
+// is in it at most once. A bot that joins is due at once, ahead of bots
+// scheduled an interval after their answer.
+typedef struct SendQueue {
+    int *bots;
+    uint64_t *due;
+    size_t count;
+} SendQueue;
+
+typedef struct LoadRun {
+    const LoadOptions *options;
+    struct sockaddr_in server_addr;
+    int epoll_fd;
+    Bot *bots;
+    SendQueue queue;
+    uint64_t interval; // between an answer and the next guess of a bot
+    uint64_t rng;
+    Samples joins;
+    Samples round_trips;
+    long games_won;
+    long errors;
+} LoadRun;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SECOND + (uint64_t) ts.tv_nsec;
+}
+
+
+// xorshift64*
+static uint32_t next_random(LoadRun *run)
+{
+    run->rng ^= run->rng >> 12;
+    run->rng ^= run->rng << 25;
+    run->rng ^= run->rng >> 27;
+    return (uint32_t) ((run->rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+
+static void add_sample(Samples *samples, uint64_t start, uint64_t end)
+{
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 4096;
+        uint32_t *values = realloc(samples->values,
+                                   capacity * sizeof(uint32_t));
+        if (!values) {
+            return;
+        }
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    uint64_t micros = (end - start) / 1000;
+    samples->values[samples->count++] =
+            micros > UINT32_MAX ? UINT32_MAX : (uint32_t) micros;
+}
+
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint32_t first = *(const uint32_t *) a, second = *(const uint32_t *) b;
+    return (first > second) - (first < second);
+}
+
+
+static double percentile_ms(const Samples *samples, double percent)
+{
+    size_t rank = (size_t) (percent / 100.0 * (double) samples->count);
+    if (rank >= samples->count) {
+        rank = samples->count - 1;
+    }
+    return samples->values[rank] / 1000.0;
+}
+
+
+static void print_samples(const char *name, Samples *samples)
+{
+    if (samples->count == 0) {
+        printf("%-12s no samples\n", name);
+        return;
+    }
+    qsort(samples->values, samples->count, sizeof(uint32_t), compare_samples);
+    printf("%-12s p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, "
+           "max %.3f ms\n", name,
+           percentile_ms(samples, 50), percentile_ms(samples, 90),
+           percentile_ms(samples, 99), percentile_ms(samples, 99.9),
+           samples->values[samples->count - 1] / 1000.0);
+}
+
+
+static void place_in_queue(LoadRun *run, size_t slot, int index, uint64_t due)
+{
+    run->queue.bots[slot] = index;
+    run->queue.due[slot] = due;
+    run->bots[index].queue_slot = (int) slot;
+}
+
+
+// Move the entry at slot up while it is due before its parent
+static void sift_up(LoadRun *run, size_t slot)
+{
+    SendQueue *queue = &run->queue;
+    int index = queue->bots[slot];
+    uint64_t due = queue->due[slot];
+    while (slot > 0 && queue->due[(slot - 1) / 2] > due) {
+        size_t parent = (slot - 1) / 2;
+        place_in_queue(run, slot, queue->bots[parent], queue->due[parent]);
+        slot = parent;
+    }
+    place_in_queue(run, slot, index, due);
+}
+
+
+// Move the entry at slot down while one of its children is due before it
+static void sift_down(LoadRun *run, size_t slot)
+{
+    SendQueue *queue = &run->queue;
+    int index = queue->bots[slot];
+    uint64_t due = queue->due[slot];
+    for (;;) {
+        size_t child = 2 * slot + 1;
+        if (child >= queue->count) {
+            break;
+        }
+        if (child + 1 < queue->count && queue->due[child + 1] < queue->due[child]) {
+            child++;
+        }
+        if (queue->due[child] >= due) {
+            break;
+        }
+        place_in_queue(run, slot, queue->bots[child], queue->due[child]);
+        slot = child;
+    }
+    place_in_queue(run, slot, index, due);
+}
+
+
+static void schedule_guess(LoadRun *run, int index, uint64_t due)
+{
+    SendQueue *queue = &run->queue;
+    int slot = run->bots[index].queue_slot;
+    if (slot >= 0) {
+        // Already waiting: only ever moved earlier
+        if (due < queue->due[slot]) {
+            queue->due[slot] = due;
+            sift_up(run, (size_t) slot);
+        }
+        return;
+    }
+    place_in_queue(run, queue->count++, index, due);
+    sift_up(run, queue->count - 1);
+}
+
+
+// Take the bot due first out of the send queue
+static int pop_guess(LoadRun *run)
+{
+    SendQueue *queue = &run->queue;
+    int index = queue->bots[0];
+    run->bots[index].queue_slot = -1;
+    if (--queue->count > 0) {
+        place_in_queue(run, 0, queue->bots[queue->count], queue->due[queue->count]);
+        sift_down(run, 0);
+    }
+    return index;
+}
+
+
+static void start_bot(LoadRun *run, int index);
+
+
+// Close the connection of a bot and join again with a new one
+static void restart_bot(LoadRun *run, int index)
+{
+    close(run->bots[index].fd);
+    start_bot(run, index);
+}
+
+
+static void start_bot(LoadRun *run, int index)
+{
+    Bot *bot = &run->bots[index];
+    bot->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (bot->fd < 0) {
+        perror("Socket error");
+        exit(1);
+    }
+    int flags = fcntl(bot->fd, F_GETFL, 0);
+    fcntl(bot->fd, F_SETFL, flags | O_NONBLOCK);
+    // Guesses are tiny and each one waits for its answer
+    int one = 1;
+    setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    bot->state = BOT_CONNECTING;
+    bot->guess = 0;
+    bot->in_len = 0;
+    bot->start = now_ns();
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT,
+                                .data.u32 = (uint32_t) index};
+    if (connect(bot->fd, (struct sockaddr *) &run->server_addr,
+                sizeof(run->server_addr)) == 0) {
+        bot->state = BOT_JOINING;
+        event.events = EPOLLIN;
+    } else if (errno != EINPROGRESS) {
+        perror("Connection failed");
+        exit(1);
+    }
+    if (epoll_ctl(run->epoll_fd, EPOLL_CTL_ADD, bot->fd, &event) < 0) {
+        perror("Epoll error");
+        exit(1);
+    }
+}
+
+
+static void send_guess(LoadRun *run, int index)
+{
+    Bot *bot = &run->bots[index];
+    if (bot->low > bot->high) {
+        // Joined in the middle of a game: the number may be anywhere
+        bot->low = MIN_NUMBER;
+        bot->high = MAX_NUMBER;
+    }
+    int guess = bot->low + (bot->high - bot->low) / 2;
+    if (run->options->strategy == STRATEGY_RANDOM) {
+        guess = bot->low +
+                (int) (next_random(run) % (uint32_t) (bot->high - bot->low + 1));
+    }
+    char line[16];
+    int len = snprintf(line, sizeof(line), "%d\n", guess);
+    bot->start = now_ns();
+    if (send(bot->fd, line, (size_t) len, MSG_NOSIGNAL) != len) {
+        run->errors++;
+        restart_bot(run, index);
+        return;
+    }
+    bot->guess = guess;
+}
+
+
+// The answer to the guess of a bot arrived
+static void guess_answered(LoadRun *run, int index, uint64_t now)
+{
+    Bot *bot = &run->bots[index];
+    add_sample(&run->round_trips, bot->start, now);
+    bot->guess = 0;
+    schedule_guess(run, index, now + run->interval);
+}
+
+
+static void handle_line(LoadRun *run, int index, const char *line,
+                        uint64_t now)
+{
+    Bot *bot = &run->bots[index];
+    int id, number;
+    if (sscanf(line, "Welcome to the game, your id is %d", &id) == 1) {
+        add_sample(&run->joins, bot->start, now);
+        bot->id = id;
+        bot->state = BOT_PLAYING;
+        bot->low = MIN_NUMBER;
+        bot->high = MAX_NUMBER;
+        schedule_guess(run, index, now);
+    } else if (sscanf(line, "Player %d guessed %d", &id, &number) == 2) {
+        bot->last_guesser = id;
+    } else if (sscanf(line, "The guess %d is too", &number) == 1) {
+        // Every guess in the room narrows the range, not only ours
+        if (strstr(line, "too low") != NULL && number >= bot->low) {
+            bot->low = number + 1;
+        } else if (strstr(line, "too high") != NULL && number <= bot->high) {
+            bot->high = number - 1;
+        }
+        if (bot->last_guesser == bot->id && bot->guess == number) {
+            guess_answered(run, index, now);
+        }
+    } else if (sscanf(line, "Player %d wins!", &id) == 1) {
+        if (id == bot->id) {
+            run->games_won++;
+            if (bot->guess != 0) {
+                add_sample(&run->round_trips, bot->start, now);
+                bot->guess = 0;
+            }
+        }
+        // The server closes the connection of everyone in the room
+    }
+}
+
+
+static void handle_bot_event(LoadRun *run, int index, uint32_t events)
+{
+    Bot *bot = &run->bots[index];
+    if (bot->state == BOT_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(bot->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            run->errors++;
+            restart_bot(run, index);
+            return;
+        }
+        bot->state = BOT_JOINING;
+        struct epoll_event event = {.events = EPOLLIN,
+                                    .data.u32 = (uint32_t) index};
+        epoll_ctl(run->epoll_fd, EPOLL_CTL_MOD, bot->fd, &event);
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+
+    ssize_t bytes_read = recv(bot->fd, bot->in + bot->in_len,
+                              sizeof(bot->in) - bot->in_len, 0);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        // The game is over: join a new one. The connection may be reset
+        // when the server closed it with guesses still unread.
+        if (bot->state != BOT_PLAYING) {
+            run->errors++;
+        }
+        restart_bot(run, index);
+        return;
+    }
+
+    uint64_t now = now_ns();
+    char *start = bot->in;
+    char *end = bot->in + bot->in_len + bytes_read;
+    char *newline;
+    while ((newline = memchr(start, '\n', (size_t) (end - start))) != NULL) {
+        *newline = '\0';
+        handle_line(run, index, start, now);
+        start = newline + 1;
+    }
+    bot->in_len = (size_t) (end - start);
+    if (bot->in_len == sizeof(bot->in)) {
+        bot->in_len = 0; // not the game protocol, drop it
+    }
+    memmove(bot->in, start, bot->in_len);
+}
+
+
+// Send the guesses that are due
+static void send_due_guesses(LoadRun *run, uint64_t now)
+{
+    SendQueue *queue = &run->queue;
+    while (queue->count > 0 && queue->due[0] <= now) {
+        int index = pop_guess(run);
+        Bot *bot = &run->bots[index];
+        // The bot may be joining a new game since it was scheduled
+        if (bot->state == BOT_PLAYING && bot->guess == 0) {
+            send_guess(run, index);
+        }
+    }
+}
+
+
+int run_load(const char *server_ip, int port, const LoadOptions *options)
+{
+    LoadRun run;
+    memset(&run, 0, sizeof(run));
+    run.options = options;
+    run.server_addr.sin_family = AF_INET;
+    run.server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &run.server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid address\n");
+        return 1;
+    }
+    run.interval = options->guesses_per_second > 0 ?
+                   (uint64_t) (NS_PER_SECOND / options->guesses_per_second) : 0;
+    run.rng = options->seed ? options->seed : 1;
+
+    size_t count = (size_t) options->connections;
+    run.bots = calloc(count, sizeof(Bot));
+    run.queue.bots = malloc(count * sizeof(int));
+    run.queue.due = malloc(count * sizeof(uint64_t));
+    run.epoll_fd = epoll_create1(0);
+    if (!run.bots || !run.queue.bots || !run.queue.due || run.epoll_fd < 0) {
+        fprintf(stderr, "Failed to set up the load\n");
+        free(run.bots);
+        free(run.queue.bots);
+        free(run.queue.due);
+        return 1;
+    }
+
+    uint64_t begin = now_ns();
+    uint64_t end = begin + (uint64_t) options->duration * NS_PER_SECOND;
+    for (int i = 0; i < options->connections; i++) {
+        run.bots[i].queue_slot = -1;
+        start_bot(&run, i);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t now = begin;
+    while (now < end) {
+        uint64_t wake = end;
+        if (run.queue.count > 0 && run.queue.due[0] < wake) {
+            wake = run.queue.due[0];
+        }
+        int timeout = wake <= now ? 0 : (int) ((wake - now + 999999) / 1000000);
+        if (timeout > IDLE_TIMEOUT_MS) {
+            timeout = IDLE_TIMEOUT_MS;
+        }
+        int num_events = epoll_wait(run.epoll_fd, events, MAX_EVENTS, timeout);
+        if (num_events < 0 && errno != EINTR) {
+            perror("Epoll error");
+            break;
+        }
+        for (int i = 0; i < num_events; i++) {
+            handle_bot_event(&run, (int) events[i].data.u32, events[i].events);
+        }
+        now = now_ns();
+        send_due_guesses(&run, now);
+    }
+    double seconds = (double) (now - begin) / NS_PER_SECOND;
+
+    printf("Players:     %d for %.1f s\n", options->connections, seconds);
+    printf("Joins:       %zu (%.0f/s)\n", run.joins.count,
+           run.joins.count / seconds);
+    print_samples("Join", &run.joins);
+    printf("Guesses:     %zu (%.0f/s)\n", run.round_trips.count,
+           run.round_trips.count / seconds);
+    print_samples("Round trip", &run.round_trips);
+    printf("Games won:   %ld\n", run.games_won);
+    printf("Errors:      %ld\n", run.errors);
+
+    for (int i = 0; i < options->connections; i++) {
+        close(run.bots[i].fd);
+    }
+    close(run.epoll_fd);
+    free(run.bots);
+    free(run.queue.bots);
+    free(run.queue.due);
+    free(run.joins.values);
+    free(run.round_trips.values);
+    return 0;
+}
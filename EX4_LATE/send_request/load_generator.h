@@ -0,0 +1,29 @@
+#ifndef _LOAD_GENERATOR_H_
+#define _LOAD_GENERATOR_H_
+
+typedef enum GuessStrategy {
+    STRATEGY_BINARY, // halve the range the number is known to be in
+    STRATEGY_RANDOM  // any number in that range
+} GuessStrategy;
+
+typedef struct LoadOptions {
+    int connections;           // players connected at the same time
+    double guesses_per_second; // per player, 0 to guess as soon as answered
+    GuessStrategy strategy;
+    int duration;              // seconds
+    unsigned int seed;
+} LoadOptions;
+
+/**
+ * Play the game with many players from one thread and print the join
+ * latency, the round trip latency of guesses and the throughput. A player
+ * has at most one guess waiting for an answer, and joins again when its
+ * game ends.
+ * @param server_ip
+ * @param port
+ * @param options
+ * @return 0 on success, 1 if the run could not start.
+ */
+int run_load(const char *server_ip, int port, const LoadOptions *options);
+
+#endif /* _LOAD_GENERATOR_H_ */
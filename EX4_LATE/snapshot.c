@@ -0,0 +1,134 @@
+#include "snapshot.h"
+#include "matchmaker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_PATH_SIZE 4096
+
+// File layout, in host byte order (the snapshot is read back by the same
+// server on the same machine): a header, then for every room a SnapshotRoom
+// followed by num_seats SnapshotSeat
+typedef struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t players_per_room;
+    uint32_t num_rooms;
+    uint32_t reserved;
+} SnapshotHeader;
+
+typedef struct SnapshotRoom {
+    uint32_t number;
+    int32_t target_number;
+    uint32_t ticks_left;
+    uint32_t num_seats;
+} SnapshotRoom;
+
+typedef struct SnapshotSeat {
+    uint64_t token;
+    uint32_t id;
+    uint32_t reserved;
+} SnapshotSeat;
+
+
+static int write_room(FILE *fp, Room *room, int players_per_room,
+                      const TimerWheel *timers)
+{
+    SnapshotRoom record = {(uint32_t) room->number, room->target_number, 0,
+                           (uint32_t) room->num_players};
+    if (room->round_timer.pending) {
+        record.ticks_left = (uint32_t) (room->round_timer.expires - timers->now);
+    }
+    if (fwrite(&record, sizeof(record), 1, fp) != 1) {
+        return -1;
+    }
+    for (int i = 0; i < players_per_room; i++) {
+        Player *player = room->seats[i];
+        if (player != NULL) {
+            SnapshotSeat seat = {player->token, (uint32_t) player->id, 0};
+            if (fwrite(&seat, sizeof(seat), 1, fp) != 1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+int save_snapshot(const char *path, int players_per_room,
+                  const TimerWheel *timers)
+{
+    char temp_path[SNAPSHOT_PATH_SIZE];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >=
+        (int) sizeof(temp_path)) {
+        return -1;
+    }
+    FILE *fp = fopen(temp_path, "wb");
+    if (!fp) {
+        return -1;
+    }
+
+    SnapshotHeader header = {SNAPSHOT_MAGIC, (uint32_t) players_per_room, 0, 0};
+    int opened = rooms_opened();
+    for (int i = 0; i < opened; i++) {
+        if (get_room(i)->num_players > 0) {
+            header.num_rooms++;
+        }
+    }
+    int result = fwrite(&header, sizeof(header), 1, fp) == 1 ? 0 : -1;
+    for (int i = 0; i < opened && result == 0; i++) {
+        Room *room = get_room(i);
+        if (room->num_players > 0) {
+            result = write_room(fp, room, players_per_room, timers);
+        }
+    }
+
+    if (fclose(fp) != 0 || result != 0) {
+        remove(temp_path);
+        return -1;
+    }
+    return rename(temp_path, path) == 0 ? 0 : -1;
+}
+
+
+int load_snapshot(const char *path, int players_per_room,
+                  RoomRestored room_restored, SeatRestored seat_restored)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+    SnapshotHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != SNAPSHOT_MAGIC ||
+        header.players_per_room != (uint32_t) players_per_room) {
+        fclose(fp);
+        return -1;
+    }
+
+    int seats = 0;
+    for (uint32_t i = 0; i < header.num_rooms; i++) {
+        SnapshotRoom record;
+        if (fread(&record, sizeof(record), 1, fp) != 1 ||
+            record.num_seats == 0 ||
+            record.num_seats > (uint32_t) players_per_room) {
+            break;
+        }
+        Room *room = restore_room((int) record.number, record.target_number);
+        if (room == NULL) {
+            break;
+        }
+        for (uint32_t j = 0; j < record.num_seats; j++) {
+            SnapshotSeat seat;
+            if (fread(&seat, sizeof(seat), 1, fp) != 1 || seat.id == 0 ||
+                seat.id > (uint32_t) players_per_room ||
+                room->seats[seat.id - 1] != NULL) {
+                break;
+            }
+            seat_restored(room, (int) seat.id, seat.token);
+            seats++;
+        }
+        room_restored(room, record.ticks_left);
+    }
+    fclose(fp);
+    return seats;
+}
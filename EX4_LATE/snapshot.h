@@ -0,0 +1,39 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "gameServer.h"
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC 0x31535347u // "GSS1"
+
+// Called for every room of a snapshot being loaded, with the room already
+// restored and the round time it had left (0 for an untimed round)
+typedef void (*RoomRestored)(Room *room, uint64_t ticks_left);
+// Called for every seat of a room of a snapshot being loaded
+typedef void (*SeatRestored)(Room *room, int id, uint64_t token);
+
+/**
+ * Write the rooms that have players, and the token of each player, to a
+ * compact binary file. The file is written next to path and renamed over
+ * it, so a crash never leaves a partial snapshot behind.
+ * @param path
+ * @param players_per_room
+ * @param timers the wheel of the round timers
+ * @return 0 on success, -1 in case of write error.
+ */
+int save_snapshot(const char *path, int players_per_room,
+                  const TimerWheel *timers);
+
+/**
+ * Restore the rooms of a snapshot.
+ * @param path
+ * @param players_per_room must be the same as when the snapshot was saved
+ * @param room_restored
+ * @param seat_restored
+ * @return the number of seats restored, -1 if the file is missing,
+ * corrupt or doesn't match players_per_room.
+ */
+int load_snapshot(const char *path, int players_per_room,
+                  RoomRestored room_restored, SeatRestored seat_restored);
+
+#endif /* _SNAPSHOT_H_ */
@@ -0,0 +1,186 @@
+#define _POSIX_C_SOURCE 200809L
+#include "timer_wheel.h"
+#include <time.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+
+uint64_t timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ms = (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+    return ms / TIMER_TICK_MS;
+}
+
+
+static void init_list(Timer *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+
+void init_timer_wheel(TimerWheel *wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            init_list(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+
+void init_timer(Timer *timer, TimerCallback callback)
+{
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->pending = 0;
+}
+
+
+// Put a timer in the slot of its expiry tick, at the lowest level that
+// reaches it
+static void insert_timer(TimerWheel *wheel, Timer *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >> (TIMER_WHEEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+    if (level == TIMER_WHEEL_LEVELS - 1 &&
+        delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS) != 0) {
+        // Beyond the last level: wait as long as the wheel can
+        timer->expires = wheel->now +
+                         ((uint64_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+    Timer *head = &wheel->slots[level][
+            (timer->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+
+static void unlink_timer(Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t ticks)
+{
+    timer_cancel(wheel, timer);
+    // A timer due now runs on the next tick
+    timer->expires = wheel->now + (ticks ? ticks : 1);
+    timer->pending = 1;
+    wheel->count++;
+    insert_timer(wheel, timer);
+}
+
+
+void timer_cancel(TimerWheel *wheel, Timer *timer)
+{
+    if (!timer->pending) {
+        return;
+    }
+    unlink_timer(timer);
+    timer->pending = 0;
+    wheel->count--;
+}
+
+
+// Move the timers of a slot of an upper level to the levels below it
+static void cascade(TimerWheel *wheel, int level, int slot)
+{
+    Timer *head = &wheel->slots[level][slot];
+    Timer list;
+    if (head->next == head) {
+        return;
+    }
+    // Detach the slot first, the timers may go back to the same level
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    init_list(head);
+    while (list.next != &list) {
+        Timer *timer = list.next;
+        unlink_timer(timer);
+        insert_timer(wheel, timer);
+    }
+}
+
+
+// Run the timers of the level 0 slot of the current tick
+static void run_slot(TimerWheel *wheel)
+{
+    Timer *head = &wheel->slots[0][wheel->now & SLOT_MASK];
+    Timer list;
+    if (head->next == head) {
+        return;
+    }
+    // Callbacks may cancel timers of this slot, so they are taken out of
+    // the wheel one at a time
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    init_list(head);
+    while (list.next != &list) {
+        Timer *timer = list.next;
+        unlink_timer(timer);
+        timer->pending = 0;
+        wheel->count--;
+        timer->callback(timer);
+    }
+}
+
+
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+        if (wheel->count == 0) {
+            wheel->now = now; // nothing to run on the way
+            return;
+        }
+        wheel->now++;
+        // When a level wraps around, the next slot of the level above moves
+        // down
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            uint64_t below = wheel->now >> (TIMER_WHEEL_BITS * (level - 1));
+            if ((below & SLOT_MASK) != 0) {
+                break;
+            }
+            cascade(wheel, level,
+                    (int) ((wheel->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK));
+        }
+        run_slot(wheel);
+    }
+}
+
+
+int timer_wheel_timeout(const TimerWheel *wheel)
+{
+    if (wheel->count == 0) {
+        return -1;
+    }
+    // The next non empty slot of level 0 in this turn, or else the end of
+    // the turn, where upper levels cascade
+    uint64_t tick = wheel->now + 1;
+    do {
+        const Timer *head = &wheel->slots[0][tick & SLOT_MASK];
+        if (head->next != head) {
+            break;
+        }
+        tick++;
+    } while ((tick & SLOT_MASK) != 0);
+    return (int) ((tick - wheel->now) * TIMER_TICK_MS);
+}
@@ -0,0 +1,72 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+// 4 levels of 64 slots reach 2^24 ticks, about 19 days
+#define TIMER_WHEEL_LEVELS 4
+
+// The struct that has member embedded in it, given a pointer to the member
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+typedef struct Timer Timer;
+typedef void (*TimerCallback)(Timer *timer);
+
+// A timer is embedded in the object it belongs to, so adding and canceling
+// it never allocates
+struct Timer {
+    Timer *next;
+    Timer *prev;
+    uint64_t expires;   // tick
+    TimerCallback callback;
+    int pending;        // 1 while in the wheel
+};
+
+// Hierarchical timer wheel: level 0 has a slot per tick, and every slot of
+// level n covers a whole turn of level n - 1. Timers of an upper level slot
+// move down a level when the lower level wraps around to it.
+typedef struct TimerWheel {
+    uint64_t now;       // current tick
+    size_t count;       // number of pending timers
+    Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // list heads
+} TimerWheel;
+
+/**
+ * Get the current tick of the monotonic clock.
+ */
+uint64_t timer_now(void);
+
+void init_timer_wheel(TimerWheel *wheel, uint64_t now);
+
+void init_timer(Timer *timer, TimerCallback callback);
+
+/**
+ * Schedule a timer ticks from now. A pending timer is moved. Takes O(1).
+ */
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t ticks);
+
+/**
+ * Cancel a timer. Does nothing if it isn't pending. Takes O(1).
+ */
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+
+/**
+ * Run the callbacks of the timers that expired up to now. Callbacks may add
+ * and cancel timers.
+ * @param wheel
+ * @param now the current tick
+ */
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now);
+
+/**
+ * Get how long to wait for the next timer.
+ * @return the timeout in milliseconds, -1 if no timer is pending.
+ */
+int timer_wheel_timeout(const TimerWheel *wheel);
+
+#endif /* _TIMER_WHEEL_H_ */
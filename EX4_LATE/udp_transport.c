@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include "udp_transport.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// A session id is its slot in the session table, tagged with a counter so
+// the id of a closed session doesn't match the next one in the same slot
+#define SESSION_SLOT_BITS 20
+#define MAX_SESSIONS (1u << SESSION_SLOT_BITS)
+#define SESSION_TAG_MASK ((1u << (32 - SESSION_SLOT_BITS)) - 1)
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+
+static int udp_socket = -1;
+static TimerWheel *wheel;
+static UdpJoined on_joined;
+static UdpReceived on_received;
+static UdpLost on_lost;
+
+static UdpSession **sessions = NULL;
+static uint32_t sessions_capacity = 0;
+static uint32_t sessions_used = 0; // slots ever used
+static uint32_t *free_slots = NULL;
+static uint32_t num_free_slots = 0;
+static uint32_t next_tag = 0;
+
+// Sessions by peer address, to tell a repeated UDP_HELLO from a new peer.
+// Open addressing with linear probing.
+static UdpSession **by_addr = NULL;
+static size_t by_addr_capacity = 0; // a power of two
+static size_t by_addr_count = 0;
+
+// Datagrams waiting for the next sendmmsg()
+static struct mmsghdr out_msgs[UDP_BATCH_SIZE];
+static struct iovec out_iov[UDP_BATCH_SIZE][2];
+static UdpHeader out_headers[UDP_BATCH_SIZE];
+static struct sockaddr_in out_addrs[UDP_BATCH_SIZE];
+static Message *out_messages[UDP_BATCH_SIZE];
+static int num_out = 0;
+
+
+static size_t addr_hash(const struct sockaddr_in *addr)
+{
+    uint64_t x = ((uint64_t) addr->sin_addr.s_addr << 16) | addr->sin_port;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (size_t) x;
+}
+
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+           a->sin_port == b->sin_port;
+}
+
+
+// The slot of the session of addr, or the empty slot where it would go
+static size_t find_addr_slot(UdpSession **table, size_t capacity,
+                             const struct sockaddr_in *addr)
+{
+    size_t mask = capacity - 1;
+    size_t i = addr_hash(addr) & mask;
+    while (table[i] != NULL && !same_addr(&table[i]->addr, addr)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+
+static UdpSession *find_by_addr(const struct sockaddr_in *addr)
+{
+    if (by_addr_capacity == 0) {
+        return NULL;
+    }
+    return by_addr[find_addr_slot(by_addr, by_addr_capacity, addr)];
+}
+
+
+static int add_by_addr(UdpSession *session)
+{
+    if ((by_addr_count + 1) * 2 > by_addr_capacity) {
+        size_t capacity = by_addr_capacity ? by_addr_capacity * 2 : 64;
+        UdpSession **table = calloc(capacity, sizeof(UdpSession *));
+        if (!table) {
+            return -1;
+        }
+        for (size_t i = 0; i < by_addr_capacity; i++) {
+            if (by_addr[i] != NULL) {
+                table[find_addr_slot(table, capacity, &by_addr[i]->addr)] =
+                        by_addr[i];
+            }
+        }
+        free(by_addr);
+        by_addr = table;
+        by_addr_capacity = capacity;
+    }
+    by_addr[find_addr_slot(by_addr, by_addr_capacity, &session->addr)] =
+            session;
+    by_addr_count++;
+    return 0;
+}
+
+
+// Remove a session from the address table if it is there, moving back the
+// entries that probed past its slot
+static void remove_by_addr(UdpSession *session)
+{
+    if (by_addr_capacity == 0) {
+        return;
+    }
+    size_t mask = by_addr_capacity - 1;
+    size_t i = find_addr_slot(by_addr, by_addr_capacity, &session->addr);
+    if (by_addr[i] != session) {
+        return;
+    }
+    by_addr[i] = NULL;
+    by_addr_count--;
+    for (size_t j = (i + 1) & mask; by_addr[j] != NULL; j = (j + 1) & mask) {
+        size_t home = addr_hash(&by_addr[j]->addr) & mask;
+        // Move the entry to the hole unless its home lies between them
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            by_addr[i] = by_addr[j];
+            by_addr[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+
+static void retransmit(Timer *timer);
+
+
+static UdpSession *new_session(const struct sockaddr_in *addr)
+{
+    uint32_t slot;
+    if (num_free_slots > 0) {
+        slot = free_slots[--num_free_slots];
+    } else {
+        if (sessions_used == MAX_SESSIONS) {
+            return NULL;
+        }
+        if (sessions_used == sessions_capacity) {
+            uint32_t capacity = sessions_capacity ? sessions_capacity * 2 : 64;
+            UdpSession **table = realloc(sessions,
+                                         capacity * sizeof(UdpSession *));
+            if (!table) {
+                return NULL;
+            }
+            sessions = table;
+            uint32_t *slots = realloc(free_slots, capacity * sizeof(uint32_t));
+            if (!slots) {
+                return NULL;
+            }
+            free_slots = slots;
+            sessions_capacity = capacity;
+        }
+        slot = sessions_used++;
+    }
+
+    UdpSession *session = calloc(1, sizeof(UdpSession));
+    if (session != NULL) {
+        session->addr = *addr;
+    }
+    if (!session || add_by_addr(session) != 0) {
+        free(session);
+        free_slots[num_free_slots++] = slot;
+        return NULL;
+    }
+    next_tag = (next_tag % SESSION_TAG_MASK) + 1;
+    session->id = (next_tag << SESSION_SLOT_BITS) | slot;
+    init_timer(&session->retransmit_timer, retransmit);
+    sessions[slot] = session;
+    return session;
+}
+
+
+static UdpSession *find_session(uint32_t id)
+{
+    uint32_t slot = id & (MAX_SESSIONS - 1);
+    if (slot >= sessions_used || sessions[slot] == NULL ||
+        sessions[slot]->id != id) {
+        return NULL;
+    }
+    return sessions[slot];
+}
+
+
+static void free_session(UdpSession *session)
+{
+    uint32_t slot = session->id & (MAX_SESSIONS - 1);
+    timer_cancel(wheel, &session->retransmit_timer);
+    for (int i = 0; i < session->num_unacked; i++) {
+        message_unref(session->unacked[i].message);
+    }
+    remove_by_addr(session);
+    sessions[slot] = NULL;
+    free_slots[num_free_slots++] = slot;
+    free(session);
+}
+
+
+static void queue_datagram(const UdpSession *session, uint8_t type,
+                           uint32_t seq, Message *message, size_t offset,
+                           size_t len)
+{
+    if (num_out == UDP_BATCH_SIZE) {
+        udp_flush();
+    }
+    int i = num_out++;
+    out_headers[i] = (UdpHeader) {htonl(session->id), htonl(seq), type, {0}};
+    out_addrs[i] = session->addr;
+    out_iov[i][0] = (struct iovec) {&out_headers[i], sizeof(UdpHeader)};
+    out_iov[i][1] = (struct iovec) {message ? message->data + offset : NULL,
+                                    len};
+    memset(&out_msgs[i], 0, sizeof(struct mmsghdr));
+    out_msgs[i].msg_hdr.msg_name = &out_addrs[i];
+    out_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    out_msgs[i].msg_hdr.msg_iov = out_iov[i];
+    out_msgs[i].msg_hdr.msg_iovlen = message ? 2 : 1;
+    out_messages[i] = message;
+    if (message) {
+        message->refs++;
+    }
+}
+
+
+// The peer doesn't acknowledge anymore
+static void give_up(UdpSession *session)
+{
+    for (int i = 0; i < session->num_unacked; i++) {
+        message_unref(session->unacked[i].message);
+    }
+    session->num_unacked = 0;
+    if (session->player != NULL) {
+        on_lost(session);
+    } else {
+        free_session(session);
+    }
+}
+
+
+static void retransmit(Timer *timer)
+{
+    UdpSession *session = container_of(timer, UdpSession, retransmit_timer);
+    if (session->tries == UDP_MAX_TRIES) {
+        give_up(session);
+        return;
+    }
+    session->tries++;
+    for (int i = 0; i < session->num_unacked; i++) {
+        UdpPart *part = &session->unacked[i];
+        queue_datagram(session, UDP_DATA, part->seq, part->message,
+                       part->offset, part->len);
+    }
+    timer_add(wheel, timer, UDP_RETRANSMIT_TICKS);
+}
+
+
+static void handle_ack(UdpSession *session, uint32_t seq)
+{
+    for (int i = 0; i < session->num_unacked; i++) {
+        if (session->unacked[i].seq == seq) {
+            message_unref(session->unacked[i].message);
+            memmove(&session->unacked[i], &session->unacked[i + 1],
+                    (session->num_unacked - i - 1) * sizeof(UdpPart));
+            session->num_unacked--;
+            session->tries = 1;
+            break;
+        }
+    }
+    if (session->num_unacked == 0) {
+        timer_cancel(wheel, &session->retransmit_timer);
+        if (session->player == NULL) {
+            free_session(session);
+        }
+    }
+}
+
+
+static void handle_hello(const struct sockaddr_in *addr)
+{
+    UdpSession *session = find_by_addr(addr);
+    if (session != NULL) {
+        if (session->player != NULL) {
+            return; // a repeated hello, the welcome is on its way
+        }
+        // The last game of the peer is over, it joins a new one
+        remove_by_addr(session);
+    }
+    session = new_session(addr);
+    if (session == NULL) {
+        return;
+    }
+    on_joined(session);
+    if (session->player == NULL && session->num_unacked == 0) {
+        free_session(session);
+    }
+}
+
+
+static void handle_datagram(const struct sockaddr_in *addr, char *data,
+                            size_t len)
+{
+    UdpHeader header;
+    if (len < sizeof(UdpHeader)) {
+        return;
+    }
+    memcpy(&header, data, sizeof(UdpHeader));
+    if (header.type == UDP_HELLO) {
+        handle_hello(addr);
+        return;
+    }
+    UdpSession *session = find_session(ntohl(header.session));
+    if (session == NULL || !same_addr(&session->addr, addr)) {
+        return;
+    }
+    if (header.type == UDP_ACK) {
+        handle_ack(session, ntohl(header.seq));
+    } else if (session->player == NULL) {
+        return;
+    } else if (header.type == UDP_DATA) {
+        on_received(session, data + sizeof(UdpHeader),
+                    len - sizeof(UdpHeader));
+    } else if (header.type == UDP_BYE) {
+        on_lost(session);
+    }
+}
+
+
+int init_udp_transport(int port, TimerWheel *timers, UdpJoined joined,
+                       UdpReceived received, UdpLost lost)
+{
+    struct sockaddr_in addr = {0};
+    udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_socket < 0) {
+        return -1;
+    }
+    // Bursts of datagrams from thousands of players must not overflow the
+    // socket between two loop iterations. The kernel caps these.
+    int size = SOCKET_BUFFER_SIZE;
+    setsockopt(udp_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(udp_socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    int flags = fcntl(udp_socket, F_GETFL, 0);
+    if (bind(udp_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        flags < 0 || fcntl(udp_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(udp_socket);
+        udp_socket = -1;
+        return -1;
+    }
+    wheel = timers;
+    on_joined = joined;
+    on_received = received;
+    on_lost = lost;
+    return udp_socket;
+}
+
+
+void udp_receive(void)
+{
+    static char buffers[UDP_BATCH_SIZE][sizeof(UdpHeader) + UDP_MAX_DATAGRAM];
+    struct sockaddr_in addrs[UDP_BATCH_SIZE];
+    struct iovec iov[UDP_BATCH_SIZE];
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+        iov[i] = (struct iovec) {buffers[i], sizeof(buffers[i])};
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = recvmmsg(udp_socket, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < count; i++) {
+        if (msgs[i].msg_hdr.msg_namelen == sizeof(struct sockaddr_in) &&
+            !(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+            handle_datagram(&addrs[i], buffers[i], msgs[i].msg_len);
+        }
+    }
+}
+
+
+int udp_send(UdpSession *session, Message *message, int reliable)
+{
+    size_t offset = 0;
+    while (offset < message->len) {
+        size_t len = message->len - offset;
+        if (len > UDP_MAX_DATAGRAM) {
+            // Cut after the last whole line that fits
+            char *end = memrchr(message->data + offset, '\n',
+                                UDP_MAX_DATAGRAM);
+            if (end == NULL) {
+                return -1;
+            }
+            len = (size_t) (end + 1 - (message->data + offset));
+        }
+        uint32_t seq = 0;
+        if (reliable) {
+            if (session->num_unacked == UDP_MAX_UNACKED) {
+                return -1;
+            }
+            seq = ++session->next_seq;
+            session->unacked[session->num_unacked++] =
+                    (UdpPart) {message, offset, len, seq};
+            message->refs++;
+            if (!session->retransmit_timer.pending) {
+                session->tries = 1;
+                timer_add(wheel, &session->retransmit_timer,
+                          UDP_RETRANSMIT_TICKS);
+            }
+        }
+        queue_datagram(session, UDP_DATA, seq, message, offset, len);
+        offset += len;
+    }
+    return 0;
+}
+
+
+void udp_flush(void)
+{
+    int sent = 0;
+    while (sent < num_out) {
+        int result = sendmmsg(udp_socket, out_msgs + sent,
+                              (unsigned int) (num_out - sent), 0);
+        if (result > 0) {
+            sent += result;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break; // dropped, as the network could have done
+        } else if (errno != EINTR) {
+            sent++; // skip the datagram the kernel refused
+        }
+    }
+    for (int i = 0; i < num_out; i++) {
+        if (out_messages[i] != NULL) {
+            message_unref(out_messages[i]);
+        }
+    }
+    num_out = 0;
+}
+
+
+void udp_close_session(UdpSession *session)
+{
+    session->player = NULL;
+    if (session->num_unacked == 0) {
+        free_session(session);
+    }
+}
+
+
+void close_udp_transport(void)
+{
+    udp_flush();
+    for (uint32_t slot = 0; slot < sessions_used; slot++) {
+        if (sessions[slot] != NULL) {
+            free_session(sessions[slot]);
+        }
+    }
+    free(sessions);
+    free(free_slots);
+    free(by_addr);
+    sessions = NULL;
+    free_slots = NULL;
+    by_addr = NULL;
+    close(udp_socket);
+    udp_socket = -1;
+}
@@ -0,0 +1,108 @@
+#ifndef _UDP_TRANSPORT_H_
+#define _UDP_TRANSPORT_H_
+
+#include "gameServer.h"
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Datagrams received or sent per recvmmsg()/sendmmsg() call
+#define UDP_BATCH_SIZE 64
+#define UDP_MAX_DATAGRAM 1400
+// Reliable datagrams a session may have waiting for their ACK
+#define UDP_MAX_UNACKED 4
+#define UDP_RETRANSMIT_TICKS 2
+// Sends of a reliable datagram before the peer is given up
+#define UDP_MAX_TRIES 10
+
+// Every datagram starts with this header, in network byte order
+typedef struct UdpHeader {
+    uint32_t session; // 0 in a UDP_HELLO
+    uint32_t seq;     // of a reliable datagram (to ACK), 0 otherwise
+    uint8_t type;
+    uint8_t reserved[3];
+} UdpHeader;
+
+enum {
+    UDP_HELLO = 1, // client: join a game
+    UDP_DATA,      // both ways: lines of text
+    UDP_ACK,       // client: got the reliable datagram seq
+    UDP_BYE        // client: leave the game
+};
+
+// Lines of a message sent in one datagram
+typedef struct UdpPart {
+    Message *message;
+    size_t offset;
+    size_t len;
+    uint32_t seq;
+} UdpPart;
+
+// A player talking to the server through the shared UDP socket
+struct UdpSession {
+    uint32_t id;
+    struct sockaddr_in addr;
+    Player *player;            // NULL once the player left
+    uint32_t next_seq;
+    UdpPart unacked[UDP_MAX_UNACKED];
+    int num_unacked;
+    int tries;                 // sends of the unacked datagrams so far
+    Timer retransmit_timer;
+};
+
+// Called for a new peer. Setting session->player accepts it; a session left
+// without a player is closed.
+typedef void (*UdpJoined)(UdpSession *session);
+// Called with the text of a UDP_DATA datagram of a session with a player
+typedef void (*UdpReceived)(UdpSession *session, const char *data, size_t len);
+// Called when the peer said goodbye, or stopped acknowledging reliable
+// datagrams. The owner must call udp_close_session.
+typedef void (*UdpLost)(UdpSession *session);
+
+/**
+ * Open the UDP socket, non blocking.
+ * @param port
+ * @param timers the wheel running the retransmissions
+ * @param joined
+ * @param received
+ * @param lost
+ * @return the socket, -1 in case of error.
+ */
+int init_udp_transport(int port, TimerWheel *timers, UdpJoined joined,
+                       UdpReceived received, UdpLost lost);
+
+/**
+ * Read the datagrams waiting on the socket, a batch per recvmmsg() call,
+ * and handle them.
+ */
+void udp_receive(void);
+
+/**
+ * Queue a message for a session, split at line ends into datagrams. The
+ * queue takes its own reference and is sent by udp_flush, or when it is
+ * full.
+ * @param session
+ * @param message
+ * @param reliable 1 to resend the message until the peer acknowledges it
+ * @return 0 on success, -1 if the session has too many unacknowledged
+ * datagrams or a line is too long for one.
+ */
+int udp_send(UdpSession *session, Message *message, int reliable);
+
+/**
+ * Send all the queued datagrams, many per sendmmsg() call.
+ */
+void udp_flush(void);
+
+/**
+ * The player of a session left. The session is freed once its reliable
+ * datagrams are acknowledged or given up.
+ */
+void udp_close_session(UdpSession *session);
+
+/**
+ * Free all the sessions and close the socket. The owners of the sessions
+ * must be released by the caller.
+ */
+void close_udp_transport(void);
+
+#endif /* _UDP_TRANSPORT_H_ */